@@ -0,0 +1,332 @@
+// Micro benchmarks of the parser hot paths
+//
+// Every benchmark repeats its body until BENCH_MIN_NS have passed and reports
+// the throughput, the time per object and the allocations per object. Pass a
+// name (or a part of it) to run only the matching benchmarks.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Count every allocation that goes through the DS_* macros
+static unsigned long bench_allocations = 0;
+
+static void *bench_malloc(void *allocator, unsigned long size);
+static void *bench_realloc(void *allocator, void *ptr, unsigned long old_size, unsigned long new_size);
+static void bench_free(void *allocator, void *ptr);
+
+#define DS_MALLOC(a, sz) bench_malloc(a, sz)
+#define DS_REALLOC(a, ptr, old_sz, new_sz) bench_realloc(a, ptr, old_sz, new_sz)
+#define DS_FREE(a, ptr) bench_free(a, ptr)
+#define PDF_IMPLEMENTATION
+#include "pdf.h"
+
+static void *bench_malloc(void *allocator, unsigned long size) {
+    bench_allocations += 1;
+    return ds_allocator_alloc(allocator, size);
+}
+
+static void *bench_realloc(void *allocator, void *ptr, unsigned long old_size, unsigned long new_size) {
+    bench_allocations += 1;
+    return ds_allocator_realloc(allocator, ptr, old_size, new_size);
+}
+
+static void bench_free(void *allocator, void *ptr) {
+    ds_allocator_free(allocator, ptr);
+}
+
+#ifndef BENCH_MIN_NS
+#define BENCH_MIN_NS 500000000ull
+#endif // BENCH_MIN_NS
+
+#define BENCH_DICTIONARIES 100000
+#define BENCH_XREF_ENTRIES 1000000
+#define BENCH_STREAMS 8
+#define BENCH_STREAM_SIZE (4 * 1024 * 1024)
+#define BENCH_CONTENT_SIZE (8 * 1024 * 1024)
+
+typedef struct bench_run {
+    unsigned long long ns;
+    unsigned long bytes;
+    unsigned long objects;
+    unsigned long allocations;
+} bench_run;
+
+static unsigned long long bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void bench_report(const char *name, bench_run *run) {
+    double seconds = run->ns / 1e9;
+    double objects = run->objects != 0 ? run->objects : 1;
+
+    printf("%-20s %10.1f MB/s %12.1f ns/object %8.2f allocs/object\n", name,
+           run->bytes / seconds / (1024.0 * 1024.0), run->ns / objects, run->allocations / objects);
+}
+
+static void bench_parser_init(pdf_parser *parser) {
+    *parser = (pdf_parser){0};
+    pdf_parse_options_init(&parser->options);
+    parser->error = PDF_OK;
+}
+
+// Page like dictionaries with nested dictionaries, arrays and references
+static void bench_dictionaries_input(ds_string_builder *sb) {
+    for (int i = 0; i < BENCH_DICTIONARIES; i++) {
+        ds_string_builder_append(sb,
+                                 "<< /Type /Page /Parent 2 0 R /MediaBox [0 0 612 792] /Rotate 0 "
+                                 "/Resources << /Font << /F1 %d 0 R /F2 %d 0 R >> /ProcSet [/PDF /Text] >> "
+                                 "/Contents %d 0 R /UserUnit 1.5 >>\n", i + 3, i + 4, i + 5);
+    }
+}
+
+static int bench_direct_object(char *input, unsigned long input_len, bench_run *run) {
+    pdf_parser parser;
+    ds_string_slice slice;
+
+    bench_parser_init(&parser);
+    ds_string_slice_init(&slice, input, input_len);
+    ds_string_slice_trim_left_ws(&slice);
+
+    while (!ds_string_slice_empty(&slice)) {
+        object_t object = {0};
+        if (parse_direct_object(&parser, &slice, &object) != 0) {
+            return 1;
+        }
+        object_free(NULL, &object);
+        ds_string_slice_trim_left_ws(&slice);
+        run->objects += 1;
+    }
+
+    run->bytes += input_len;
+    return 0;
+}
+
+static void bench_xref_input(ds_string_builder *sb) {
+    ds_string_builder_append(sb, "xref\n0 %d\n", BENCH_XREF_ENTRIES);
+    ds_string_builder_append(sb, "0000000000 65535 f \n");
+    for (int i = 1; i < BENCH_XREF_ENTRIES; i++) {
+        ds_string_builder_append(sb, "%010d 00000 n \n", i * 97);
+    }
+    ds_string_builder_append(sb, "trailer\n");
+}
+
+static int bench_xref(char *input, unsigned long input_len, bench_run *run) {
+    pdf_parser parser;
+    ds_string_slice slice;
+    xref_t xref = {0};
+
+    bench_parser_init(&parser);
+    ds_string_slice_init(&slice, input, input_len);
+    if (parse_xref(&parser, &slice, &xref) != 0) {
+        return 1;
+    }
+
+    run->objects += xref.entries.count;
+    run->bytes += input_len;
+    ds_dynamic_array_free(&xref.entries);
+    return 0;
+}
+
+// Streams of random bytes that never spell `endstream`
+static void bench_streams_input(ds_string_builder *sb) {
+    unsigned int seed = 42;
+
+    for (int i = 0; i < BENCH_STREAMS; i++) {
+        ds_string_builder_append(sb, "stream\n");
+        for (int j = 0; j < BENCH_STREAM_SIZE; j++) {
+            seed = seed * 1103515245 + 12345;
+            char c = 'a' + (seed >> 16) % 26;
+            ds_string_builder_appendn(sb, c == 'e' ? "x" : &c, 1);
+        }
+        ds_string_builder_append(sb, "\nendstream\n");
+    }
+}
+
+static int bench_stream_object(char *input, unsigned long input_len, bench_run *run) {
+    pdf_parser parser;
+    ds_string_slice slice;
+
+    bench_parser_init(&parser);
+    ds_string_slice_init(&slice, input, input_len);
+    ds_string_slice_trim_left_ws(&slice);
+
+    while (!ds_string_slice_empty(&slice)) {
+        object_t object = {0};
+        if (parse_stream_object(&parser, &slice, &object) != 0) {
+            return 1;
+        }
+        ds_string_slice_trim_left_ws(&slice);
+        run->objects += 1;
+    }
+
+    run->bytes += input_len;
+    return 0;
+}
+
+// A content stream that shows text, one string per line
+static unsigned long bench_content_strings = 0;
+
+static void bench_content_input(ds_string_builder *sb) {
+    for (int i = 0; sb->items.count < BENCH_CONTENT_SIZE; i++) {
+        ds_string_builder_append(sb, "BT /F1 12 Tf 72 %d Td (Line %d of the benchmark content) Tj ET\n", 720 - i % 700, i);
+        bench_content_strings += 1;
+    }
+}
+
+typedef struct bench_flate {
+    ds_string_slice compressed;
+    unsigned long decoded_len; /* 0 when the /DL is not given */
+} bench_flate;
+
+static int bench_flate_decode(bench_flate *flate, bench_run *run) {
+    pdf_parse_options options;
+    char *buffer = NULL;
+    unsigned long buffer_len = 0;
+
+    pdf_parse_options_init(&options);
+    if (pdf_flate_decode(&options, &flate->compressed, flate->decoded_len, &buffer, &buffer_len) != PDF_OK) {
+        return 1;
+    }
+
+    run->objects += 1;
+    run->bytes += buffer_len;
+    DS_FREE(NULL, buffer);
+    return 0;
+}
+
+static int bench_text(char *input, unsigned long input_len, bench_run *run) {
+    ds_string_builder sb;
+
+    ds_string_builder_init(&sb);
+    if (pdf_append_text(&sb, input, input_len) != 0) {
+        return 1;
+    }
+
+    run->objects += bench_content_strings;
+    run->bytes += input_len;
+    ds_string_builder_free(&sb);
+    return 0;
+}
+
+typedef enum bench_kind {
+    bench_kind_direct_object,
+    bench_kind_xref,
+    bench_kind_stream_object,
+    bench_kind_flate,
+    bench_kind_text,
+} bench_kind;
+
+// Repeat a benchmark until it has run for BENCH_MIN_NS
+static int bench_repeat(const char *name, bench_kind kind, char *input, unsigned long input_len, bench_flate *flate) {
+    bench_run run = {0};
+    unsigned long allocations = bench_allocations;
+    unsigned long long start = bench_now_ns();
+    int result = 0;
+
+    while (result == 0 && bench_now_ns() - start < BENCH_MIN_NS) {
+        switch (kind) {
+        case bench_kind_direct_object:
+            result = bench_direct_object(input, input_len, &run);
+            break;
+        case bench_kind_xref:
+            result = bench_xref(input, input_len, &run);
+            break;
+        case bench_kind_stream_object:
+            result = bench_stream_object(input, input_len, &run);
+            break;
+        case bench_kind_flate:
+            result = bench_flate_decode(flate, &run);
+            break;
+        case bench_kind_text:
+            result = bench_text(input, input_len, &run);
+            break;
+        }
+    }
+
+    if (result != 0) {
+        DS_LOG_ERROR("Benchmark %s failed", name);
+        return 1;
+    }
+
+    run.ns = bench_now_ns() - start;
+    run.allocations = bench_allocations - allocations;
+    bench_report(name, &run);
+    return 0;
+}
+
+static int bench_selected(int argc, char **argv, const char *name) {
+    if (argc < 2) {
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (strstr(name, argv[i]) != NULL) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int result = 0;
+    ds_string_builder input = {0};
+    char *compressed = NULL;
+
+    ds_string_builder_init(&input);
+
+    if (bench_selected(argc, argv, "direct_object")) {
+        bench_dictionaries_input(&input);
+        result |= bench_repeat("direct_object", bench_kind_direct_object, input.items.items, input.items.count, NULL);
+        input.items.count = 0;
+    }
+
+    if (bench_selected(argc, argv, "xref")) {
+        bench_xref_input(&input);
+        result |= bench_repeat("xref", bench_kind_xref, input.items.items, input.items.count, NULL);
+        input.items.count = 0;
+    }
+
+    if (bench_selected(argc, argv, "stream_object")) {
+        bench_streams_input(&input);
+        result |= bench_repeat("stream_object", bench_kind_stream_object, input.items.items, input.items.count, NULL);
+        input.items.count = 0;
+    }
+
+    bench_content_input(&input);
+
+    if (bench_selected(argc, argv, "flate_decode") || bench_selected(argc, argv, "flate_decode_dl")) {
+        uLongf compressed_len = compressBound(input.items.count);
+        compressed = malloc(compressed_len);
+        if (compressed == NULL || compress((Bytef *)compressed, &compressed_len, (Bytef *)input.items.items, input.items.count) != Z_OK) {
+            DS_LOG_ERROR("Failed to compress the benchmark content");
+            return_defer(1);
+        }
+
+        bench_flate flate = {0};
+        ds_string_slice_init(&flate.compressed, compressed, compressed_len);
+        if (bench_selected(argc, argv, "flate_decode")) {
+            result |= bench_repeat("flate_decode", bench_kind_flate, NULL, 0, &flate);
+        }
+
+        flate.decoded_len = input.items.count;
+        if (bench_selected(argc, argv, "flate_decode_dl")) {
+            result |= bench_repeat("flate_decode_dl", bench_kind_flate, NULL, 0, &flate);
+        }
+    }
+
+    if (bench_selected(argc, argv, "text")) {
+        result |= bench_repeat("text", bench_kind_text, input.items.items, input.items.count, NULL);
+    }
+
+defer:
+    if (compressed != NULL) {
+        free(compressed);
+    }
+    ds_string_builder_free(&input);
+    pdf_inflater_release();
+    return result;
+}
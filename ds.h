@@ -27,6 +27,8 @@
 // implementation of the ds_argument parser utility
 // - DS_IO_IMPLEMENTATION: Define this macro for some io utils
 // - DS_JS_IMPLEMENTATION: Define this macro for JSON utils
+// - DS_TR_IMPLEMENTATION: Define this macro in one source file to include the
+// implementation of the allocation tracker
 //
 // MEMORY MANAGEMENT
 //
@@ -37,6 +39,7 @@
 //
 // Options:
 // - DS_NO_STDLIB: Disables the use of the standard library
+// - DS_TRACK_ALLOCATIONS: Wraps the memory macros with the allocation tracker
 //
 // LOGGING
 //
@@ -75,25 +78,40 @@
 #define DS_ERR 1
 
 typedef int bool;
-const bool true = 1;
-const bool false = 0;
+enum { false = 0, true = 1 };
 
 // ALLOCATOR
 //
 // The allocator is a simple utility to allocate and free memory. You can define
 // the allocator to use when allocating and freeing memory. This can be used in
 // all the other data structures and utilities to use a custom allocator.
+//
+// The allocator hands out blocks from a fixed memory region using power of two
+// size classes. Each class keeps a free list of the blocks released back to
+// it, so allocating and freeing are O(1) no matter how many blocks are live.
+// Passing a NULL allocator falls back to the standard library.
+#ifndef DS_ALLOCATOR_MIN_SIZE
+#define DS_ALLOCATOR_MIN_SIZE 16
+#endif // DS_ALLOCATOR_MIN_SIZE
+
+#ifndef DS_ALLOCATOR_CLASSES
+#define DS_ALLOCATOR_CLASSES 40
+#endif // DS_ALLOCATOR_CLASSES
+
 typedef struct ds_allocator {
         unsigned char *start;
-        unsigned char *prev;
         unsigned char *top;
         unsigned long int size;
+        void *free_lists[DS_ALLOCATOR_CLASSES];
 } ds_allocator;
 
 DSHDEF void ds_allocator_init(ds_allocator *allocator, unsigned char *start,
                               unsigned long int size);
 DSHDEF void ds_allocator_dump(ds_allocator *allocator);
 DSHDEF void *ds_allocator_alloc(ds_allocator *allocator, unsigned long int size);
+DSHDEF void *ds_allocator_realloc(ds_allocator *allocator, void *ptr,
+                                  unsigned long int old_size,
+                                  unsigned long int new_size);
 DSHDEF void ds_allocator_free(ds_allocator *allocator, void *ptr);
 
 // DYNAMIC ARRAY
@@ -106,30 +124,31 @@ DSHDEF void ds_allocator_free(ds_allocator *allocator, void *ptr);
 typedef struct ds_dynamic_array {
         struct ds_allocator *allocator;
         void *items;
-        unsigned int item_size;
-        unsigned int count;
-        unsigned int capacity;
+        unsigned long item_size;
+        unsigned long count;
+        unsigned long capacity;
 } ds_dynamic_array;
 
 DSHDEF void ds_dynamic_array_init_allocator(ds_dynamic_array *da,
-                                            unsigned int item_size,
+                                            unsigned long item_size,
                                             struct ds_allocator *allocator);
-DSHDEF void ds_dynamic_array_init(ds_dynamic_array *da, unsigned int item_size);
+DSHDEF void ds_dynamic_array_init(ds_dynamic_array *da, unsigned long item_size);
 DSHDEF int ds_dynamic_array_append(ds_dynamic_array *da, const void *item);
 DSHDEF int ds_dynamic_array_pop(ds_dynamic_array *da, const void **item);
 DSHDEF int ds_dynamic_array_append_many(ds_dynamic_array *da, void **new_items,
-                                        unsigned int new_items_count);
-DSHDEF int ds_dynamic_array_get(ds_dynamic_array *da, unsigned int index,
+                                        unsigned long new_items_count);
+DSHDEF int ds_dynamic_array_reserve(ds_dynamic_array *da, unsigned long capacity);
+DSHDEF int ds_dynamic_array_get(ds_dynamic_array *da, unsigned long index,
                                 void *item);
-DSHDEF int ds_dynamic_array_get_ref(ds_dynamic_array *da, unsigned int index,
+DSHDEF int ds_dynamic_array_get_ref(ds_dynamic_array *da, unsigned long index,
                                     void **item);
 DSHDEF int ds_dynamic_array_copy(ds_dynamic_array *da, ds_dynamic_array *copy);
 DSHDEF void ds_dynamic_array_sort(ds_dynamic_array *da,
                                   int (*compare)(const void *, const void *));
 DSHDEF int ds_dynamic_array_reverse(ds_dynamic_array *da);
-DSHDEF int ds_dynamic_array_swap(ds_dynamic_array *da, unsigned int index1,
-                                 unsigned int index2);
-DSHDEF int ds_dynamic_array_delete(ds_dynamic_array *da, unsigned int index);
+DSHDEF int ds_dynamic_array_swap(ds_dynamic_array *da, unsigned long index1,
+                                 unsigned long index2);
+DSHDEF int ds_dynamic_array_delete(ds_dynamic_array *da, unsigned long index);
 DSHDEF void ds_dynamic_array_free(ds_dynamic_array *da);
 
 // PRIORITY QUEUE
@@ -146,10 +165,10 @@ typedef struct ds_priority_queue {
 
 DSHDEF void ds_priority_queue_init_allocator(
     ds_priority_queue *pq, int (*compare)(const void *, const void *),
-    unsigned int item_size, struct ds_allocator *allocator);
+    unsigned long item_size, struct ds_allocator *allocator);
 DSHDEF void ds_priority_queue_init(ds_priority_queue *pq,
                                    int (*compare)(const void *, const void *),
-                                   unsigned int item_size);
+                                   unsigned long item_size);
 DSHDEF int ds_priority_queue_insert(ds_priority_queue *pq, void *item);
 DSHDEF int ds_priority_queue_pull(ds_priority_queue *pq, void *item);
 DSHDEF int ds_priority_queue_peek(ds_priority_queue *pq, void *item);
@@ -171,7 +190,7 @@ DSHDEF void ds_string_builder_init(ds_string_builder *sb);
 DSHDEF int ds_string_builder_append(ds_string_builder *sb, const char *format,
                                     ...);
 DSHDEF int ds_string_builder_appendn(ds_string_builder *sb, const char *str,
-                                     unsigned int len);
+                                     unsigned long len);
 DSHDEF int ds_string_builder_appendc(ds_string_builder *sb, char chr);
 DSHDEF int ds_string_builder_build(ds_string_builder *sb, char **str);
 DSHDEF void ds_string_builder_free(ds_string_builder *sb);
@@ -184,32 +203,25 @@ DSHDEF void ds_string_builder_free(ds_string_builder *sb);
 typedef struct ds_string_slice {
         struct ds_allocator *allocator;
         char *str;
-        unsigned int len;
+        unsigned long len;
 } ds_string_slice;
 
-#define DS_STRING_SLICE(string) ((ds_string_slice){.str = string, .len = strlen((string))})
+// The string slice literal only accepts string literals, and the length is
+// computed at compile time.
+#define DS_STRING_SLICE(string) ((ds_string_slice){.str = "" string "", .len = sizeof(string) - 1})
 
 DSHDEF void ds_string_slice_init_allocator(ds_string_slice *ss, char *str,
-                                           unsigned int len,
+                                           unsigned long len,
                                            struct ds_allocator *allocator);
 DSHDEF void ds_string_slice_init(ds_string_slice *ss, char *str,
-                                 unsigned int len);
-DSHDEF int ds_string_slice_tokenize(ds_string_slice *ss, char delimiter,
-                                    ds_string_slice *token);
-DSHDEF int ds_string_slice_take_while_pred(ds_string_slice *ss, int (*predicate)(char), ds_string_slice *token);
-DSHDEF int ds_string_slice_trim_left_ws(ds_string_slice *ss);
-DSHDEF int ds_string_slice_trim_right_ws(ds_string_slice *ss);
-DSHDEF int ds_string_slice_trim_left(ds_string_slice *ss, char chr);
-DSHDEF int ds_string_slice_trim_right(ds_string_slice *ss, char chr);
-DSHDEF int ds_string_slice_trim(ds_string_slice *ss, char chr);
+                                 unsigned long len);
 DSHDEF int ds_string_slice_to_owned(ds_string_slice *ss, char **str);
-DSHDEF bool ds_string_slice_equals(ds_string_slice *ss, ds_string_slice *so);
-DSHDEF bool ds_string_slice_starts_with(ds_string_slice *ss, ds_string_slice *prefix);
-DSHDEF bool ds_string_slice_starts_with_pred(ds_string_slice *ss, bool (*predicate)(char));
-DSHDEF int ds_string_slice_step(ds_string_slice *ss, int count);
-DSHDEF bool ds_string_slice_empty(ds_string_slice *ss);
 DSHDEF void ds_string_slice_free(ds_string_slice *ss);
 
+// The rest of the string slice functions are small static inline functions
+// defined at the end of this header. They never read outside of the slice,
+// so calling them on an empty slice is always safe.
+
 DSHDEF void ds_string_builder_to_slice(ds_string_builder *sb, ds_string_slice *ss);
 
 // (DOUBLY) LINKED LIST
@@ -242,10 +254,21 @@ DSHDEF void ds_linked_list_free(ds_linked_list *ll);
 
 // HASH MAP
 //
-// The hash map is a simple table that uses a hash function to store and
-// retrieve items. The hash map uses buckets to handle collisions.
-// You can define the hash and compare functions to use when inserting and
-// retrieving items.
+// The hash map is an open addressing table that uses robin hood hashing to
+// store and retrieve items. The table capacity is always a power of two and it
+// grows automatically to keep the load factor below DS_HASHMAP_MAX_LOAD.
+// Lookups return pointers into the table, which stay valid until the next
+// insert or delete. You can define the hash and compare functions to use when
+// inserting and retrieving items; ds_hashmap_hash_string and
+// ds_hashmap_hash_pointer can be used as default hash functions.
+#ifndef DS_HASHMAP_MAX_LOAD
+#define DS_HASHMAP_MAX_LOAD 0.875
+#endif // DS_HASHMAP_MAX_LOAD
+
+#ifndef DS_HASHMAP_MIN_CAPACITY
+#define DS_HASHMAP_MIN_CAPACITY 8
+#endif // DS_HASHMAP_MIN_CAPACITY
+
 typedef struct ds_hashmap_kv {
     void *key;
     void *value;
@@ -253,8 +276,10 @@ typedef struct ds_hashmap_kv {
 
 typedef struct ds_hashmap {
     struct ds_allocator *allocator;
-    ds_dynamic_array *buckets; /* ds_hashmap_kv */
+    ds_hashmap_kv *items;
+    unsigned int *hashes; /* 0 marks an empty slot */
     unsigned int capacity;
+    unsigned int count;
     unsigned int (*hash)(const void *);
     int (*compare)(const void *, const void *);
 } ds_hashmap;
@@ -268,9 +293,15 @@ DSHDEF int ds_hashmap_init(ds_hashmap *map, unsigned int capacity,
                               int (*compare)(const void *, const void *));
 DSHDEF int ds_hashmap_insert(ds_hashmap *map, ds_hashmap_kv *kv);
 DSHDEF int ds_hashmap_get(ds_hashmap *map, ds_hashmap_kv *kv);
+DSHDEF int ds_hashmap_get_ref(ds_hashmap *map, const void *key, ds_hashmap_kv **kv);
+DSHDEF int ds_hashmap_next(ds_hashmap *map, unsigned int *index, ds_hashmap_kv **kv);
 DSHDEF int ds_hashmap_delete(ds_hashmap *map, const void *key);
 DSHDEF unsigned int ds_hashmap_count(ds_hashmap *map);
 DSHDEF void ds_hashmap_free(ds_hashmap *map);
+DSHDEF unsigned int ds_hashmap_hash_string(const void *key);
+DSHDEF int ds_hashmap_compare_string(const void *k1, const void *k2);
+DSHDEF unsigned int ds_hashmap_hash_pointer(const void *key);
+DSHDEF int ds_hashmap_compare_pointer(const void *k1, const void *k2);
 
 // ARGUMENT PARSER
 //
@@ -342,8 +373,8 @@ DSHDEF void ds_argparse_parser_free(struct ds_argparse_parser *parser);
 #define LINE_MAX 4096
 #endif
 
-DSHDEF int ds_io_read(const char *filename, char **buffer, const char *mode);
-DSHDEF int ds_io_write(const char *filename, char *buffer, unsigned int buffer_len, const char *mode);
+DSHDEF long ds_io_read(const char *filename, char **buffer, const char *mode);
+DSHDEF long ds_io_write(const char *filename, char *buffer, unsigned long buffer_len, const char *mode);
 
 // JSON
 //
@@ -371,7 +402,7 @@ typedef struct json_object {
     };
 } json_object;
 
-DSHDEF int json_object_load(char *buffer, unsigned int buffer_len, json_object *object);
+DSHDEF int json_object_load(char *buffer, unsigned long buffer_len, json_object *object);
 DSHDEF int json_object_dump(json_object *object, char **buffer);
 DSHDEF int json_object_debug(json_object *object);
 DSHDEF int json_object_free(json_object *object);
@@ -384,6 +415,47 @@ DSHDEF int json_object_free(json_object *object);
 #define JSON_OBJECT_MAP_MAX_CAPACITY 100
 #endif // JSON_OBJECT_MAP_MAX_CAPACITY
 
+// JSON WRITER
+//
+// Streaming JSON writer. Values are appended to a buffer that is reused for
+// every record and handed to the write callback once it grows past
+// JSON_WRITER_FLUSH_SIZE bytes, so writing a record does not allocate.
+// Strings are escaped and bytes outside ASCII are written as \u00XX.
+
+#ifndef JSON_WRITER_FLUSH_SIZE
+#define JSON_WRITER_FLUSH_SIZE (64 * 1024)
+#endif // JSON_WRITER_FLUSH_SIZE
+
+#ifndef JSON_WRITER_MAX_DEPTH
+#define JSON_WRITER_MAX_DEPTH 64
+#endif // JSON_WRITER_MAX_DEPTH
+
+typedef int json_writer_write_fn(void *context, const char *data, unsigned long len);
+
+typedef struct json_writer {
+    json_writer_write_fn *write;
+    void *context;
+    ds_string_builder buffer;
+    unsigned int depth;
+    int first[JSON_WRITER_MAX_DEPTH];
+    int after_key;
+} json_writer;
+
+DSHDEF void json_writer_init(json_writer *writer, json_writer_write_fn *write, void *context);
+DSHDEF int json_writer_begin_object(json_writer *writer);
+DSHDEF int json_writer_end_object(json_writer *writer);
+DSHDEF int json_writer_begin_array(json_writer *writer);
+DSHDEF int json_writer_end_array(json_writer *writer);
+DSHDEF int json_writer_key(json_writer *writer, const char *key);
+DSHDEF int json_writer_string(json_writer *writer, const char *str, unsigned long len);
+DSHDEF int json_writer_integer(json_writer *writer, long value);
+DSHDEF int json_writer_number(json_writer *writer, double value);
+DSHDEF int json_writer_boolean(json_writer *writer, int value);
+DSHDEF int json_writer_null(json_writer *writer);
+DSHDEF int json_writer_end_record(json_writer *writer);
+DSHDEF int json_writer_flush(json_writer *writer);
+DSHDEF void json_writer_free(json_writer *writer);
+
 // RETURN DEFER
 //
 // The return_defer macro is a simple way to return a value and jump to a label
@@ -429,7 +501,7 @@ DSHDEF int json_object_free(json_object *object);
 #elif defined(DS_NO_STDLIB)
 #define DS_MEMCPY(dst, src, sz)                                                \
     do {                                                                       \
-        for (unsigned int i = 0; i < sz; i++) {                                \
+        for (unsigned long i = 0; i < sz; i++) {                               \
             ((char *)dst)[i] = ((char *)src)[i];                               \
         }                                                                      \
     } while (0)
@@ -443,7 +515,7 @@ DSHDEF int json_object_free(json_object *object);
 #define DS_MEMCMP(ptr1, ptr2, sz)                                              \
     ({                                                                         \
         int result = 0;                                                        \
-        for (unsigned int i = 0; i < sz; i++) {                                \
+        for (unsigned long i = 0; i < sz; i++) {                               \
             if (((char *)ptr1)[i] != ((char *)ptr2)[i]) {                      \
                 result = ((char *)ptr1)[i] - ((char *)ptr2)[i];                \
                 break;                                                         \
@@ -463,6 +535,7 @@ DSHDEF int json_object_free(json_object *object);
 #elif !defined(DS_MALLOC) && !defined(DS_FREE) && !defined(DS_REALLOC) &&      \
     defined(DS_AL_IMPLEMENTATION)
 #define DS_MALLOC(a, sz) ds_allocator_alloc(a, sz)
+#define DS_REALLOC(a, ptr, old_sz, new_sz) ds_allocator_realloc(a, ptr, old_sz, new_sz)
 #define DS_FREE(a, ptr) ds_allocator_free(a, ptr)
 #elif defined(DS_NO_STDLIB)
 #error "Must define DS_MALLOC and DS_FREE when DS_NO_STDLIB is defined"
@@ -473,8 +546,8 @@ DSHDEF int json_object_free(json_object *object);
 #endif
 
 #ifndef DS_REALLOC
-static inline void *ds_realloc(void *a, void *ptr, unsigned int old_sz,
-                               unsigned int new_sz) {
+static inline void *ds_realloc(void *a, void *ptr, unsigned long old_sz,
+                               unsigned long new_sz) {
     void *new_ptr = DS_MALLOC(a, new_sz);
     if (new_ptr == NULL) {
         DS_FREE(a, ptr);
@@ -487,6 +560,93 @@ static inline void *ds_realloc(void *a, void *ptr, unsigned int old_sz,
 #define DS_REALLOC(a, ptr, old_sz, new_sz) ds_realloc(a, ptr, old_sz, new_sz)
 #endif
 
+// ALLOCATION TRACKING
+//
+// When DS_TRACK_ALLOCATIONS is defined the DS_MALLOC, DS_REALLOC and DS_FREE
+// macros resolved above are wrapped by a tracking allocator. Every block gets
+// a small header with its size and the call site that allocated it, and each
+// call site is keyed by its file, line and the subsystem tag of the innermost
+// DS_TRACK_SCOPE_BEGIN. The tracker keeps the live and peak bytes, the
+// allocation counts and the bytes copied when a reallocation moves a block,
+// both in total and per call site. Without DS_TRACK_ALLOCATIONS the scope
+// macros expand to nothing.
+#ifdef DS_TRACK_ALLOCATIONS
+
+#ifndef DS_TRACK_SITES
+#define DS_TRACK_SITES 512
+#endif // DS_TRACK_SITES
+
+#ifndef DS_TRACK_DUMP_SITES
+#define DS_TRACK_DUMP_SITES 24
+#endif // DS_TRACK_DUMP_SITES
+
+#define DS_TRACK_TAG_OTHER "other"
+
+typedef struct ds_track_site {
+        const char *tag;
+        const char *file;
+        int line;
+        unsigned long allocations;
+        unsigned long reallocations;
+        unsigned long frees;
+        unsigned long bytes;
+        unsigned long copy_bytes;
+        unsigned long live;
+        unsigned long peak;
+} ds_track_site;
+
+typedef struct ds_track_stats {
+        unsigned long allocations;
+        unsigned long reallocations;
+        unsigned long frees;
+        unsigned long bytes;
+        unsigned long copy_bytes;
+        unsigned long live;
+        unsigned long peak;
+} ds_track_stats;
+
+DSHDEF void *ds_track_malloc(void *a, unsigned long size, const char *file,
+                             int line);
+DSHDEF void *ds_track_realloc(void *a, void *ptr, unsigned long old_size,
+                              unsigned long new_size, const char *file,
+                              int line);
+DSHDEF void ds_track_free(void *a, void *ptr);
+DSHDEF const char *ds_track_push(const char *tag);
+DSHDEF void ds_track_pop(const char *tag);
+DSHDEF void ds_track_get_stats(ds_track_stats *stats);
+DSHDEF unsigned long ds_track_get_sites(ds_track_site *sites,
+                                        unsigned long capacity);
+DSHDEF void ds_track_dump(void);
+
+// The allocator that the tracking allocator forwards to
+static inline void *ds_track_base_malloc(void *a, unsigned long size) {
+    return DS_MALLOC(a, size);
+}
+
+static inline void *ds_track_base_realloc(void *a, void *ptr,
+                                          unsigned long old_size,
+                                          unsigned long new_size) {
+    return DS_REALLOC(a, ptr, old_size, new_size);
+}
+
+static inline void ds_track_base_free(void *a, void *ptr) { DS_FREE(a, ptr); }
+
+#undef DS_MALLOC
+#undef DS_REALLOC
+#undef DS_FREE
+#define DS_MALLOC(a, sz) ds_track_malloc(a, sz, __FILE__, __LINE__)
+#define DS_REALLOC(a, ptr, old_sz, new_sz)                                     \
+    ds_track_realloc(a, ptr, old_sz, new_sz, __FILE__, __LINE__)
+#define DS_FREE(a, ptr) ds_track_free(a, ptr)
+
+#define DS_TRACK_SCOPE_BEGIN(tag)                                              \
+    const char *ds_track_previous_tag = ds_track_push(tag)
+#define DS_TRACK_SCOPE_END() ds_track_pop(ds_track_previous_tag)
+#else
+#define DS_TRACK_SCOPE_BEGIN(tag)
+#define DS_TRACK_SCOPE_END()
+#endif // DS_TRACK_ALLOCATIONS
+
 #if defined(DS_EXIT)
 // ok
 #elif !defined(DS_EXIT) && !defined(DS_NO_STDLIB)
@@ -560,7 +720,7 @@ static inline void *ds_realloc(void *a, void *ptr, unsigned int old_sz,
 #define DS_LOG_WARN(format, ...)
 #else
 #define DS_LOG_WARN(format, ...)                                               \
-    fprintf(stdout,                                                            \
+    fprintf(stderr,                                                            \
             DS_TERMINAL_YELLOW "WARN" DS_TERMINAL_RESET ": %s:%d: " format     \
                                "\n",                                           \
             __FILE__, __LINE__, ##__VA_ARGS__)
@@ -611,11 +771,13 @@ static inline void *ds_realloc(void *a, void *ptr, unsigned int old_sz,
 //  - count: the number of items in the array
 //  - capacity: the number of items that can be stored in the array
 
-#define DS_DA_INIT_CAPACITY 8192
+#ifndef DS_DA_INIT_CAPACITY
+#define DS_DA_INIT_CAPACITY 16
+#endif // DS_DA_INIT_CAPACITY
 #define ds_da_append(da, item)                                                 \
     do {                                                                       \
         if ((da)->count >= (da)->capacity) {                                   \
-            unsigned int new_capacity = (da)->capacity * 2;                    \
+            unsigned long new_capacity = (da)->capacity * 2;                   \
             if (new_capacity == 0) {                                           \
                 new_capacity = DS_DA_INIT_CAPACITY;                            \
             }                                                                  \
@@ -636,19 +798,21 @@ static inline void *ds_realloc(void *a, void *ptr, unsigned int old_sz,
 #define ds_da_append_many(da, new_items, new_items_count)                      \
     do {                                                                       \
         if ((da)->count + new_items_count > (da)->capacity) {                  \
-            if ((da)->capacity == 0) {                                         \
-                (da)->capacity = DS_DA_INIT_CAPACITY;                          \
+            unsigned long new_capacity = (da)->capacity;                       \
+            if (new_capacity == 0) {                                           \
+                new_capacity = DS_DA_INIT_CAPACITY;                            \
             }                                                                  \
-            while ((da)->count + new_items_count > (da)->capacity) {           \
-                (da)->capacity *= 2;                                           \
+            while ((da)->count + new_items_count > new_capacity) {             \
+                new_capacity *= 2;                                             \
             }                                                                  \
                                                                                \
             (da)->items = DS_REALLOC(NULL, (da)->items,                        \
                                      (da)->capacity * sizeof(*(da)->items),    \
-                                     (da)->capacity * sizeof(*(da)->items));   \
+                                     new_capacity * sizeof(*(da)->items));     \
             if ((da)->items == NULL) {                                         \
                 DS_PANIC("Failed to reallocate dynamic array");                \
             }                                                                  \
+            (da)->capacity = new_capacity;                                     \
         }                                                                      \
                                                                                \
         DS_MEMCPY((da)->items + (da)->count, new_items,                        \
@@ -656,6 +820,166 @@ static inline void *ds_realloc(void *a, void *ptr, unsigned int old_sz,
         (da)->count += new_items_count;                                        \
     } while (0)
 
+// STRING SLICE
+//
+// Inline string slice helpers. These are on the hot path of every tokenizer,
+// so they live in the header where the compiler can inline them. All of them
+// check the length of the slice before reading from it.
+
+static inline bool ds_string_slice_isspace(char chr) {
+    return chr == ' ' || chr == '\t' || chr == '\n' || chr == '\v' ||
+           chr == '\f' || chr == '\r';
+}
+
+// Check if the string slice is empty
+static inline bool ds_string_slice_empty(ds_string_slice *ss) {
+    return ss->len == 0;
+}
+
+// Step the string slice forward by count characters
+//
+// Returns 0 if the slice was stepped, 1 if it had less than count characters,
+// in which case the slice ends up empty.
+static inline int ds_string_slice_step(ds_string_slice *ss, long count) {
+    unsigned long n = count < 0 ? 0 : (unsigned long)count;
+    int result = 0;
+
+    if (n > ss->len) {
+        n = ss->len;
+        result = 1;
+    }
+
+    ss->str += n;
+    ss->len -= n;
+
+    return result;
+}
+
+// Check if the string slice is equal to a specific string
+//
+// Returns 1 in case the string slice equals str. Returns 0 otherwise
+static inline bool ds_string_slice_equals(ds_string_slice *ss, ds_string_slice *so) {
+    return ss->len == so->len && DS_MEMCMP(ss->str, so->str, ss->len) == 0;
+}
+
+// Check if the string slice starts with a specific string
+//
+// Returns 1 in case the string slice starts with str. Returns 0 otherwise
+static inline bool ds_string_slice_starts_with(ds_string_slice *ss, ds_string_slice *prefix) {
+    return ss->len >= prefix->len && DS_MEMCMP(ss->str, prefix->str, prefix->len) == 0;
+}
+
+// Check if the string slice starts with a char that matches a predicate function
+//
+// Returns 1 if the string slice starts with a predicate. Returns 0 otherwise.
+static inline bool ds_string_slice_starts_with_pred(ds_string_slice *ss, bool (*predicate)(char)) {
+    return ss->len > 0 && predicate(*ss->str);
+}
+
+// Tokenize the string slice by a delimiter
+//
+// Returns 0 if a token was found, 1 if the string slice is empty, in which
+// case the token is empty too.
+static inline int ds_string_slice_tokenize(ds_string_slice *ss, char delimiter,
+                                           ds_string_slice *token) {
+    token->allocator = ss->allocator;
+    token->str = ss->str;
+    token->len = ss->len;
+
+    if (ss->len == 0 || ss->str == NULL) {
+        return 1;
+    }
+
+    for (unsigned long i = 0; i < ss->len; i++) {
+        if (ss->str[i] == delimiter) {
+            token->len = i;
+            ss->str += i + 1;
+            ss->len -= i + 1;
+            return 0;
+        }
+    }
+
+    ss->str += ss->len;
+    ss->len = 0;
+
+    return 0;
+}
+
+// Build a token by taking from the string slice while the predicate holds true
+//
+// Return 0 if ok. Return 1 if the string slice is empty, in which case the
+// token is empty too.
+static inline int ds_string_slice_take_while_pred(ds_string_slice *ss, int (*predicate)(char), ds_string_slice *token) {
+    unsigned long i = 0;
+    while (i < ss->len && predicate(ss->str[i])) {
+        i++;
+    }
+
+    token->allocator = ss->allocator;
+    token->str = ss->str;
+    token->len = i;
+    ss->str += i;
+    ss->len -= i;
+
+    return ss->len == 0 && i == 0;
+}
+
+// Trim the left side of the string slice by whitespaces
+//
+// Returns 0 if the string was trimmed successfully.
+static inline int ds_string_slice_trim_left_ws(ds_string_slice *ss) {
+    while (ss->len > 0 && ds_string_slice_isspace(ss->str[0])) {
+        ss->str++;
+        ss->len--;
+    }
+
+    return 0;
+}
+
+// Trim the right side of the string slice by whitespaces
+//
+// Returns 0 if the string was trimmed successfully.
+static inline int ds_string_slice_trim_right_ws(ds_string_slice *ss) {
+    while (ss->len > 0 && ds_string_slice_isspace(ss->str[ss->len - 1])) {
+        ss->len--;
+    }
+
+    return 0;
+}
+
+// Trim the left side of the string slice by a character
+//
+// Returns 0 if the string was trimmed successfully.
+static inline int ds_string_slice_trim_left(ds_string_slice *ss, char chr) {
+    while (ss->len > 0 && ss->str[0] == chr) {
+        ss->str++;
+        ss->len--;
+    }
+
+    return 0;
+}
+
+// Trim the right side of the string slice by a character
+//
+// Returns 0 if the string was trimmed successfully.
+static inline int ds_string_slice_trim_right(ds_string_slice *ss, char chr) {
+    while (ss->len > 0 && ss->str[ss->len - 1] == chr) {
+        ss->len--;
+    }
+
+    return 0;
+}
+
+// Trim the string slice by a character
+//
+// Returns 0 if the string was trimmed successfully.
+static inline int ds_string_slice_trim(ds_string_slice *ss, char chr) {
+    ds_string_slice_trim_left(ss, chr);
+    ds_string_slice_trim_right(ss, chr);
+
+    return 0;
+}
+
 #endif // DS_H
 
 #ifdef DS_IMPLEMENTATION
@@ -669,6 +993,7 @@ static inline void *ds_realloc(void *a, void *ptr, unsigned int old_sz,
 #define DS_AP_IMPLEMENTATION
 #define DS_IO_IMPLEMENTATION
 #define DS_JS_IMPLEMENTATION
+#define DS_TR_IMPLEMENTATION
 #endif // DS_IMPLEMENTATION
 
 #ifdef DS_PQ_IMPLEMENTATION
@@ -679,10 +1004,6 @@ static inline void *ds_realloc(void *a, void *ptr, unsigned int old_sz,
 #define DS_DA_IMPLEMENTATION
 #endif // DS_SB_IMPLEMENTATION
 
-#ifdef DS_HM_IMPLEMENTATION
-#define DS_DA_IMPLEMENTATION
-#endif // DS_HM_IMPLEMENTATION
-
 #ifdef DS_AP_IMPLEMENTATION
 #define DS_DA_IMPLEMENTATION
 #endif // DS_AP_IMPLEMENTATION
@@ -700,63 +1021,21 @@ static inline void *ds_realloc(void *a, void *ptr, unsigned int old_sz,
 
 #ifdef DS_AL_IMPLEMENTATION
 
-static void uint64_read_le(unsigned char *data, unsigned long int *value) {
-    *value = ((unsigned long int)data[0] << 0) | ((unsigned long int)data[1] << 8) |
-             ((unsigned long int)data[2] << 16) | ((unsigned long int)data[3] << 24) |
-             ((unsigned long int)data[4] << 32) | ((unsigned long int)data[5] << 40) |
-             ((unsigned long int)data[6] << 48) | ((unsigned long int)data[7] << 56);
-}
-
-static void uint64_write_le(unsigned char *data, unsigned long int value) {
-    data[0] = (value >> 0) & 0xff;
-    data[1] = (value >> 8) & 0xff;
-    data[2] = (value >> 16) & 0xff;
-    data[3] = (value >> 24) & 0xff;
-    data[4] = (value >> 32) & 0xff;
-    data[5] = (value >> 40) & 0xff;
-    data[6] = (value >> 48) & 0xff;
-    data[7] = (value >> 56) & 0xff;
-}
-
-static void uint32_read_le(unsigned char *data, unsigned int *value) {
-    *value = ((unsigned int)data[0] << 0) | ((unsigned int)data[1] << 8) |
-             ((unsigned int)data[2] << 16) | ((unsigned int)data[3] << 24);
-}
-
-static void uint32_write_le(unsigned char *data, unsigned int value) {
-    data[0] = (value >> 0) & 0xff;
-    data[1] = (value >> 8) & 0xff;
-    data[2] = (value >> 16) & 0xff;
-    data[3] = (value >> 24) & 0xff;
-}
-
-#define BLOCK_METADATA_SIZE 28
-#define BLOCK_INDEX_UNDEFINED -1
-
-/*
- * | prev | next | size | free | ... size bytes of data ... |
- */
-typedef struct block {
-        long int prev;  // 8 bytes
-        long int next;  // 8 bytes
-        unsigned long int size; // 8 bytes
-        unsigned int free; // 4 bytes
-        unsigned char *data; // 8 bytes
-} block_t;
+// Every block starts with a header holding its size class. The header is 16
+// bytes so that the data stays aligned for any type.
+#define BLOCK_HEADER_SIZE 16
 
-static void block_read(unsigned char *data, block_t *block) {
-    uint64_read_le(data + 0, (unsigned long int *)&block->prev);
-    uint64_read_le(data + 8, (unsigned long int *)&block->next);
-    uint64_read_le(data + 16, &block->size);
-    uint32_read_le(data + 24, &block->free);
-    block->data = data + BLOCK_METADATA_SIZE;
+static unsigned int allocator_class(unsigned long int size) {
+    unsigned int size_class = 0;
+    while (size_class < DS_ALLOCATOR_CLASSES &&
+           ((unsigned long int)DS_ALLOCATOR_MIN_SIZE << size_class) < size) {
+        size_class++;
+    }
+    return size_class;
 }
 
-static void block_write(unsigned char *data, block_t *block) {
-    uint64_write_le(data + 0, block->prev);
-    uint64_write_le(data + 8, block->next);
-    uint64_write_le(data + 16, block->size);
-    uint32_write_le(data + 24, block->free);
+static unsigned long int allocator_class_size(unsigned int size_class) {
+    return (unsigned long int)DS_ALLOCATOR_MIN_SIZE << size_class;
 }
 
 // Initialize the allocator
@@ -765,198 +1044,379 @@ static void block_write(unsigned char *data, block_t *block) {
 // the size parameter is the maximum size of the memory allocator.
 DSHDEF void ds_allocator_init(ds_allocator *allocator, unsigned char *start,
                               unsigned long int size) {
+    unsigned long int misalign = (unsigned long int)start % BLOCK_HEADER_SIZE;
+    unsigned long int skip = misalign == 0 ? 0 : BLOCK_HEADER_SIZE - misalign;
+
     allocator->start = start;
-    allocator->prev = NULL;
-    allocator->top = start;
+    allocator->top = start + (skip < size ? skip : size);
     allocator->size = size;
+
+    for (unsigned int i = 0; i < DS_ALLOCATOR_CLASSES; i++) {
+        allocator->free_lists[i] = NULL;
+    }
 }
 
 // Dump the allocator to stdout
 //
-// This function prints the contents of the allocator to stdout.
+// This function prints the used bytes and the free blocks of every size class
+// to stdout.
 DSHDEF void ds_allocator_dump(ds_allocator *allocator) {
-    block_t block = {0};
-    unsigned char *ptr = allocator->start;
+    fprintf(stdout, "%*s %*lu / %lu\n", 14, "used", 14,
+            (unsigned long int)(allocator->top - allocator->start), allocator->size);
+    fprintf(stdout, "%*s %*s\n", 14, "class", 14, "free");
+
+    for (unsigned int i = 0; i < DS_ALLOCATOR_CLASSES; i++) {
+        unsigned long int count = 0;
+        for (void *block = allocator->free_lists[i]; block != NULL; block = *(void **)block) {
+            count++;
+        }
 
-    fprintf(stdout, "%*s %*s %*s %*s %*s\n", 14, "", 14, "prev", 14, "next", 14,
-            "size", 14, "free");
+        if (count != 0) {
+            fprintf(stdout, "%*lu %*lu\n", 14, allocator_class_size(i), 14, count);
+        }
+    }
+}
 
-    while (ptr < allocator->top) {
-        block_read(ptr, &block);
+// Allocate memory from the allocator
+//
+// This function allocates memory from the allocator. The block is reused from
+// the free list of its size class when possible, otherwise it is carved from
+// the top of the region. If the allocator is unable to allocate the memory, it
+// returns NULL.
+DSHDEF void *ds_allocator_alloc(ds_allocator *allocator, unsigned long int size) {
+#ifndef DS_NO_STDLIB
+    if (allocator == NULL) {
+        return malloc(size);
+    }
+#endif
 
-        unsigned char *prev = (block.prev == BLOCK_INDEX_UNDEFINED)
-                            ? NULL
-                            : allocator->start + block.prev;
-        unsigned char *next = (block.next == BLOCK_INDEX_UNDEFINED)
-                            ? NULL
-                            : allocator->start + block.next;
+    unsigned int size_class = allocator_class(size);
+    if (size_class >= DS_ALLOCATOR_CLASSES) {
+        return NULL;
+    }
 
-        fprintf(stdout, "%*p %*p %*p %*lu %*u\n", 14, ptr, 14, prev, 14, next,
-                14, block.size, 14, block.free);
+    void *block = allocator->free_lists[size_class];
+    if (block != NULL) {
+        allocator->free_lists[size_class] = *(void **)block;
+        return block;
+    }
 
-        ptr += (block.size + BLOCK_METADATA_SIZE);
+    unsigned long int needed = BLOCK_HEADER_SIZE + allocator_class_size(size_class);
+    unsigned long int available =
+        (unsigned long int)(allocator->start + allocator->size - allocator->top);
+    if (needed > available) {
+        return NULL;
     }
+
+    *(unsigned long int *)allocator->top = size_class;
+    block = allocator->top + BLOCK_HEADER_SIZE;
+    allocator->top += needed;
+
+    return block;
 }
 
-static int allocator_find_block(ds_allocator *allocator, unsigned long int size,
-                                block_t *block) {
-    if (allocator->prev == NULL) {
-        return 0;
+// Resize memory from the allocator
+//
+// The block is kept in place when the new size still fits its size class. On
+// failure the old block is freed and NULL is returned, like DS_REALLOC.
+DSHDEF void *ds_allocator_realloc(ds_allocator *allocator, void *ptr,
+                                  unsigned long int old_size,
+                                  unsigned long int new_size) {
+#ifndef DS_NO_STDLIB
+    if (allocator == NULL) {
+        void *new_ptr = realloc(ptr, new_size);
+        if (new_ptr == NULL) {
+            free(ptr);
+        }
+        return new_ptr;
+    }
+#endif
+
+    if (ptr != NULL) {
+        unsigned long int size_class = *(unsigned long int *)((unsigned char *)ptr - BLOCK_HEADER_SIZE);
+        if (new_size <= allocator_class_size(size_class)) {
+            return ptr;
+        }
     }
 
-    block_t current = {0};
-    unsigned char *ptr = allocator->start;
+    void *new_ptr = ds_allocator_alloc(allocator, new_size);
+    if (new_ptr != NULL && ptr != NULL) {
+        DS_MEMCPY(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    }
+    ds_allocator_free(allocator, ptr);
 
-    while (ptr < allocator->top) {
-        block_read(ptr, &current);
+    return new_ptr;
+}
 
-        if (current.free && current.size >= size + BLOCK_METADATA_SIZE * 2) {
-            unsigned long int old_size = current.size;
-            long int old_next = current.next;
+// Free memory from the allocator
+//
+// This function returns the block to the free list of its size class. If the
+// pointer is not within the bounds of the allocator, it does nothing.
+DSHDEF void ds_allocator_free(ds_allocator *allocator, void *ptr) {
+#ifndef DS_NO_STDLIB
+    if (allocator == NULL) {
+        free(ptr);
+        return;
+    }
+#endif
 
-            block_t split = {0};
-            split.prev = (unsigned long int)(ptr - allocator->start);
-            split.next = old_next;
-            split.size = old_size - size - BLOCK_METADATA_SIZE;
-            split.free = 1;
-            split.data = ptr + BLOCK_METADATA_SIZE + size + BLOCK_METADATA_SIZE;
+    if ((unsigned char *)ptr >= allocator->top ||
+        (unsigned char *)ptr < allocator->start + BLOCK_HEADER_SIZE) {
+        return;
+    }
 
-            block_write(ptr + BLOCK_METADATA_SIZE + size, &split);
+    unsigned long int size_class = *(unsigned long int *)((unsigned char *)ptr - BLOCK_HEADER_SIZE);
 
-            *block = current;
-            block->next =
-                (unsigned long int)(ptr - allocator->start) + BLOCK_METADATA_SIZE + size;
-            block->size = size;
-            block->free = 0;
-            block->data = ptr + BLOCK_METADATA_SIZE;
+    *(void **)ptr = allocator->free_lists[size_class];
+    allocator->free_lists[size_class] = ptr;
+}
 
-            block_write(ptr, block);
+#endif // DS_AL_IMPLEMENTATION
 
-            block_t next = {0};
-            block_read(allocator->start + old_next, &next);
+#if defined(DS_TR_IMPLEMENTATION) && defined(DS_TRACK_ALLOCATIONS)
 
-            next.prev =
-                (unsigned long int)(ptr - allocator->start) + BLOCK_METADATA_SIZE + size;
+#include <stdatomic.h>
 
-            block_write(allocator->start + old_next, &next);
+// The header in front of every tracked block, two words to keep the block
+// aligned like the base allocator returned it
+typedef struct ds_track_header {
+        unsigned long size;
+        unsigned long site;
+} ds_track_header;
 
-            return 1;
-        }
+static ds_track_site ds_track_sites[DS_TRACK_SITES];
+static ds_track_stats ds_track_totals;
+static atomic_flag ds_track_lock = ATOMIC_FLAG_INIT;
+static _Thread_local const char *ds_track_tag = NULL;
 
-        if (current.free && current.size >= size) {
-            *block = current;
-            block->free = 0;
+static void ds_track_acquire(void) {
+    while (atomic_flag_test_and_set_explicit(&ds_track_lock,
+                                             memory_order_acquire)) {
+    }
+}
 
-            block_write(ptr, block);
+static void ds_track_release(void) {
+    atomic_flag_clear_explicit(&ds_track_lock, memory_order_release);
+}
 
-            return 1;
+// Find the site of a call under the current tag, adding it if it is new
+//
+// The caller holds the lock. Site 0 collects the calls that no longer fit in
+// the table.
+static unsigned long ds_track_site_find(const char *file, int line) {
+    const char *tag = ds_track_tag != NULL ? ds_track_tag : DS_TRACK_TAG_OTHER;
+    unsigned long hash = (unsigned long)line * 2654435761ul ^
+                         (unsigned long)file ^ (unsigned long)tag;
+
+    for (unsigned long probe = 0; probe < DS_TRACK_SITES - 1; probe++) {
+        unsigned long index = 1 + (hash + probe) % (DS_TRACK_SITES - 1);
+        ds_track_site *site = &ds_track_sites[index];
+
+        if (site->file == NULL) {
+            site->tag = tag;
+            site->file = file;
+            site->line = line;
+            return index;
+        }
+        if (site->line == line && site->file == file && site->tag == tag) {
+            return index;
         }
-
-        ptr += (current.size + BLOCK_METADATA_SIZE);
     }
 
+    ds_track_sites[0].tag = "overflow";
+    ds_track_sites[0].file = "?";
     return 0;
 }
 
-// Allocate memory from the allocator
-//
-// This function allocates memory from the allocator. If the allocator is unable
-// to allocate the memory, it returns NULL.
-DSHDEF void *ds_allocator_alloc(ds_allocator *allocator, unsigned long int size) {
-    block_t block = {0};
-    if (allocator_find_block(allocator, size, &block) != 0) {
-        return block.data;
+static void ds_track_add(unsigned long index, unsigned long size) {
+    ds_track_site *site = &ds_track_sites[index];
+
+    site->live += size;
+    if (site->live > site->peak) {
+        site->peak = site->live;
     }
 
-    if (allocator->top + size + BLOCK_METADATA_SIZE >
-        allocator->start + allocator->size) {
-        return NULL;
+    ds_track_totals.live += size;
+    if (ds_track_totals.live > ds_track_totals.peak) {
+        ds_track_totals.peak = ds_track_totals.live;
     }
+}
 
-    block.next = BLOCK_INDEX_UNDEFINED;
-    block.size = size;
-    block.free = 0;
-    block.data = allocator->top + BLOCK_METADATA_SIZE;
+static void ds_track_remove(unsigned long index, unsigned long size) {
+    ds_track_sites[index].live -= size;
+    ds_track_totals.live -= size;
+}
 
-    if (allocator->prev == NULL) {
-        block.prev = BLOCK_INDEX_UNDEFINED;
-    } else {
-        block.prev = (unsigned long int)(allocator->prev - allocator->start);
+// Allocate a tracked block from the base allocator
+//
+// The block is charged to the call site under the current tag.
+DSHDEF void *ds_track_malloc(void *a, unsigned long size, const char *file,
+                             int line) {
+    ds_track_header *header =
+        ds_track_base_malloc(a, sizeof(ds_track_header) + size);
+    if (header == NULL) {
+        return NULL;
+    }
 
-        block_t prev = {0};
-        block_read(allocator->prev, &prev);
-        prev.next = (unsigned long int)(allocator->top - allocator->start);
+    ds_track_acquire();
+    unsigned long index = ds_track_site_find(file, line);
+    ds_track_sites[index].allocations += 1;
+    ds_track_sites[index].bytes += size;
+    ds_track_totals.allocations += 1;
+    ds_track_totals.bytes += size;
+    ds_track_add(index, size);
+    ds_track_release();
 
-        block_write(allocator->prev, &prev);
-    }
+    header->size = size;
+    header->site = index;
+    return header + 1;
+}
 
-    block_write(allocator->top, &block);
+// Resize a tracked block
+//
+// The size recorded in the header is used instead of old_size. The block is
+// charged to the call site of the reallocation, and when the base allocator
+// moves it the bytes it had to copy are added to the copy volume. On failure
+// the old block counts as freed, like DS_REALLOC.
+DSHDEF void *ds_track_realloc(void *a, void *ptr, unsigned long old_size,
+                              unsigned long new_size, const char *file,
+                              int line) {
+    (void)old_size;
+    if (ptr == NULL) {
+        return ds_track_malloc(a, new_size, file, line);
+    }
+
+    ds_track_header *old_header = (ds_track_header *)ptr - 1;
+    unsigned long old_address = (unsigned long)old_header;
+    unsigned long size = old_header->size;
+    unsigned long old_index = old_header->site;
+
+    ds_track_header *header =
+        ds_track_base_realloc(a, old_header, sizeof(ds_track_header) + size,
+                              sizeof(ds_track_header) + new_size);
+
+    ds_track_acquire();
+    ds_track_remove(old_index, size);
+    if (header == NULL) {
+        ds_track_sites[old_index].frees += 1;
+        ds_track_totals.frees += 1;
+        ds_track_release();
+        return NULL;
+    }
 
-    allocator->prev = allocator->top;
-    allocator->top += size + BLOCK_METADATA_SIZE;
+    unsigned long index = ds_track_site_find(file, line);
+    unsigned long copied = 0;
+    if ((unsigned long)header != old_address) {
+        copied = size < new_size ? size : new_size;
+    }
+    ds_track_sites[index].reallocations += 1;
+    ds_track_sites[index].bytes += new_size;
+    ds_track_sites[index].copy_bytes += copied;
+    ds_track_totals.reallocations += 1;
+    ds_track_totals.bytes += new_size;
+    ds_track_totals.copy_bytes += copied;
+    ds_track_add(index, new_size);
+    ds_track_release();
 
-    return block.data;
+    header->size = new_size;
+    header->site = index;
+    return header + 1;
 }
 
-// Free memory from the allocator
-//
-// This function frees memory from the allocator. If the pointer is not within
-// the bounds of the allocator, it does nothing.
-DSHDEF void ds_allocator_free(ds_allocator *allocator, void *ptr) {
-    if ((unsigned char *)ptr > allocator->top || (unsigned char *)ptr < allocator->start) {
+// Free a tracked block
+DSHDEF void ds_track_free(void *a, void *ptr) {
+    if (ptr == NULL) {
         return;
     }
 
-    block_t block = {0};
-    block_read(ptr - BLOCK_METADATA_SIZE, &block);
-    block.free = 1;
-
-    if (block.prev != BLOCK_INDEX_UNDEFINED) {
-        block_t prev = {0};
-        block_read(allocator->start + block.prev, &prev);
+    ds_track_header *header = (ds_track_header *)ptr - 1;
 
-        if (prev.free) {
-            prev.next = block.next;
-            prev.size += block.size + BLOCK_METADATA_SIZE;
+    ds_track_acquire();
+    ds_track_sites[header->site].frees += 1;
+    ds_track_totals.frees += 1;
+    ds_track_remove(header->site, header->size);
+    ds_track_release();
 
-            unsigned char *mptr = allocator->start + block.prev;
+    ds_track_base_free(a, header);
+}
 
-            block_t next = {0};
-            block_read(allocator->start + block.next, &next);
+// Set the tag of the allocations made by this thread
+//
+// Returns the previous tag, which should be given back to ds_track_pop.
+DSHDEF const char *ds_track_push(const char *tag) {
+    const char *previous = ds_track_tag;
+    ds_track_tag = tag;
+    return previous;
+}
 
-            next.prev = (unsigned long int)((unsigned char *)mptr - allocator->start);
+// Restore the tag that ds_track_push returned
+DSHDEF void ds_track_pop(const char *tag) { ds_track_tag = tag; }
 
-            block_write(allocator->start + block.next, &next);
-            block_write(allocator->start + block.prev, &prev);
+// Get the totals of all the tracked allocations
+DSHDEF void ds_track_get_stats(ds_track_stats *stats) {
+    ds_track_acquire();
+    *stats = ds_track_totals;
+    ds_track_release();
+}
 
-            block = prev;
-            ptr = mptr + BLOCK_METADATA_SIZE;
+// Copy the call sites seen so far into sites
+//
+// Returns the number of sites, which can be larger than capacity.
+DSHDEF unsigned long ds_track_get_sites(ds_track_site *sites,
+                                        unsigned long capacity) {
+    unsigned long count = 0;
+
+    ds_track_acquire();
+    for (unsigned long i = 0; i < DS_TRACK_SITES; i++) {
+        if (ds_track_sites[i].file == NULL) {
+            continue;
+        }
+        if (count < capacity) {
+            sites[count] = ds_track_sites[i];
         }
+        count += 1;
     }
+    ds_track_release();
 
-    if (block.next != BLOCK_INDEX_UNDEFINED) {
-        block_t next = {0};
-        block_read(allocator->start + block.next, &next);
-
-        if (next.free) {
-            block_t next_next = {0};
-            block_read(allocator->start + next.next, &next_next);
-
-            unsigned char *mptr = ptr - BLOCK_METADATA_SIZE;
-
-            next_next.prev = (unsigned long int)((unsigned char *)mptr - allocator->start);
-
-            block_write(allocator->start + next.next, &next_next);
+    return count;
+}
 
-            block.next = next.next;
-            block.size += next.size + BLOCK_METADATA_SIZE;
+// Print the totals and the DS_TRACK_DUMP_SITES call sites with the highest
+// peak to stderr
+DSHDEF void ds_track_dump(void) {
+    ds_track_site sites[DS_TRACK_SITES];
+    ds_track_stats stats;
+
+    ds_track_get_stats(&stats);
+    unsigned long count = ds_track_get_sites(sites, DS_TRACK_SITES);
+
+    for (unsigned long i = 1; i < count; i++) {
+        ds_track_site site = sites[i];
+        unsigned long j = i;
+        while (j > 0 && sites[j - 1].peak < site.peak) {
+            sites[j] = sites[j - 1];
+            j--;
         }
+        sites[j] = site;
+    }
+
+    fprintf(stderr,
+            "allocations %lu reallocations %lu frees %lu bytes %lu copied %lu "
+            "live %lu peak %lu\n",
+            stats.allocations, stats.reallocations, stats.frees, stats.bytes,
+            stats.copy_bytes, stats.live, stats.peak);
+    fprintf(stderr, "%-16s %10s %10s %12s %12s %12s %12s  %s\n", "tag",
+            "allocs", "reallocs", "bytes", "copied", "live", "peak", "site");
+    for (unsigned long i = 0; i < count && i < DS_TRACK_DUMP_SITES; i++) {
+        ds_track_site *site = &sites[i];
+        fprintf(stderr, "%-16s %10lu %10lu %12lu %12lu %12lu %12lu  %s:%d\n",
+                site->tag, site->allocations, site->reallocations,
+                site->bytes, site->copy_bytes, site->live, site->peak,
+                site->file, site->line);
     }
-
-    block_write(ptr - BLOCK_METADATA_SIZE, &block);
 }
 
-#endif // DS_AL_IMPLEMENTATION
+#endif // DS_TR_IMPLEMENTATION
 
 #ifdef DS_DA_IMPLEMENTATION
 
@@ -964,7 +1424,7 @@ DSHDEF void ds_allocator_free(ds_allocator *allocator, void *ptr) {
 //
 // The item_size parameter is the size of each item in the array.
 DSHDEF void ds_dynamic_array_init_allocator(ds_dynamic_array *da,
-                                            unsigned int item_size,
+                                            unsigned long item_size,
                                             struct ds_allocator *allocator) {
     da->allocator = allocator;
     da->items = NULL;
@@ -977,7 +1437,7 @@ DSHDEF void ds_dynamic_array_init_allocator(ds_dynamic_array *da,
 //
 // The item_size parameter is the size of each item in the array.
 DSHDEF void ds_dynamic_array_init(ds_dynamic_array *da,
-                                  unsigned int item_size) {
+                                  unsigned long item_size) {
     ds_dynamic_array_init_allocator(da, item_size, NULL);
 }
 
@@ -989,7 +1449,7 @@ DSHDEF int ds_dynamic_array_append(ds_dynamic_array *da, const void *item) {
     int result = 0;
 
     if (da->count >= da->capacity) {
-        unsigned int new_capacity = da->capacity * 2;
+        unsigned long new_capacity = da->capacity * 2;
         if (new_capacity == 0) {
             new_capacity = DS_DA_INIT_CAPACITY;
         }
@@ -1041,24 +1501,27 @@ defer:
 // Returns 0 if the items were appended successfully, 1 if the array could not
 // be reallocated.
 DSHDEF int ds_dynamic_array_append_many(ds_dynamic_array *da, void **new_items,
-                                        unsigned int new_items_count) {
+                                        unsigned long new_items_count) {
     int result = 0;
 
     if (da->count + new_items_count > da->capacity) {
-        if (da->capacity == 0) {
-            da->capacity = DS_DA_INIT_CAPACITY;
+        unsigned long new_capacity = da->capacity;
+        if (new_capacity == 0) {
+            new_capacity = DS_DA_INIT_CAPACITY;
         }
-        while (da->count + new_items_count > da->capacity) {
-            da->capacity *= 2;
+        while (da->count + new_items_count > new_capacity) {
+            new_capacity *= 2;
         }
 
         da->items =
             DS_REALLOC(da->allocator, da->items, da->capacity * da->item_size,
-                       da->capacity * da->item_size);
+                       new_capacity * da->item_size);
         if (da->items == NULL) {
             DS_LOG_ERROR("Failed to reallocate dynamic array");
             return_defer(1);
         }
+
+        da->capacity = new_capacity;
     }
 
     DS_MEMCPY((char *)da->items + da->count * da->item_size, new_items,
@@ -1069,11 +1532,37 @@ defer:
     return result;
 }
 
+// Reserve space in the dynamic array
+//
+// Makes sure the array can hold at least capacity items without reallocating.
+// Returns 0 if the space was reserved successfully, 1 if the array could not
+// be reallocated.
+DSHDEF int ds_dynamic_array_reserve(ds_dynamic_array *da, unsigned long capacity) {
+    int result = 0;
+
+    if (capacity <= da->capacity) {
+        return_defer(0);
+    }
+
+    da->items = DS_REALLOC(da->allocator, da->items,
+                           da->capacity * da->item_size,
+                           capacity * da->item_size);
+    if (da->items == NULL) {
+        DS_LOG_ERROR("Failed to reallocate dynamic array");
+        return_defer(1);
+    }
+
+    da->capacity = capacity;
+
+defer:
+    return result;
+}
+
 // Get an item from the dynamic array
 //
 // Returns 0 if the item was retrieved successfully, 1 if the index is out of
 // bounds.
-DSHDEF int ds_dynamic_array_get(ds_dynamic_array *da, unsigned int index,
+DSHDEF int ds_dynamic_array_get(ds_dynamic_array *da, unsigned long index,
                                 void *item) {
     int result = 0;
 
@@ -1089,12 +1578,12 @@ defer:
 }
 
 // Get a reference to an item from the dynamic array
-DSHDEF int ds_dynamic_array_get_ref(ds_dynamic_array *da, unsigned int index,
+DSHDEF int ds_dynamic_array_get_ref(ds_dynamic_array *da, unsigned long index,
                                     void **item) {
     int result = 0;
 
     if (index >= da->count) {
-        DS_LOG_ERROR("Index out of bounds %d %d", index, da->count);
+        DS_LOG_ERROR("Index out of bounds %lu %lu", index, da->count);
         return_defer(1);
     }
 
@@ -1142,8 +1631,8 @@ DSHDEF void ds_dynamic_array_sort(ds_dynamic_array *da,
 DSHDEF int ds_dynamic_array_reverse(ds_dynamic_array *da) {
     int result = 0;
 
-    for (unsigned int i = 0; i < da->count / 2; i++) {
-        unsigned int j = da->count - i - 1;
+    for (unsigned long i = 0; i < da->count / 2; i++) {
+        unsigned long j = da->count - i - 1;
 
         if (ds_dynamic_array_swap(da, i, j) != 0) {
             DS_LOG_ERROR("Failed to swap items");
@@ -1159,8 +1648,8 @@ defer:
 //
 // Returns 0 if the items were swapped successfully, 1 if the index is out of
 // bounds or if the temporary item could not be allocated.
-DSHDEF int ds_dynamic_array_swap(ds_dynamic_array *da, unsigned int index1,
-                                 unsigned int index2) {
+DSHDEF int ds_dynamic_array_swap(ds_dynamic_array *da, unsigned long index1,
+                                 unsigned long index2) {
     int result = 0;
 
     if (index1 >= da->count || index2 >= da->count) {
@@ -1204,7 +1693,7 @@ defer:
 // Delete an item from the dynamic array
 //
 // Returns 0 in case of succsess. Returns 1 if the index is out of bounds
-DSHDEF int ds_dynamic_array_delete(ds_dynamic_array *da, unsigned int index) {
+DSHDEF int ds_dynamic_array_delete(ds_dynamic_array *da, unsigned long index) {
     int result = 0;
 
     if (index >= da->count) {
@@ -1212,7 +1701,7 @@ DSHDEF int ds_dynamic_array_delete(ds_dynamic_array *da, unsigned int index) {
         return_defer(1);
     }
 
-    unsigned int n = da->count - index - 1;
+    unsigned long n = da->count - index - 1;
 
     if (n > 0) {
         void *dest = NULL;
@@ -1255,7 +1744,7 @@ DSHDEF void ds_dynamic_array_free(ds_dynamic_array *da) {
 // Initialize the priority queue with a custom allocator
 DSHDEF void ds_priority_queue_init_allocator(
     ds_priority_queue *pq, int (*compare)(const void *, const void *),
-    unsigned int item_size, struct ds_allocator *allocator) {
+    unsigned long item_size, struct ds_allocator *allocator) {
     ds_dynamic_array_init_allocator(&pq->items, item_size, allocator);
 
     pq->compare = compare;
@@ -1264,7 +1753,7 @@ DSHDEF void ds_priority_queue_init_allocator(
 // Initialize the priority queue
 DSHDEF void ds_priority_queue_init(ds_priority_queue *pq,
                                    int (*compare)(const void *, const void *),
-                                   unsigned int item_size) {
+                                   unsigned long item_size) {
     ds_priority_queue_init_allocator(pq, compare, item_size, NULL);
 }
 
@@ -1275,8 +1764,8 @@ DSHDEF int ds_priority_queue_insert(ds_priority_queue *pq, void *item) {
     int result = 0;
     ds_dynamic_array_append(&pq->items, item);
 
-    int index = pq->items.count - 1;
-    int parent = (index - 1) / 2;
+    long index = pq->items.count - 1;
+    long parent = (index - 1) / 2;
 
     void *index_item = NULL;
     if (ds_dynamic_array_get_ref(&pq->items, index, &index_item) != 0) {
@@ -1327,13 +1816,13 @@ DSHDEF int ds_priority_queue_pull(ds_priority_queue *pq, void *item) {
     }
     ds_dynamic_array_swap(&pq->items, 0, pq->items.count - 1);
 
-    unsigned int index = 0;
-    unsigned int swap = index;
+    unsigned long index = 0;
+    unsigned long swap = index;
     void *swap_item = NULL;
     do {
         index = swap;
 
-        unsigned int left = 2 * index + 1;
+        unsigned long left = 2 * index + 1;
         if (left < pq->items.count - 1) {
             void *left_item = NULL;
             if (ds_dynamic_array_get_ref(&pq->items, swap, &swap_item) != 0) {
@@ -1349,7 +1838,7 @@ DSHDEF int ds_priority_queue_pull(ds_priority_queue *pq, void *item) {
             }
         }
 
-        unsigned int right = 2 * index + 2;
+        unsigned long right = 2 * index + 2;
         if (right < pq->items.count - 1) {
             void *right_item = NULL;
             if (ds_dynamic_array_get_ref(&pq->items, swap, &swap_item) != 0) {
@@ -1420,45 +1909,58 @@ DSHDEF void ds_string_builder_init(ds_string_builder *sb) {
     ds_string_builder_init_allocator(sb, NULL);
 }
 
-// Append a formatted string to the string builder
+// Append a string of the given length to the string builder
 //
 // Returns 0 if the string was appended successfully.
 DSHDEF int ds_string_builder_appendn(ds_string_builder *sb, const char *str,
-                                     unsigned int len) {
-    return ds_dynamic_array_append_many(&sb->items, (void **)str, len);
+                                     unsigned long len) {
+    DS_TRACK_SCOPE_BEGIN("string_builder");
+    int result = ds_dynamic_array_append_many(&sb->items, (void **)str, len);
+    DS_TRACK_SCOPE_END();
+    return result;
 }
 
 // Append a formatted string to the string builder
 //
+// The string is formatted straight into the spare capacity of the builder,
+// which grows geometrically like the dynamic array.
+//
 // Returns 0 if the string was appended successfully.
 DSHDEF int ds_string_builder_append(ds_string_builder *sb, const char *format,
                                     ...) {
     int result = 0;
+    DS_TRACK_SCOPE_BEGIN("string_builder");
 
     va_list args;
     va_start(args, format);
     int needed = vsnprintf(NULL, 0, format, args);
     va_end(args);
 
-    char *buffer = DS_MALLOC(sb->items.allocator, needed + 1);
-    if (buffer == NULL) {
-        DS_LOG_ERROR("Failed to allocate string");
+    if (needed < 0) {
+        DS_LOG_ERROR("Failed to format string");
         return_defer(1);
     }
 
-    va_start(args, format);
-    vsnprintf(buffer, needed + 1, format, args);
-    va_end(args);
+    unsigned long capacity = sb->items.capacity;
+    if (capacity == 0) {
+        capacity = DS_DA_INIT_CAPACITY;
+    }
+    while (capacity < sb->items.count + needed + 1) {
+        capacity *= 2;
+    }
 
-    if (ds_dynamic_array_append_many(&sb->items, (void **)buffer, needed) !=
-        0) {
+    if (ds_dynamic_array_reserve(&sb->items, capacity) != 0) {
         return_defer(1);
     }
 
+    va_start(args, format);
+    vsnprintf((char *)sb->items.items + sb->items.count, needed + 1, format,
+              args);
+    va_end(args);
+    sb->items.count += needed;
+
 defer:
-    if (buffer != NULL) {
-        DS_FREE(sb->items.allocator, buffer);
-    }
+    DS_TRACK_SCOPE_END();
     return result;
 }
 
@@ -1466,7 +1968,10 @@ defer:
 //
 // Returns 0 if the character was appended successfully.
 DSHDEF int ds_string_builder_appendc(ds_string_builder *sb, char chr) {
-    return ds_dynamic_array_append(&sb->items, &chr);
+    DS_TRACK_SCOPE_BEGIN("string_builder");
+    int result = ds_dynamic_array_append(&sb->items, &chr);
+    DS_TRACK_SCOPE_END();
+    return result;
 }
 
 // Build the final string from the string builder
@@ -1475,6 +1980,7 @@ DSHDEF int ds_string_builder_appendc(ds_string_builder *sb, char chr) {
 // allocated.
 DSHDEF int ds_string_builder_build(ds_string_builder *sb, char **str) {
     int result = 0;
+    DS_TRACK_SCOPE_BEGIN("string_builder");
 
     *str = DS_MALLOC(NULL, sb->items.count + 1);
     if (*str == NULL) {
@@ -1486,6 +1992,7 @@ DSHDEF int ds_string_builder_build(ds_string_builder *sb, char **str) {
     (*str)[sb->items.count] = '\0';
 
 defer:
+    DS_TRACK_SCOPE_END();
     return result;
 }
 
@@ -1506,7 +2013,7 @@ DSHDEF void ds_string_builder_free(ds_string_builder *sb) {
 #ifdef DS_SS_IMPLEMENTATION
 
 DSHDEF void ds_string_slice_init_allocator(ds_string_slice *ss, char *str,
-                                           unsigned int len,
+                                           unsigned long len,
                                            struct ds_allocator *allocator) {
     ss->allocator = allocator;
     ss->str = str;
@@ -1515,144 +2022,10 @@ DSHDEF void ds_string_slice_init_allocator(ds_string_slice *ss, char *str,
 
 // Initialize the string slice
 DSHDEF void ds_string_slice_init(ds_string_slice *ss, char *str,
-                                 unsigned int len) {
+                                 unsigned long len) {
     ds_string_slice_init_allocator(ss, str, len, NULL);
 }
 
-// Tokenize the string slice by a delimiter
-//
-// Returns 0 if a token was found, 1 if the string slice is empty.
-DSHDEF int ds_string_slice_tokenize(ds_string_slice *ss, char delimiter,
-                                    ds_string_slice *token) {
-    int result = 0;
-
-    if (ss->len == 0 || ss->str == NULL) {
-        return_defer(1);
-    }
-
-    token->str = ss->str;
-    token->len = 0;
-
-    for (unsigned int i = 0; i < ss->len; i++) {
-        if (ss->str[i] == delimiter) {
-            token->len = i;
-            ss->str += i + 1;
-            ss->len -= i + 1;
-            return_defer(0);
-        }
-    }
-
-    token->len = ss->len;
-    ss->str += ss->len;
-    ss->len = 0;
-
-defer:
-    return result;
-}
-
-// Build a token by taking from the string slice while the predicate holds true
-//
-// Return 0 if ok. Return 1 if error occured.
-DSHDEF int ds_string_slice_take_while_pred(ds_string_slice *ss, int (*predicate)(char), ds_string_slice *token) {
-    int result = 0;
-
-    if (ss->len == 0 || ss->str == NULL) {
-        return_defer(1);
-    }
-
-    token->str = ss->str;
-    token->len = 0;
-
-    for (unsigned int i = 0; i < ss->len; i++) {
-        if (predicate(ss->str[i]) == 0) {
-            token->len = i;
-            ss->str += i;
-            ss->len -= i;
-            return_defer(0);
-        }
-    }
-
-    token->len = ss->len;
-    ss->str += ss->len;
-    ss->len = 0;
-
-defer:
-    return result;
-}
-
-// Trim the left side of the string slice by whitespaces
-//
-// Returns 0 if the string was trimmed successfully, 1 if the string slice is
-DSHDEF int ds_string_slice_trim_left_ws(ds_string_slice *ss) {
-    int result = 0;
-
-    while (ss->len > 0 && isspace(ss->str[0])) {
-        ss->str++;
-        ss->len--;
-    }
-
-    return result;
-}
-
-
-// Trim the left side of the string slice by whitespaces
-//
-// Returns 0 if the string was trimmed successfully, 1 if the string slice is
-DSHDEF int ds_string_slice_trim_right_ws(ds_string_slice *ss) {
-    int result = 0;
-
-    while (ss->len > 0 && isspace(ss->str[ss->len - 1])) {
-        ss->len--;
-    }
-
-    return result;
-}
-
-// Trim the left side of the string slice by a character
-//
-// Returns 0 if the string was trimmed successfully, 1 if the string slice is
-DSHDEF int ds_string_slice_trim_left(ds_string_slice *ss, char chr) {
-    int result = 0;
-
-    while (ss->len > 0 && ss->str[0] == chr) {
-        ss->str++;
-        ss->len--;
-    }
-
-    return result;
-}
-
-// Trim the right side of the string slice by a character
-//
-// Returns 0 if the string was trimmed successfully, 1 if the string slice is
-DSHDEF int ds_string_slice_trim_right(ds_string_slice *ss, char chr) {
-    int result = 0;
-
-    while (ss->len > 0 && ss->str[ss->len - 1] == chr) {
-        ss->len--;
-    }
-
-    return result;
-}
-
-// Trim the string slice by a character
-//
-// Returns 0 if the string was trimmed successfully, 1 if the string slice is
-DSHDEF int ds_string_slice_trim(ds_string_slice *ss, char chr) {
-    int result = 0;
-
-    if (ds_string_slice_trim_left(ss, chr) != 0) {
-        return_defer(1);
-    }
-
-    if (ds_string_slice_trim_right(ss, chr) != 0) {
-        return_defer(1);
-    }
-
-defer:
-    return result;
-}
-
 // Convert the string slice to an owned string
 //
 // Returns 0 if the string was converted successfully, 1 if the string could not
@@ -1670,41 +2043,7 @@ DSHDEF int ds_string_slice_to_owned(ds_string_slice *ss, char **str) {
     (*str)[ss->len] = '\0';
 
 defer:
-    return result;
-}
-
-// Check if the string slice is equal to a specific string
-//
-// Returns 1 in case the string slice equals str. Returns 0 otherwise
-DSHDEF bool ds_string_slice_equals(ds_string_slice *ss, ds_string_slice *so) {
-    return ss->len == so->len && DS_MEMCMP(ss->str, so->str, ss->len) == 0;
-}
-
-// Check if the string slice starts with a specific string
-//
-// Returns 1 in case the string slice starts with str. Returns 0 otherwise
-DSHDEF bool ds_string_slice_starts_with(ds_string_slice *ss, ds_string_slice *prefix) {
-    return DS_MEMCMP(ss->str, prefix->str, prefix->len) == 0;
-}
-
-// Check if the string slice starts with a char that matches a predicate function
-//
-// Returns 1 if the string slice starts with a predicate. Returns 0 otherwise.
-DSHDEF bool ds_string_slice_starts_with_pred(ds_string_slice *ss, bool (*predicate)(char)) {
-    return predicate(*ss->str);
-}
-
-// Step the string slice by one character forward
-DSHDEF int ds_string_slice_step(ds_string_slice *ss, int count) {
-    ss->str += count;
-    ss->len -= count;
-
-    return 0;
-}
-
-// Check if the string slice is empty
-DSHDEF bool ds_string_slice_empty(ds_string_slice *ss) {
-    return ss->len == 0;
+    return result;
 }
 
 // Free the string slice
@@ -1919,7 +2258,151 @@ DSHDEF void ds_linked_list_free(ds_linked_list *ll) {
 
 #ifdef DS_HM_IMPLEMENTATION
 
-// Initialize the hashmap using an allocator
+// Mix the user hash so that weak hash functions still spread over the low
+// bits used for the home slot. The value 0 is reserved for empty slots.
+static unsigned int ds_hashmap_mix(unsigned int hash) {
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bU;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35U;
+    hash ^= hash >> 16;
+    return hash == 0 ? 1 : hash;
+}
+
+// Distance of the slot at index from the home slot of the hash
+static unsigned int ds_hashmap_distance(ds_hashmap *map, unsigned int hash,
+                                        unsigned int index) {
+    return (index - hash) & (map->capacity - 1);
+}
+
+// Allocate an empty table with the given capacity (a power of two)
+//
+// Returns 0 if the allocation was succsess. Returns 1 if it failed
+static int ds_hashmap_alloc(ds_hashmap *map, unsigned int capacity) {
+    int result = 0;
+    DS_TRACK_SCOPE_BEGIN("hashmap");
+
+    map->items = DS_MALLOC(map->allocator, capacity * sizeof(ds_hashmap_kv));
+    if (map->items == NULL) {
+        DS_LOG_ERROR("Failed to allocate hashmap items");
+        return_defer(1);
+    }
+
+    map->hashes = DS_MALLOC(map->allocator, capacity * sizeof(unsigned int));
+    if (map->hashes == NULL) {
+        DS_LOG_ERROR("Failed to allocate hashmap hashes");
+        DS_FREE(map->allocator, map->items);
+        map->items = NULL;
+        return_defer(1);
+    }
+
+    for (unsigned int i = 0; i < capacity; i++) {
+        map->hashes[i] = 0;
+    }
+
+    map->capacity = capacity;
+    map->count = 0;
+
+defer:
+    DS_TRACK_SCOPE_END();
+    return result;
+}
+
+// Place an item whose key is known not to be in the table. Richer slots (the
+// ones closer to their home) are taken over and their item is carried forward.
+static void ds_hashmap_place(ds_hashmap *map, unsigned int hash, ds_hashmap_kv kv) {
+    unsigned int mask = map->capacity - 1;
+    unsigned int index = hash & mask;
+    unsigned int distance = 0;
+
+    for (;;) {
+        unsigned int current = map->hashes[index];
+        if (current == 0) {
+            map->hashes[index] = hash;
+            map->items[index] = kv;
+            map->count++;
+            return;
+        }
+
+        unsigned int current_distance = ds_hashmap_distance(map, current, index);
+        if (current_distance < distance) {
+            ds_hashmap_kv tmp = map->items[index];
+            map->items[index] = kv;
+            map->hashes[index] = hash;
+            kv = tmp;
+            hash = current;
+            distance = current_distance;
+        }
+
+        index = (index + 1) & mask;
+        distance++;
+    }
+}
+
+// Resize the table and re-insert all the items
+//
+// Returns 0 if the resize was succsess. Returns 1 if it failed
+static int ds_hashmap_resize(ds_hashmap *map, unsigned int capacity) {
+    int result = 0;
+    ds_hashmap_kv *items = map->items;
+    unsigned int *hashes = map->hashes;
+    unsigned int old_capacity = map->capacity;
+
+    if (ds_hashmap_alloc(map, capacity) != 0) {
+        map->items = items;
+        map->hashes = hashes;
+        return_defer(1);
+    }
+
+    for (unsigned int i = 0; i < old_capacity; i++) {
+        if (hashes[i] != 0) {
+            ds_hashmap_place(map, hashes[i], items[i]);
+        }
+    }
+
+    if (items != NULL) {
+        DS_FREE(map->allocator, items);
+    }
+    if (hashes != NULL) {
+        DS_FREE(map->allocator, hashes);
+    }
+
+defer:
+    return result;
+}
+
+// Find the slot of a key. The probe stops at the first empty slot or at the
+// first slot that is closer to its home than the key would be.
+//
+// Returns 0 if it found the key. Returns 1 otherwise
+static int ds_hashmap_find(ds_hashmap *map, const void *key, unsigned int hash,
+                           unsigned int *index) {
+    if (map->capacity == 0) {
+        return 1;
+    }
+
+    unsigned int mask = map->capacity - 1;
+    unsigned int i = hash & mask;
+    unsigned int distance = 0;
+
+    for (;;) {
+        unsigned int current = map->hashes[i];
+        if (current == 0 || ds_hashmap_distance(map, current, i) < distance) {
+            return 1;
+        }
+
+        if (current == hash && map->compare(map->items[i].key, key) == 0) {
+            *index = i;
+            return 0;
+        }
+
+        i = (i + 1) & mask;
+        distance++;
+    }
+}
+
+// Initialize the hashmap using an allocator. The capacity is the number of
+// items that fit before the first resize.
 //
 // Returns 0 if the initialization was succsess. Returns 1 if it failed to
 // allocate the hashmap
@@ -1928,23 +2411,24 @@ DSHDEF int ds_hashmap_init_allocator(ds_hashmap *map, unsigned int capacity,
                               int (*compare)(const void *, const void *),
                               ds_allocator *allocator) {
     int result = 0;
+    unsigned int slots = DS_HASHMAP_MIN_CAPACITY;
 
     map->allocator = allocator;
-    map->capacity = capacity;
+    map->items = NULL;
+    map->hashes = NULL;
+    map->capacity = 0;
+    map->count = 0;
+    map->hash = hash;
+    map->compare = compare;
 
-    map->buckets = DS_MALLOC(map->allocator, capacity * sizeof(ds_dynamic_array));
-    if (map->buckets == NULL) {
-        DS_LOG_ERROR("Failed to allocate hashmap buckets");
-        return_defer(1);
+    while (slots < (1U << 31) && slots * DS_HASHMAP_MAX_LOAD < capacity) {
+        slots *= 2;
     }
 
-    for (unsigned int i = 0; i < map->capacity; i++) {
-        ds_dynamic_array_init_allocator(map->buckets + i, sizeof(ds_hashmap_kv), map->allocator);
+    if (ds_hashmap_alloc(map, slots) != 0) {
+        return_defer(1);
     }
 
-    map->hash = hash;
-    map->compare = compare;
-
 defer:
     return result;
 }
@@ -1959,83 +2443,115 @@ DSHDEF int ds_hashmap_init(ds_hashmap *map, unsigned int capacity,
     return ds_hashmap_init_allocator(map, capacity, hash, compare, NULL);
 }
 
-// Insert a key value pair into the hashmap
+// Insert a key value pair into the hashmap. If the key is already in the map
+// only its value is replaced.
 //
 // Returns 0 for succsess. Returns 1 if it failed to add the item
 DSHDEF int ds_hashmap_insert(ds_hashmap *map, ds_hashmap_kv *kv) {
     int result = 0;
+    unsigned int index = 0;
+    unsigned int hash = ds_hashmap_mix(map->hash(kv->key));
 
-    unsigned int index = map->hash(kv->key) % map->capacity;
+    if (ds_hashmap_find(map, kv->key, hash, &index) == 0) {
+        map->items[index].value = kv->value;
+        return_defer(0);
+    }
 
-    if (ds_dynamic_array_append(map->buckets + index, kv) != 0) {
-        DS_LOG_ERROR("Failed to insert item into bucket");
-        return_defer(1);
+    if (map->count + 1 >= map->capacity ||
+        map->count + 1 > map->capacity * DS_HASHMAP_MAX_LOAD) {
+        if (map->capacity >= (1U << 31) ||
+            ds_hashmap_resize(map, map->capacity * 2) != 0) {
+            DS_LOG_ERROR("Failed to grow the hashmap");
+            return_defer(1);
+        }
     }
 
+    ds_hashmap_place(map, hash, *kv);
+
 defer:
     return result;
 }
 
 // Get an item from the hashmap using the key
 //
-// Returns 0 if it found the item. Returns 1 in case of an error
+// Returns 0 if it found the item. Returns 1 if the key is not in the map
 DSHDEF int ds_hashmap_get(ds_hashmap *map, ds_hashmap_kv *kv) {
     int result = 0;
-    int found = 0;
-
-    unsigned int index = map->hash(kv->key) % map->capacity;
-    ds_dynamic_array *bucket = map->buckets + index;
-
-    for (int i = 0; bucket->count; i++) {
-        ds_hashmap_kv tmp = {0};
-        if (ds_dynamic_array_get(bucket, i, &tmp) != 0) {
-            return_defer(1);
-        }
-
-        if (map->compare(kv->key, tmp.key) == 0) {
-            kv->value = tmp.value;
-            found = 1;
-            break;
-        }
-    }
+    unsigned int index = 0;
+    unsigned int hash = ds_hashmap_mix(map->hash(kv->key));
 
-    if (found == 0) {
-        DS_LOG_ERROR("Failed to find item in hashmap");
+    if (ds_hashmap_find(map, kv->key, hash, &index) != 0) {
         return_defer(1);
     }
 
+    kv->value = map->items[index].value;
+
 defer:
     return result;
 }
 
-// Delete a key from the hashmap (this does not free the memory)
+// Get a pointer to the key value pair stored in the hashmap. The pointer is
+// valid until the next insert or delete.
 //
-// Returns 0 if it found the item. Returns 1 in case of an error
-DSHDEF int ds_hashmap_delete(ds_hashmap *map, const void *key) {
+// Returns 0 if it found the item. Returns 1 if the key is not in the map
+DSHDEF int ds_hashmap_get_ref(ds_hashmap *map, const void *key, ds_hashmap_kv **kv) {
     int result = 0;
-    int found = 0;
+    unsigned int index = 0;
+    unsigned int hash = ds_hashmap_mix(map->hash(key));
 
-    unsigned int index = map->hash(key) % map->capacity;
-    ds_dynamic_array *bucket = map->buckets + index;
+    if (ds_hashmap_find(map, key, hash, &index) != 0) {
+        return_defer(1);
+    }
 
-    for (int i = 0; bucket->count; i++) {
-        ds_hashmap_kv tmp = {0};
-        if (ds_dynamic_array_get(bucket, i, &tmp) != 0) {
-            return_defer(1);
-        }
+    *kv = map->items + index;
 
-        if (map->compare(key, tmp.key) == 0) {
-            ds_dynamic_array_delete(bucket, i);
-            found = 1;
-            break;
+defer:
+    return result;
+}
+
+// Iterate over the items of the hashmap. Start with *index set to 0; the
+// index is moved past the returned item. The order is unspecified.
+//
+// Returns 0 if it found an item. Returns 1 when there are no more items
+DSHDEF int ds_hashmap_next(ds_hashmap *map, unsigned int *index, ds_hashmap_kv **kv) {
+    for (unsigned int i = *index; i < map->capacity; i++) {
+        if (map->hashes[i] != 0) {
+            *kv = map->items + i;
+            *index = i + 1;
+            return 0;
         }
     }
 
-    if (found == 0) {
-        DS_LOG_ERROR("Failed to find item in hashmap");
+    *index = map->capacity;
+    return 1;
+}
+
+// Delete a key from the hashmap (this does not free the memory). The items
+// that follow are shifted back so that no tombstones are left behind.
+//
+// Returns 0 if it found the item. Returns 1 if the key is not in the map
+DSHDEF int ds_hashmap_delete(ds_hashmap *map, const void *key) {
+    int result = 0;
+    unsigned int index = 0;
+    unsigned int hash = ds_hashmap_mix(map->hash(key));
+
+    if (ds_hashmap_find(map, key, hash, &index) != 0) {
         return_defer(1);
     }
 
+    unsigned int mask = map->capacity - 1;
+    unsigned int next = (index + 1) & mask;
+    while (map->hashes[next] != 0 &&
+           ds_hashmap_distance(map, map->hashes[next], next) > 0) {
+        map->hashes[index] = map->hashes[next];
+        map->items[index] = map->items[next];
+        index = next;
+        next = (next + 1) & mask;
+    }
+
+    map->hashes[index] = 0;
+    map->count--;
+
 defer:
     return result;
 }
@@ -2044,32 +2560,58 @@ defer:
 //
 // Returns the number of items.
 DSHDEF unsigned int ds_hashmap_count(ds_hashmap *map) {
-    unsigned int count = 0;
-
-    for (unsigned int i = 0; i < map->capacity; i++) {
-        count += map->buckets[i].count;
-    }
-
-    return count;
+    return map->count;
 }
 
 // Free the hashmap (this does not free the values or the keys)
 DSHDEF void ds_hashmap_free(ds_hashmap *map) {
-    for (unsigned int i = 0; i < map->capacity; i++) {
-        ds_dynamic_array_free(map->buckets + i);
+    if (map->items != NULL) {
+        DS_FREE(map->allocator, map->items);
     }
 
-    if (map->buckets != NULL) {
-        DS_FREE(map->allocator, map->buckets);
+    if (map->hashes != NULL) {
+        DS_FREE(map->allocator, map->hashes);
     }
 
     map->allocator = NULL;
-    map->buckets = NULL;
+    map->items = NULL;
+    map->hashes = NULL;
     map->capacity = 0;
+    map->count = 0;
     map->hash = NULL;
     map->compare = NULL;
 }
 
+// FNV-1a hash for NUL terminated string keys
+DSHDEF unsigned int ds_hashmap_hash_string(const void *key) {
+    unsigned int hash = 2166136261U;
+    for (const unsigned char *s = key; *s != '\0'; s++) {
+        hash ^= *s;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+DSHDEF int ds_hashmap_compare_string(const void *k1, const void *k2) {
+    const unsigned char *s1 = k1;
+    const unsigned char *s2 = k2;
+    while (*s1 != '\0' && *s1 == *s2) {
+        s1++;
+        s2++;
+    }
+    return *s1 - *s2;
+}
+
+// Hash for keys that are the pointer value itself (e.g. packed integers)
+DSHDEF unsigned int ds_hashmap_hash_pointer(const void *key) {
+    unsigned long value = (unsigned long)key;
+    return (unsigned int)(value ^ (value >> (sizeof(value) * 4)));
+}
+
+DSHDEF int ds_hashmap_compare_pointer(const void *k1, const void *k2) {
+    return k1 == k2 ? 0 : 1;
+}
+
 #endif // DS_HM_IMPLEMENTATION
 
 #ifdef DS_AP_IMPLEMENTATION
@@ -2283,7 +2825,7 @@ static ds_argument *argparse_get_option_arg(ds_argparse_parser *parser,
 
 static ds_argument *argparse_get_positional_arg(ds_argparse_parser *parser,
                                                 const char *name) {
-    if (name[0] == '-') {
+    if (name[0] == '-' && name[1] != '\0') {
         DS_LOG_WARN("provided name is not a positional argument: %s", name);
         return NULL;
     }
@@ -2342,7 +2884,7 @@ DSHDEF int ds_argparse_parse(ds_argparse_parser *parser, int argc, char *argv[])
             DS_EXIT(0);
         }
 
-        if (name[0] == '-') {
+        if (name[0] == '-' && name[1] != '\0') {
             ds_argument *arg = argparse_get_option_arg(parser, name);
 
             if (arg == NULL) {
@@ -2683,8 +3225,8 @@ DSHDEF void ds_argparse_parser_free(ds_argparse_parser *parser) {
 //
 // Returns:
 // - the number of bytes read
-DSHDEF int ds_io_read(const char *filename, char **buffer, const char *mode) {
-    int result = 0;
+DSHDEF long ds_io_read(const char *filename, char **buffer, const char *mode) {
+    long result = 0;
     unsigned long line_size;
     FILE *file = NULL;
     ds_string_builder sb;
@@ -2738,8 +3280,8 @@ defer:
 //
 // Returns:
 // - the number of bytes written
-DSHDEF int ds_io_write(const char *filename, char *buffer, unsigned int buffer_len, const char *mode) {
-    int result = 0;
+DSHDEF long ds_io_write(const char *filename, char *buffer, unsigned long buffer_len, const char *mode) {
+    long result = 0;
     unsigned long buffer_size;
     FILE *file = NULL;
 
@@ -2790,9 +3332,9 @@ typedef struct json_token {
 
 typedef struct json_lexer {
     const char *buffer;
-    unsigned int buffer_len;
-    unsigned int pos;
-    unsigned int read_pos;
+    unsigned long buffer_len;
+    unsigned long pos;
+    unsigned long read_pos;
     char ch;
 } json_lexer;
 
@@ -2800,19 +3342,6 @@ typedef struct json_parser {
     json_lexer lexer;
 } json_parser;
 
-static unsigned int json_object_hash(const void *key) {
-    unsigned int hash = 0;
-    char *name = (char *)key;
-    for (unsigned int i = 0; i < strlen(name); i++) {
-        hash = 31 * hash + name[i];
-    }
-    return hash % JSON_OBJECT_MAP_MAX_CAPACITY;
-}
-
-static int json_object_compare(const void *k1, const void *k2) {
-    return strcmp((char *)k1, (char *)k2);
-}
-
 static const char* json_token_kind_to_string(json_token_kind kind) {
     switch (kind) {
     case JSON_TOKEN_LBRACE: return "[";
@@ -3126,7 +3655,7 @@ static int json_parser_parse_map(json_parser *parser, json_object *object) {
     json_token token = {0};
 
     object->kind = JSON_OBJECT_MAP;
-    ds_hashmap_init(&object->map, JSON_OBJECT_MAP_MAX_CAPACITY, json_object_hash, json_object_compare);
+    ds_hashmap_init(&object->map, JSON_OBJECT_MAP_MAX_CAPACITY, ds_hashmap_hash_string, ds_hashmap_compare_string);
 
     if (json_lexer_next(&parser->lexer, &token) != 0) {
         DS_LOG_ERROR("Failed to get the next token");
@@ -3175,7 +3704,14 @@ static int json_parser_parse_map(json_parser *parser, json_object *object) {
             return_defer(1);
         }
 
-        if (ds_hashmap_insert(&object->map, &kv) != 0) {
+        ds_hashmap_kv *existing = NULL;
+        if (ds_hashmap_get_ref(&object->map, kv.key, &existing) == 0) {
+            // Duplicate keys: the last value wins
+            DS_FREE(NULL, kv.key);
+            json_object_free((json_object *)existing->value);
+            DS_FREE(NULL, existing->value);
+            existing->value = kv.value;
+        } else if (ds_hashmap_insert(&object->map, &kv) != 0) {
             DS_LOG_ERROR("Failed to insert item to map");
             return_defer(1);
         }
@@ -3284,6 +3820,7 @@ static void json_parser_free(json_parser *parser) { }
 
 static int json_object_debug_indent(json_object *object, int indent) {
     int result = 0;
+    ds_hashmap_kv *kv = NULL;
 
     switch (object->kind) {
     case JSON_OBJECT_STRING:
@@ -3315,20 +3852,10 @@ static int json_object_debug_indent(json_object *object, int indent) {
         break;
     case JSON_OBJECT_MAP:
         printf("%*s[MAP]: {\n", indent, "");
-        for (int i = 0; i < object->map.capacity; i++) {
-            ds_dynamic_array bucket = object->map.buckets[i];
-
-            for (int j = 0; j < bucket.count; j++) {
-                ds_hashmap_kv kv = {0};
-                if (ds_dynamic_array_get(&bucket, j, &kv) != 0) {
-                    DS_LOG_ERROR("Failed to get item from array");
-                    return_defer(1);
-                }
-
-                printf("%*s[KEY]: \'%s\'\n", indent, "", (char *)kv.key);
-                if (json_object_debug_indent((json_object*)kv.value, indent + JSON_OBJECT_DUMP_INDENT) != 0) {
-                    return_defer(1);
-                }
+        for (unsigned int i = 0; ds_hashmap_next(&object->map, &i, &kv) == 0;) {
+            printf("%*s[KEY]: \'%s\'\n", indent, "", (char *)kv->key);
+            if (json_object_debug_indent((json_object*)kv->value, indent + JSON_OBJECT_DUMP_INDENT) != 0) {
+                return_defer(1);
             }
         }
         printf("%*s}\n", indent, "");
@@ -3342,6 +3869,7 @@ defer:
 static int json_object_dump_indent(json_object *object, unsigned int indent, const char *prefix, const char *ending, ds_string_builder *sb) {
     int result = 0;
     unsigned int count = 0;
+    ds_hashmap_kv *kv = NULL;
 
     if (prefix != NULL) {
         if (ds_string_builder_append(sb, "%s", prefix) != 0) {
@@ -3414,29 +3942,19 @@ static int json_object_dump_indent(json_object *object, unsigned int indent, con
             DS_LOG_ERROR("Failed to append string");
             return_defer(1);
         }
-        for (int i = 0, index = 0; i < object->map.capacity; i++) {
-            ds_dynamic_array bucket = object->map.buckets[i];
-
-            for (int j = 0; j < bucket.count; j++) {
-                ds_hashmap_kv kv = {0};
-                if (ds_dynamic_array_get(&bucket, j, &kv) != 0) {
-                    DS_LOG_ERROR("Failed to get item from array");
-                    return_defer(1);
-                }
-
-                if (ds_string_builder_append(sb, "%*s\"%s\":", indent + JSON_OBJECT_DUMP_INDENT, "", (char *)kv.key) != 0) {
-                    DS_LOG_ERROR("Failed to append string");
-                    return_defer(1);
-                }
-                if (json_object_dump_indent((json_object*)kv.value, indent + JSON_OBJECT_DUMP_INDENT, " ", "", sb) != 0) {
-                    DS_LOG_ERROR("Failed to dump value");
-                    return_defer(1);
-                }
+        for (unsigned int i = 0, index = 0; ds_hashmap_next(&object->map, &i, &kv) == 0;) {
+            if (ds_string_builder_append(sb, "%*s\"%s\":", indent + JSON_OBJECT_DUMP_INDENT, "", (char *)kv->key) != 0) {
+                DS_LOG_ERROR("Failed to append string");
+                return_defer(1);
+            }
+            if (json_object_dump_indent((json_object*)kv->value, indent + JSON_OBJECT_DUMP_INDENT, " ", "", sb) != 0) {
+                DS_LOG_ERROR("Failed to dump value");
+                return_defer(1);
+            }
 
-                index += 1;
-                if (index < count ) {
-                    ds_string_builder_append(sb, ",\n");
-                }
+            index += 1;
+            if (index < count ) {
+                ds_string_builder_append(sb, ",\n");
             }
         }
         if (ds_string_builder_append(sb, "\n%*s}%s", indent, "", ending) != 0) {
@@ -3453,7 +3971,7 @@ defer:
 // Load json object from a string
 //
 // Returns 0 if parsing successful. Returns 1 if it failed
-DSHDEF int json_object_load(char *buffer, unsigned int buffer_len, json_object *object) {
+DSHDEF int json_object_load(char *buffer, unsigned long buffer_len, json_object *object) {
     int result = 0;
     json_lexer lexer = {0};
     json_parser parser = {0};
@@ -3508,6 +4026,7 @@ defer:
 // Returns 0 if free is ok. Returns 1 if it failed
 DSHDEF int json_object_free(json_object *object) {
     int result = 0;
+    ds_hashmap_kv *kv = NULL;
 
     switch (object->kind) {
     case JSON_OBJECT_STRING:
@@ -3535,23 +4054,13 @@ DSHDEF int json_object_free(json_object *object) {
         ds_dynamic_array_free(&object->array);
         break;
     case JSON_OBJECT_MAP:
-        for (int i = 0; i < object->map.capacity; i++) {
-            ds_dynamic_array bucket = object->map.buckets[i];
-
-            for (int j = 0; j < bucket.count; j++) {
-                ds_hashmap_kv kv = {0};
-                if (ds_dynamic_array_get(&bucket, j, &kv) != 0) {
-                    DS_LOG_ERROR("Failed to get item from array");
-                    return_defer(1);
-                }
-
-                DS_FREE(NULL, kv.key);
-                if (json_object_free(kv.value) != 0) {
-                    DS_LOG_ERROR("Failed to free json object");
-                    return_defer(1);
-                }
-                DS_FREE(NULL, kv.value);
+        for (unsigned int i = 0; ds_hashmap_next(&object->map, &i, &kv) == 0;) {
+            DS_FREE(NULL, kv->key);
+            if (json_object_free(kv->value) != 0) {
+                DS_LOG_ERROR("Failed to free json object");
+                return_defer(1);
             }
+            DS_FREE(NULL, kv->value);
         }
         ds_hashmap_free(&object->map);
         break;
@@ -3561,4 +4070,241 @@ defer:
     return result;
 }
 
+static int json_writer_value_begin(json_writer *writer) {
+    if (writer->after_key) {
+        writer->after_key = 0;
+        return 0;
+    }
+
+    if (writer->depth == 0) {
+        return 0;
+    }
+
+    if (writer->first[writer->depth - 1]) {
+        writer->first[writer->depth - 1] = 0;
+        return 0;
+    }
+
+    return ds_string_builder_appendc(&writer->buffer, ',');
+}
+
+static int json_writer_open(json_writer *writer, char chr) {
+    if (writer->depth >= JSON_WRITER_MAX_DEPTH) {
+        DS_LOG_ERROR("JSON nesting is deeper than %d", JSON_WRITER_MAX_DEPTH);
+        return 1;
+    }
+
+    if (json_writer_value_begin(writer) != 0 || ds_string_builder_appendc(&writer->buffer, chr) != 0) {
+        return 1;
+    }
+
+    writer->first[writer->depth++] = 1;
+    return 0;
+}
+
+static int json_writer_close(json_writer *writer, char chr) {
+    if (writer->depth == 0) {
+        DS_LOG_ERROR("JSON writer has no open object or array");
+        return 1;
+    }
+
+    writer->depth -= 1;
+    return ds_string_builder_appendc(&writer->buffer, chr);
+}
+
+static int json_writer_escape(json_writer *writer, const char *str, unsigned long len) {
+    static const char hex[] = "0123456789abcdef";
+    unsigned long start = 0;
+
+    if (ds_string_builder_appendc(&writer->buffer, '"') != 0) {
+        return 1;
+    }
+
+    for (unsigned long i = 0; i < len; i++) {
+        unsigned char chr = (unsigned char)str[i];
+        char escape[6] = { '\\', 0 };
+        unsigned int escape_len = 2;
+
+        switch (chr) {
+        case '"': escape[1] = '"'; break;
+        case '\\': escape[1] = '\\'; break;
+        case '\n': escape[1] = 'n'; break;
+        case '\r': escape[1] = 'r'; break;
+        case '\t': escape[1] = 't'; break;
+        case '\b': escape[1] = 'b'; break;
+        case '\f': escape[1] = 'f'; break;
+        default:
+            if (chr >= 0x20 && chr < 0x80) {
+                continue;
+            }
+            escape[1] = 'u';
+            escape[2] = '0';
+            escape[3] = '0';
+            escape[4] = hex[chr >> 4];
+            escape[5] = hex[chr & 0xF];
+            escape_len = 6;
+            break;
+        }
+
+        if ((i > start && ds_string_builder_appendn(&writer->buffer, str + start, i - start) != 0) ||
+            ds_string_builder_appendn(&writer->buffer, escape, escape_len) != 0) {
+            return 1;
+        }
+        start = i + 1;
+    }
+
+    if (len > start && ds_string_builder_appendn(&writer->buffer, str + start, len - start) != 0) {
+        return 1;
+    }
+
+    return ds_string_builder_appendc(&writer->buffer, '"');
+}
+
+static int json_writer_literal(json_writer *writer, const char *literal, unsigned int len) {
+    if (json_writer_value_begin(writer) != 0) {
+        return 1;
+    }
+
+    return ds_string_builder_appendn(&writer->buffer, literal, len);
+}
+
+// Initialize a JSON writer that hands full buffers to write(context, ...)
+DSHDEF void json_writer_init(json_writer *writer, json_writer_write_fn *write, void *context) {
+    *writer = (json_writer){0};
+    writer->write = write;
+    writer->context = context;
+    ds_string_builder_init(&writer->buffer);
+}
+
+// Start a JSON object
+//
+// Returns 0 on success. Returns 1 if it failed
+DSHDEF int json_writer_begin_object(json_writer *writer) {
+    return json_writer_open(writer, '{');
+}
+
+// End the current JSON object
+//
+// Returns 0 on success. Returns 1 if it failed
+DSHDEF int json_writer_end_object(json_writer *writer) {
+    return json_writer_close(writer, '}');
+}
+
+// Start a JSON array
+//
+// Returns 0 on success. Returns 1 if it failed
+DSHDEF int json_writer_begin_array(json_writer *writer) {
+    return json_writer_open(writer, '[');
+}
+
+// End the current JSON array
+//
+// Returns 0 on success. Returns 1 if it failed
+DSHDEF int json_writer_end_array(json_writer *writer) {
+    return json_writer_close(writer, ']');
+}
+
+// Write the key of the next member of the current object
+//
+// Returns 0 on success. Returns 1 if it failed
+DSHDEF int json_writer_key(json_writer *writer, const char *key) {
+    if (json_writer_value_begin(writer) != 0 || json_writer_escape(writer, key, strlen(key)) != 0 ||
+        ds_string_builder_appendc(&writer->buffer, ':') != 0) {
+        return 1;
+    }
+
+    writer->after_key = 1;
+    return 0;
+}
+
+// Write a string value of len bytes
+//
+// Returns 0 on success. Returns 1 if it failed
+DSHDEF int json_writer_string(json_writer *writer, const char *str, unsigned long len) {
+    if (json_writer_value_begin(writer) != 0) {
+        return 1;
+    }
+
+    return json_writer_escape(writer, str, len);
+}
+
+// Write an integer value
+//
+// Returns 0 on success. Returns 1 if it failed
+DSHDEF int json_writer_integer(json_writer *writer, long value) {
+    char number[32];
+    int len = snprintf(number, sizeof(number), "%ld", value);
+
+    return json_writer_literal(writer, number, len);
+}
+
+// Write a number value, NaN and infinities are written as null
+//
+// Returns 0 on success. Returns 1 if it failed
+DSHDEF int json_writer_number(json_writer *writer, double value) {
+    char number[32];
+
+    if (value != value || value - value != 0) {
+        return json_writer_null(writer);
+    }
+
+    int len = snprintf(number, sizeof(number), "%.17g", value);
+    return json_writer_literal(writer, number, len);
+}
+
+// Write a boolean value
+//
+// Returns 0 on success. Returns 1 if it failed
+DSHDEF int json_writer_boolean(json_writer *writer, int value) {
+    return value ? json_writer_literal(writer, "true", 4) : json_writer_literal(writer, "false", 5);
+}
+
+// Write a null value
+//
+// Returns 0 on success. Returns 1 if it failed
+DSHDEF int json_writer_null(json_writer *writer) {
+    return json_writer_literal(writer, "null", 4);
+}
+
+// End a record with a newline, flushing the buffer once it is large enough
+//
+// Returns 0 on success. Returns 1 if it failed
+DSHDEF int json_writer_end_record(json_writer *writer) {
+    if (writer->depth != 0) {
+        DS_LOG_ERROR("JSON record ended with %u open values", writer->depth);
+        return 1;
+    }
+
+    if (ds_string_builder_appendc(&writer->buffer, '\n') != 0) {
+        return 1;
+    }
+
+    if (writer->buffer.items.count >= JSON_WRITER_FLUSH_SIZE) {
+        return json_writer_flush(writer);
+    }
+
+    return 0;
+}
+
+// Hand the buffered output to the write callback
+//
+// Returns 0 on success. Returns 1 if it failed
+DSHDEF int json_writer_flush(json_writer *writer) {
+    int result = 0;
+
+    if (writer->buffer.items.count != 0 &&
+        writer->write(writer->context, (const char *)writer->buffer.items.items, writer->buffer.items.count) != 0) {
+        DS_LOG_ERROR("Failed to write json output");
+        result = 1;
+    }
+
+    writer->buffer.items.count = 0;
+    return result;
+}
+
+// Free the buffer of the JSON writer, unflushed output is dropped
+DSHDEF void json_writer_free(json_writer *writer) {
+    ds_string_builder_free(&writer->buffer);
+}
+
 #endif // DS_JS_IMPLEMENTATION
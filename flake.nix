@@ -22,6 +22,7 @@
 
         nativeBuildInputs = with pkgs; [
           zlib
+          libdeflate
         ];
       };
   };
@@ -0,0 +1,626 @@
+// Synthetic pdf generator
+//
+// Writes a valid pdf whose shape is controlled from the command line: the
+// number of objects and pages, the size and the compression ratio of the
+// content streams, a classic or a stream xref, how many objects are packed
+// into object streams, the depth of the incremental updates and the nesting
+// of the dictionaries. The same arguments always give the same bytes, so
+// parser runs can be compared across machines and scale points.
+//
+// The file is written as it is generated and only the xref entries are kept
+// in memory, so outputs of many gigabytes can be produced.
+//
+// The parser only reads classic xref tables. A stream xref makes it rebuild
+// the table from the object headers, and the objects packed into object
+// streams are not found at all, so those scale points measure the repair
+// scan rather than the normal open.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#define PDF_IMPLEMENTATION
+#include "pdf.h"
+
+#define GEN_FIRST_PAGE 5 // 1 catalog, 2 page tree, 3 font, 4 info
+#define GEN_OBJSTM_SIZE 100 // objects packed into one object stream
+#define GEN_CLASSIC_MAX_OFFSET 9999999999ull // 10 digits of a classic xref entry
+#define GEN_LINE_TEXT 60 // characters shown by one line of content
+#define GEN_WRITE_CHUNK (1024 * 1024)
+
+// Deflated size of a line of random text and of a line of repeated text,
+// relative to the line. The content streams mix both kinds of lines to get
+// close to the requested compression ratio.
+#define GEN_RANDOM_COST 0.62
+#define GEN_REPEATED_COST 0.012
+
+typedef enum gen_xref_kind {
+    gen_xref_classic,
+    gen_xref_stream
+} gen_xref_kind;
+
+typedef struct gen_options {
+    unsigned long objects;
+    unsigned long pages;
+    unsigned long stream_size;
+    double ratio; /* 0 stores the streams without a filter */
+    gen_xref_kind xref;
+    double objstm_density; /* share of the pages and fillers in object streams */
+    unsigned long updates;
+    unsigned long nesting;
+    unsigned long long seed;
+} gen_options;
+
+// An xref entry: type 0 free, 1 at an offset, 2 inside an object stream
+typedef struct gen_entry {
+    unsigned long long field; /* offset or object stream number */
+    unsigned int index; /* generation or position in the object stream */
+    unsigned char type;
+} gen_entry;
+
+typedef struct generator {
+    gen_options options;
+    FILE *out;
+    unsigned long long offset;
+    unsigned long long random;
+    ds_dynamic_array entries; /* gen_entry, by object number */
+    unsigned long next_number; /* of the next object or xref stream */
+    ds_string_builder sb; /* the object being written */
+    ds_string_builder objstm; /* objects waiting for their object stream */
+    ds_string_builder objstm_header; /* their numbers and offsets */
+    ds_dynamic_array objstm_members; /* unsigned long */
+    double objstm_credit;
+    char *content;
+    char *compressed;
+    unsigned long compressed_capacity;
+    unsigned long long raw_bytes;
+    unsigned long long encoded_bytes;
+} generator;
+
+static unsigned long long gen_random(generator *gen) {
+    gen->random ^= gen->random << 13;
+    gen->random ^= gen->random >> 7;
+    gen->random ^= gen->random << 17;
+    return gen->random;
+}
+
+static int gen_write(generator *gen, const char *data, unsigned long len) {
+    if (len != 0 && fwrite(data, 1, len, gen->out) != len) {
+        DS_LOG_ERROR("Failed to write the output");
+        return 1;
+    }
+
+    gen->offset += len;
+    return 0;
+}
+
+static int gen_write_sb(generator *gen, ds_string_builder *sb) {
+    int result = gen_write(gen, sb->items.items, sb->items.count);
+    sb->items.count = 0;
+    return result;
+}
+
+// Set the xref entry of an object, growing the table up to its number
+static int gen_set_entry(generator *gen, unsigned long number, gen_entry entry) {
+    gen_entry free_entry = {0};
+
+    while (gen->entries.count <= number) {
+        if (ds_dynamic_array_append(&gen->entries, &free_entry) != 0) {
+            return 1;
+        }
+    }
+
+    ((gen_entry *)gen->entries.items)[number] = entry;
+    return 0;
+}
+
+// Deflate data into the reusable compression buffer
+static int gen_deflate(generator *gen, const char *data, unsigned long len, unsigned long *compressed_len) {
+    uLongf bound = compressBound(len);
+
+    if (bound > gen->compressed_capacity) {
+        char *compressed = realloc(gen->compressed, bound);
+        if (compressed == NULL) {
+            DS_LOG_ERROR("Failed to allocate %lu bytes", (unsigned long)bound);
+            return 1;
+        }
+        gen->compressed = compressed;
+        gen->compressed_capacity = bound;
+    }
+
+    if (compress2((Bytef *)gen->compressed, &bound, (const Bytef *)data, len, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        DS_LOG_ERROR("Failed to compress a stream");
+        return 1;
+    }
+
+    *compressed_len = bound;
+    return 0;
+}
+
+// Write a stream object, deflated unless the ratio is 0. The dictionary
+// entries other than the length and the filter are given in extra.
+static int gen_write_stream(generator *gen, unsigned long number, const char *extra, unsigned long extra_len,
+                            const char *data, unsigned long len) {
+    const char *encoded = data;
+    unsigned long encoded_len = len;
+
+    if (gen_set_entry(gen, number, (gen_entry){ .type = 1, .field = gen->offset }) != 0) {
+        return 1;
+    }
+
+    if (gen->options.ratio != 0) {
+        if (gen_deflate(gen, data, len, &encoded_len) != 0) {
+            return 1;
+        }
+        encoded = gen->compressed;
+        ds_string_builder_append(&gen->sb, "%lu 0 obj\n<< %.*s%s/Length %lu /Filter /FlateDecode /DL %lu >>\nstream\n",
+                                 number, (int)extra_len, extra, extra_len != 0 ? " " : "", encoded_len, len);
+    } else {
+        ds_string_builder_append(&gen->sb, "%lu 0 obj\n<< %.*s%s/Length %lu >>\nstream\n",
+                                 number, (int)extra_len, extra, extra_len != 0 ? " " : "", len);
+    }
+
+    gen->raw_bytes += len;
+    gen->encoded_bytes += encoded_len;
+
+    if (gen_write_sb(gen, &gen->sb) != 0 || gen_write(gen, encoded, encoded_len) != 0) {
+        return 1;
+    }
+    return gen_write(gen, "\nendstream\nendobj\n", 18);
+}
+
+// Pack the waiting objects into an object stream
+static int gen_flush_objstm(generator *gen) {
+    int result = 0;
+    char extra[64];
+
+    if (gen->objstm_members.count == 0) {
+        return 0;
+    }
+
+    unsigned long number = gen->next_number++;
+    for (unsigned long i = 0; i < gen->objstm_members.count; i++) {
+        unsigned long member = ((unsigned long *)gen->objstm_members.items)[i];
+        ((gen_entry *)gen->entries.items)[member].field = number;
+    }
+
+    unsigned long first = gen->objstm_header.items.count;
+    if (ds_string_builder_appendn(&gen->objstm_header, gen->objstm.items.items, gen->objstm.items.count) != 0) {
+        return_defer(1);
+    }
+
+    int extra_len = snprintf(extra, sizeof(extra), "/Type /ObjStm /N %lu /First %lu", gen->objstm_members.count, first);
+    if (gen_write_stream(gen, number, extra, extra_len, gen->objstm_header.items.items, gen->objstm_header.items.count) != 0) {
+        return_defer(1);
+    }
+
+defer:
+    gen->objstm.items.count = 0;
+    gen->objstm_header.items.count = 0;
+    gen->objstm_members.count = 0;
+    return result;
+}
+
+// Write the object held in gen->sb. Packable objects go into the object
+// stream being filled for their share of the objstm density.
+static int gen_write_object(generator *gen, unsigned long number, int packable) {
+    int result = 0;
+
+    if (packable) {
+        gen->objstm_credit += gen->options.objstm_density;
+    }
+
+    if (packable && gen->objstm_credit >= 1) {
+        gen->objstm_credit -= 1;
+
+        gen_entry entry = { .type = 2, .index = gen->objstm_members.count };
+        if (gen_set_entry(gen, number, entry) != 0 ||
+            ds_dynamic_array_append(&gen->objstm_members, &number) != 0) {
+            return_defer(1);
+        }
+
+        ds_string_builder_append(&gen->objstm_header, "%lu %lu ", number, gen->objstm.items.count);
+        ds_string_builder_appendn(&gen->objstm, gen->sb.items.items, gen->sb.items.count);
+        ds_string_builder_appendc(&gen->objstm, '\n');
+        gen->sb.items.count = 0;
+
+        if (gen->objstm_members.count == GEN_OBJSTM_SIZE) {
+            return_defer(gen_flush_objstm(gen));
+        }
+        return_defer(0);
+    }
+
+    char header[32];
+    int header_len = snprintf(header, sizeof(header), "%lu 0 obj\n", number);
+    if (gen_set_entry(gen, number, (gen_entry){ .type = 1, .field = gen->offset }) != 0 ||
+        gen_write(gen, header, header_len) != 0 ||
+        gen_write(gen, gen->sb.items.items, gen->sb.items.count) != 0 ||
+        gen_write(gen, "\nendobj\n", 8) != 0) {
+        return_defer(1);
+    }
+
+defer:
+    gen->sb.items.count = 0;
+    return result;
+}
+
+// A dictionary with options.nesting levels of dictionaries inside
+static int gen_filler(generator *gen, unsigned long number) {
+    ds_string_builder_append(&gen->sb, "<< /Type /Filler /Id %lu", number);
+    for (unsigned long level = 0; level < gen->options.nesting; level++) {
+        ds_string_builder_append(&gen->sb, " /Level << /Depth %lu /Values [%lu %lu.5 (filler %lu) /Name%lu true null] /Page %d 0 R",
+                                 level + 1, number, level, number, level, GEN_FIRST_PAGE);
+    }
+    for (unsigned long level = 0; level < gen->options.nesting; level++) {
+        ds_string_builder_append(&gen->sb, " >>");
+    }
+    ds_string_builder_append(&gen->sb, " >>");
+
+    return gen_write_object(gen, number, 1);
+}
+
+// Lines of text, random ones mixed with repeated ones to hit the ratio
+static unsigned long gen_content(generator *gen, unsigned long page) {
+    static const char charset[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 .,;:!?-+*/=<>[]{}#$&@";
+    unsigned long size = gen->options.stream_size;
+    unsigned long len = 0;
+    double random_share = 0;
+
+    if (gen->options.ratio != 0) {
+        random_share = (1.0 / gen->options.ratio - GEN_REPEATED_COST) / (GEN_RANDOM_COST - GEN_REPEATED_COST);
+        random_share = DS_MAX(0.0, DS_MIN(1.0, random_share));
+    }
+
+    for (unsigned long line = 0; len < size; line++) {
+        char text[GEN_LINE_TEXT + 24];
+        char buffer[160];
+
+        if ((gen_random(gen) % 1000000) < random_share * 1000000) {
+            for (int i = 0; i < GEN_LINE_TEXT; i++) {
+                text[i] = charset[gen_random(gen) % (sizeof(charset) - 1)];
+            }
+            text[GEN_LINE_TEXT] = '\0';
+        } else {
+            snprintf(text, sizeof(text), "The quick brown fox jumps over the lazy dog on page %lu", page + 1);
+        }
+
+        unsigned long n = snprintf(buffer, sizeof(buffer), "BT /F1 12 Tf 72 %lu Td (%s) Tj ET\n", 720 - line % 700, text);
+        n = DS_MIN(n, size - len);
+        memcpy(gen->content + len, buffer, n);
+        len += n;
+    }
+
+    return len;
+}
+
+static int gen_page(generator *gen, unsigned long page) {
+    unsigned long number = GEN_FIRST_PAGE + 2 * page;
+
+    ds_string_builder_append(&gen->sb, "<< /Type /Page /Parent 2 0 R /MediaBox [0 0 612 792] "
+                             "/Resources << /Font << /F1 3 0 R >> >> /Contents %lu 0 R >>", number + 1);
+    if (gen_write_object(gen, number, 1) != 0) {
+        return 1;
+    }
+
+    unsigned long len = gen_content(gen, page);
+    return gen_write_stream(gen, number + 1, "", 0, gen->content, len);
+}
+
+// Write an xref section and its trailer. The section covers the objects in
+// numbers, or every object when numbers is NULL, and points back at prev
+// unless it is 0.
+static int gen_xref(generator *gen, unsigned long *numbers, unsigned long count, unsigned long long prev,
+                    unsigned long long *startxref) {
+    int result = 0;
+    ds_string_builder rows = {0};
+    ds_string_builder dictionary = {0};
+    char prev_entry[48] = "";
+
+    ds_string_builder_init(&rows);
+    ds_string_builder_init(&dictionary);
+    if (prev != 0) {
+        snprintf(prev_entry, sizeof(prev_entry), " /Prev %llu", prev);
+    }
+
+    if (gen->options.xref == gen_xref_classic) {
+        unsigned long size = gen->entries.count;
+        gen_entry *entries = (gen_entry *)gen->entries.items;
+
+        if (gen->offset > GEN_CLASSIC_MAX_OFFSET) {
+            DS_LOG_ERROR("Offsets past %llu bytes do not fit a classic xref, use --xref stream", GEN_CLASSIC_MAX_OFFSET);
+            return_defer(1);
+        }
+
+        *startxref = gen->offset;
+        if (numbers == NULL) {
+            count = size;
+            ds_string_builder_append(&rows, "xref\n0 %lu\n", size);
+        } else {
+            ds_string_builder_append(&rows, "xref\n0 1\n0000000000 65535 f \n");
+        }
+
+        for (unsigned long i = 0; i < count; i++) {
+            unsigned long number = numbers == NULL ? i : numbers[i];
+            gen_entry entry = entries[number];
+
+            if (numbers != NULL) {
+                ds_string_builder_append(&rows, "%lu 1\n", number);
+            }
+
+            if (entry.type == 1) {
+                ds_string_builder_append(&rows, "%010llu %05u n \n", entry.field, entry.index);
+            } else {
+                ds_string_builder_append(&rows, "0000000000 65535 f \n");
+            }
+
+            if (rows.items.count >= GEN_WRITE_CHUNK && gen_write_sb(gen, &rows) != 0) {
+                return_defer(1);
+            }
+        }
+
+        ds_string_builder_append(&rows, "trailer\n<< /Size %lu /Root 1 0 R /Info 4 0 R%s >>\n", size, prev_entry);
+        if (gen_write_sb(gen, &rows) != 0) {
+            return_defer(1);
+        }
+    } else {
+        // the xref stream is an object too and has an entry of its own
+        unsigned long number = gen->next_number++;
+        *startxref = gen->offset;
+        if (gen_set_entry(gen, number, (gen_entry){ .type = 1, .field = *startxref }) != 0) {
+            return_defer(1);
+        }
+
+        unsigned long size = gen->entries.count;
+        gen_entry *entries = (gen_entry *)gen->entries.items;
+
+        ds_string_builder_append(&dictionary, "/Type /XRef /Size %lu /W [1 8 2] /Root 1 0 R /Info 4 0 R%s /Index [", size, prev_entry);
+        if (numbers == NULL) {
+            count = size;
+            ds_string_builder_append(&dictionary, "0 %lu", size);
+        }
+
+        for (unsigned long i = 0; i < count + (numbers != NULL); i++) {
+            unsigned long current = numbers == NULL ? i : i == count ? number : numbers[i];
+            gen_entry entry = entries[current];
+            unsigned int index = entry.type == 0 ? 0xffff : entry.index;
+
+            if (numbers != NULL) {
+                ds_string_builder_append(&dictionary, "%s%lu 1", i == 0 ? "" : " ", current);
+            }
+
+            ds_string_builder_appendc(&rows, entry.type);
+            for (int shift = 56; shift >= 0; shift -= 8) {
+                ds_string_builder_appendc(&rows, (entry.field >> shift) & 0xff);
+            }
+            ds_string_builder_appendc(&rows, (index >> 8) & 0xff);
+            ds_string_builder_appendc(&rows, index & 0xff);
+        }
+
+        ds_string_builder_append(&dictionary, "]");
+        if (gen_write_stream(gen, number, dictionary.items.items, dictionary.items.count, rows.items.items, rows.items.count) != 0) {
+            return_defer(1);
+        }
+    }
+
+    ds_string_builder_append(&gen->sb, "startxref\n%llu\n%%%%EOF\n", *startxref);
+    if (gen_write_sb(gen, &gen->sb) != 0) {
+        return_defer(1);
+    }
+
+defer:
+    ds_string_builder_free(&rows);
+    ds_string_builder_free(&dictionary);
+    return result;
+}
+
+// Rewrite the info dictionary and one page per update, each update with an
+// xref section that only covers them
+static int gen_updates(generator *gen, unsigned long long startxref) {
+    for (unsigned long update = 1; update <= gen->options.updates; update++) {
+        unsigned long page = (update - 1) % gen->options.pages;
+        unsigned long numbers[2] = { 4, GEN_FIRST_PAGE + 2 * page };
+
+        ds_string_builder_append(&gen->sb, "<< /Producer (pdfgen) /Revision %lu >>", update);
+        if (gen_write_object(gen, numbers[0], 0) != 0) {
+            return 1;
+        }
+
+        ds_string_builder_append(&gen->sb, "<< /Type /Page /Parent 2 0 R /MediaBox [0 0 612 792] /Rotate %lu "
+                                 "/Resources << /Font << /F1 3 0 R >> >> /Contents %lu 0 R >>",
+                                 (update * 90) % 360, numbers[1] + 1);
+        if (gen_write_object(gen, numbers[1], 0) != 0) {
+            return 1;
+        }
+
+        if (gen_xref(gen, numbers, 2, startxref, &startxref) != 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int gen_document(generator *gen) {
+    int result = 0;
+    unsigned long long startxref = 0;
+    unsigned long fillers_start = GEN_FIRST_PAGE + 2 * gen->options.pages;
+
+    if (gen->options.xref == gen_xref_stream) {
+        result = gen_write(gen, "%PDF-1.5\n%\xe2\xe3\xcf\xd3\n", 15);
+    } else {
+        result = gen_write(gen, "%PDF-1.4\n%\xe2\xe3\xcf\xd3\n", 15);
+    }
+    if (result != 0) {
+        return_defer(1);
+    }
+
+    ds_string_builder_append(&gen->sb, "<< /Type /Catalog /Pages 2 0 R >>");
+    if (gen_write_object(gen, 1, 0) != 0) {
+        return_defer(1);
+    }
+
+    ds_string_builder_append(&gen->sb, "<< /Type /Pages /Count %lu /Kids [", gen->options.pages);
+    for (unsigned long page = 0; page < gen->options.pages; page++) {
+        ds_string_builder_append(&gen->sb, "%s%lu 0 R", page == 0 ? "" : " ", GEN_FIRST_PAGE + 2 * page);
+    }
+    ds_string_builder_append(&gen->sb, "] >>");
+    if (gen_write_object(gen, 2, 0) != 0) {
+        return_defer(1);
+    }
+
+    ds_string_builder_append(&gen->sb, "<< /Type /Font /Subtype /Type1 /BaseFont /Helvetica >>");
+    if (gen_write_object(gen, 3, 0) != 0) {
+        return_defer(1);
+    }
+
+    ds_string_builder_append(&gen->sb, "<< /Producer (pdfgen) /Revision 0 >>");
+    if (gen_write_object(gen, 4, 0) != 0) {
+        return_defer(1);
+    }
+
+    for (unsigned long page = 0; page < gen->options.pages; page++) {
+        if (gen_page(gen, page) != 0) {
+            return_defer(1);
+        }
+    }
+
+    for (unsigned long number = fillers_start; number <= gen->options.objects; number++) {
+        if (gen_filler(gen, number) != 0) {
+            return_defer(1);
+        }
+    }
+
+    if (gen_flush_objstm(gen) != 0 || gen_xref(gen, NULL, 0, 0, &startxref) != 0) {
+        return_defer(1);
+    }
+
+    if (gen_updates(gen, startxref) != 0 || fflush(gen->out) != 0) {
+        return_defer(1);
+    }
+
+defer:
+    return result;
+}
+
+int main(int argc, char **argv) {
+    int result = 0;
+    generator gen = {0};
+    ds_argparse_parser parser;
+    ds_argparse_parser_init(&parser, "pdf-gen", "Generate synthetic pdf files for load testing", "0.1");
+
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'o', .long_name = "output", .description = "The output pdf file, - for stdout", .type = ARGUMENT_TYPE_POSITIONAL, .required = 1 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'n', .long_name = "objects", .description = "Number of objects, raised to fit the pages (object and xref streams come on top)", .type = ARGUMENT_TYPE_VALUE, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'p', .long_name = "pages", .description = "Number of pages, each with a content stream", .type = ARGUMENT_TYPE_VALUE, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 's', .long_name = "stream-size", .description = "Decoded bytes of each content stream", .type = ARGUMENT_TYPE_VALUE, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'r', .long_name = "ratio", .description = "Target compression ratio of the streams, at least 1.6 (0 leaves them uncompressed)", .type = ARGUMENT_TYPE_VALUE, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'x', .long_name = "xref", .description = "Kind of xref: classic or stream", .type = ARGUMENT_TYPE_VALUE, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'O', .long_name = "objstm", .description = "Share of the pages and fillers stored in object streams, from 0 to 1 (needs --xref stream)", .type = ARGUMENT_TYPE_VALUE, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'u', .long_name = "updates", .description = "Number of incremental updates appended to the file", .type = ARGUMENT_TYPE_VALUE, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'N', .long_name = "nesting", .description = "Depth of the dictionaries nested inside each filler object", .type = ARGUMENT_TYPE_VALUE, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'S', .long_name = "seed", .description = "Seed of the random content", .type = ARGUMENT_TYPE_VALUE, .required = 0 });
+
+    if (ds_argparse_parse(&parser, argc, argv) != 0) {
+        DS_LOG_ERROR("Failed to parse arguments");
+        return_defer(-1);
+    }
+
+    gen.options = (gen_options){ .objects = 1000, .pages = 100, .stream_size = 16384, .ratio = 4,
+                                 .xref = gen_xref_classic, .nesting = 2, .seed = 1 };
+
+    char *output = ds_argparse_get_value(&parser, "output");
+    char *value = NULL;
+
+    if ((value = ds_argparse_get_value(&parser, "objects")) != NULL) {
+        gen.options.objects = strtoul(value, NULL, 10);
+    }
+    if ((value = ds_argparse_get_value(&parser, "pages")) != NULL) {
+        gen.options.pages = strtoul(value, NULL, 10);
+    }
+    if ((value = ds_argparse_get_value(&parser, "stream-size")) != NULL) {
+        gen.options.stream_size = strtoul(value, NULL, 10);
+    }
+    if ((value = ds_argparse_get_value(&parser, "ratio")) != NULL) {
+        gen.options.ratio = strtod(value, NULL);
+    }
+    if ((value = ds_argparse_get_value(&parser, "objstm")) != NULL) {
+        gen.options.objstm_density = strtod(value, NULL);
+    }
+    if ((value = ds_argparse_get_value(&parser, "updates")) != NULL) {
+        gen.options.updates = strtoul(value, NULL, 10);
+    }
+    if ((value = ds_argparse_get_value(&parser, "nesting")) != NULL) {
+        gen.options.nesting = strtoul(value, NULL, 10);
+    }
+    if ((value = ds_argparse_get_value(&parser, "seed")) != NULL) {
+        gen.options.seed = strtoull(value, NULL, 10);
+    }
+    if ((value = ds_argparse_get_value(&parser, "xref")) != NULL) {
+        if (strcmp(value, "stream") == 0) {
+            gen.options.xref = gen_xref_stream;
+        } else if (strcmp(value, "classic") != 0) {
+            DS_LOG_ERROR("Unknown xref kind %s", value);
+            return_defer(-1);
+        }
+    }
+
+    if (gen.options.pages == 0) {
+        DS_LOG_ERROR("A pdf needs at least one page");
+        return_defer(-1);
+    }
+    if (gen.options.ratio != 0 && gen.options.ratio < 1) {
+        DS_LOG_ERROR("The compression ratio must be 0 or at least 1");
+        return_defer(-1);
+    }
+    if (gen.options.objstm_density < 0 || gen.options.objstm_density > 1) {
+        DS_LOG_ERROR("The objstm share must be between 0 and 1");
+        return_defer(-1);
+    }
+    if (gen.options.objstm_density > 0 && gen.options.xref != gen_xref_stream) {
+        DS_LOG_ERROR("Object streams need --xref stream");
+        return_defer(-1);
+    }
+    gen.options.objects = DS_MAX(gen.options.objects, GEN_FIRST_PAGE - 1 + 2 * gen.options.pages);
+
+    gen.next_number = gen.options.objects + 1;
+    gen.random = gen.options.seed * 0x9e3779b97f4a7c15ull + 1;
+    ds_dynamic_array_init(&gen.entries, sizeof(gen_entry));
+    ds_dynamic_array_init(&gen.objstm_members, sizeof(unsigned long));
+    ds_string_builder_init(&gen.sb);
+    ds_string_builder_init(&gen.objstm);
+    ds_string_builder_init(&gen.objstm_header);
+
+    gen.content = malloc(DS_MAX(gen.options.stream_size, 1));
+    if (gen.content == NULL) {
+        DS_LOG_ERROR("Failed to allocate %lu bytes", gen.options.stream_size);
+        return_defer(-1);
+    }
+
+    gen.out = strcmp(output, "-") == 0 ? stdout : fopen(output, "wb");
+    if (gen.out == NULL) {
+        DS_LOG_ERROR("Failed to open %s", output);
+        return_defer(-1);
+    }
+    setvbuf(gen.out, NULL, _IOFBF, GEN_WRITE_CHUNK);
+
+    if (gen_document(&gen) != 0) {
+        return_defer(-1);
+    }
+
+    DS_LOG_INFO("Wrote %llu bytes with %lu objects, streams %llu bytes deflated to %llu (ratio %.2f)",
+                gen.offset, gen.entries.count - 1, gen.raw_bytes, gen.encoded_bytes,
+                gen.encoded_bytes != 0 ? (double)gen.raw_bytes / gen.encoded_bytes : 0.0);
+
+defer:
+    if (gen.out != NULL && gen.out != stdout && fclose(gen.out) != 0) {
+        DS_LOG_ERROR("Failed to write %s", output);
+        result = -1;
+    }
+    ds_dynamic_array_free(&gen.entries);
+    ds_dynamic_array_free(&gen.objstm_members);
+    ds_string_builder_free(&gen.sb);
+    ds_string_builder_free(&gen.objstm);
+    ds_string_builder_free(&gen.objstm_header);
+    free(gen.content);
+    free(gen.compressed);
+    ds_argparse_parser_free(&parser);
+    return result;
+}
@@ -1,180 +1,722 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
-#include <assert.h>
-#define PDF_IMPLEMENTATION
-#include "pdf.h"
-#include "zlib.h"
-
-filter_kind get_filter_kind(ds_dynamic_array dictionary /* object_kv */) {
-    for (int i = 0; i < dictionary.count; i++) {
-        object_kv kv = {0};
-        ds_dynamic_array_get(&dictionary, i, &kv);
-
-        if (strncmp(kv.name, "Filter", 6) == 0) {
-            assert(kv.object.kind == object_name);
-
-            if (strncmp(kv.object.name, "FlateDecode", 11) == 0) {
-                return filter_flate_decode;
-            } else if (strncmp(kv.object.name, "DCTDecode", 9) == 0) {
-                return filter_dct_decode;
-            }
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// the command line only parses its arguments and writes the end records of
+// --serve with ds.h, the allocation tracker belongs to the library
+#undef DS_TRACK_ALLOCATIONS
+#define DS_AP_IMPLEMENTATION
+#define DS_JS_IMPLEMENTATION
+#include "ds.h"
+#include "pdfparser.h"
+
+void print_document(pdf_document *document) {
+    pdf_document_info info;
+    pdf_document_get_info(document, &info);
+    printf("startxref: %ld\n", info.startxref);
+
+    for (unsigned long i = 0; i < info.trailer_count; i++) {
+        printf("trailer: %s\n", pdf_document_trailer_key(document, i));
+    }
+
+    for (unsigned long i = 0; i < info.xref_count; i++) {
+        pdf_document_xref entry = {0};
+        pdf_document_get_xref(document, i, &entry);
+        printf("xref: %lu %d %c\n", entry.offset, entry.generation_number, entry.in_use);
+    }
+
+    for (unsigned long i = 0; i < info.recovered_count; i++) {
+        pdf_document_xref entry = {0};
+        pdf_document_get_recovered(document, i, &entry);
+        printf("recovered: %d %d %lu\n", entry.object_number, entry.generation_number, entry.offset);
+    }
+}
+
+// Print a regular pdf file and extract its streams into path through
+// libpdfparser
+//
+// Returns 0 on success. Returns 1 when the file can not be opened or written.
+int extract_document(const char *filename, const pdf_document_options *options, const char *path, int archive,
+                     unsigned int jobs) {
+    int result = 0;
+    pdf_document *document = NULL;
+
+    int error = pdf_document_open(filename, options, &document);
+    if (error != PDF_DOCUMENT_OK) {
+        DS_LOG_ERROR("Failed to parse the buffer: %s", pdf_document_error_string(error));
+        return_defer(1);
+    }
+
+    print_document(document);
+
+    error = pdf_document_extract(document, path, archive, jobs);
+    if (error != PDF_DOCUMENT_OK) {
+        DS_LOG_ERROR("Failed to extract the streams: %s", pdf_document_error_string(error));
+        return_defer(1);
+    }
+
+    if (options->cache_bytes != 0) {
+        pdf_document_info info;
+        pdf_document_get_info(document, &info);
+        printf("stream cache: %lu hits %lu misses %lu evictions %lu bytes in %lu streams\n",
+               info.cache_hits, info.cache_misses, info.cache_evictions, info.cache_bytes, info.cache_count);
+    }
+
+defer:
+    pdf_document_close(document);
+    return result;
+}
+
+int write_output(void *context, const char *data, unsigned long len) {
+    return fwrite(data, 1, len, (FILE *)context) == len ? 0 : 1;
+}
+
+// Write the ndjson records of a regular pdf file, then extract its streams
+// into path when one is given
+//
+// Returns 0 on success. Returns 1 when the file can not be opened or written.
+int write_document(const char *filename, const pdf_document_options *options, const char *path, int archive,
+                   unsigned int jobs) {
+    int result = 0;
+    pdf_document *document = NULL;
+
+    int error = pdf_document_open(filename, options, &document);
+    if (error != PDF_DOCUMENT_OK) {
+        DS_LOG_ERROR("Failed to parse the buffer: %s", pdf_document_error_string(error));
+        return_defer(1);
+    }
+
+    if (pdf_document_write_metadata(document, write_output, stdout) != PDF_DOCUMENT_OK ||
+        pdf_document_write_pages(document, 0, ULONG_MAX, PDF_DOCUMENT_PAGE_TEXT | PDF_DOCUMENT_PAGE_IMAGES,
+                                 write_output, stdout) != PDF_DOCUMENT_OK) {
+        DS_LOG_ERROR("Failed to write the records");
+        return_defer(1);
+    }
+
+    // the records carry the text, files are only written when asked for
+    if (path != NULL) {
+        error = pdf_document_extract(document, path, archive, jobs);
+        if (error != PDF_DOCUMENT_OK) {
+            DS_LOG_ERROR("Failed to extract the streams: %s", pdf_document_error_string(error));
+            return_defer(1);
         }
     }
 
-    return 2;
+defer:
+    pdf_document_close(document);
+    return result;
 }
 
-void show_text(ds_string_slice stream, char *filename, indirect_object object) {
-    Bytef *source = (Bytef *)(stream.str);
-    uLong sourceLen = (uLong)(stream.len);
-    uLongf destLen = sourceLen * 8;
-    Bytef *dest = calloc(sizeof(Bytef), destLen);
-    int result = uncompress(dest, &destLen, source, sourceLen);
-    if (result != Z_OK) {
-        DS_LOG_ERROR("Failed to uncompress data at : %d", result);
+// Documents kept open by --serve, the least recently used one is closed first
+#define SERVE_DOCUMENTS 16
+// Longest request line, a path plus the operation and the page range
+#define SERVE_REQUEST_MAX (PATH_MAX + 64)
+
+// A document kept open between requests together with its resolved objects
+// and its decoded stream cache. It is reopened when the file changes.
+typedef struct serve_document {
+    char *path; /* NULL when the slot is free */
+    struct stat st;
+    pdf_document *document;
+    unsigned int refs;
+    unsigned long long used; /* tick of the last request */
+    int cached; /* 0 for a document opened for one request */
+    int opening; /* set while a worker opens the file outside the lock */
+    int catalog; /* 0 when the trailer has no /Root dictionary */
+} serve_document;
+
+typedef struct serve_context {
+    int fd; /* listening socket */
+    const pdf_document_options *options;
+    pthread_mutex_t lock;
+    pthread_cond_t opened; /* signaled when a worker is done opening a slot */
+    serve_document documents[SERVE_DOCUMENTS];
+    unsigned long long ticks;
+    atomic_int stopping;
+    int *clients; /* connection of each worker, -1 when idle */
+} serve_context;
+
+typedef struct serve_worker {
+    serve_context *context;
+    unsigned int index;
+} serve_worker;
+
+// Open the file of a slot claimed by serve_acquire. Only the worker that
+// claimed the slot touches these fields, so it runs outside the lock
+static int serve_open_document(serve_context *context, serve_document *document) {
+    pdf_document_info info;
+
+    if (pdf_document_open(document->path, context->options, &document->document) != PDF_DOCUMENT_OK) {
+        return 1;
     }
 
-    ds_string_builder string_builder;
-    ds_string_builder_init(&string_builder);
-    char *text = (char *)dest;
-    int text_len = (int)destLen;
+    pdf_document_get_info(document->document, &info);
+    document->catalog = info.catalog;
+    return 0;
+}
+
+static void serve_close_document(serve_document *document) {
+    pdf_document_close(document->document);
+    free(document->path);
+    *document = (serve_document){0};
+}
+
+static int serve_same_file(struct stat *a, struct stat *b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
 
-    for (int j = 0; j < text_len; j++) {
-        if (text[j] == '(') {
-            j = j + 1;
+// Get the open document of a path, opening it if it is not cached or if the
+// file changed since it was opened. When every slot is in use the document
+// is opened for this request only. The file is opened and the evicted
+// document is closed outside the lock, the other requests for the file wait
+// until it is ready
+//
+// Returns 0 on success. Returns 1 if the file could not be opened
+static int serve_acquire(serve_context *context, const char *path, serve_document **document) {
+    int result = 0;
+    struct stat st;
+    serve_document *slot = NULL;
+    serve_document evicted = {0};
 
-            for (; j < text_len; j++) {
-                if (text[j] == ')') {
-                    break;
-                }
+    *document = NULL;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&context->lock);
+    for (;;) {
+        serve_document *match = NULL;
+        slot = NULL;
+        for (unsigned int i = 0; i < SERVE_DOCUMENTS && match == NULL; i++) {
+            serve_document *candidate = context->documents + i;
+            if (candidate->path != NULL && strcmp(candidate->path, path) == 0 && serve_same_file(&candidate->st, &st)) {
+                match = candidate;
+            }
 
-                ds_string_builder_appendc(&string_builder, text[j]);
+            // a free slot first, then the least recently used document
+            if (candidate->refs == 0 && (slot == NULL || candidate->path == NULL || (slot->path != NULL && candidate->used < slot->used))) {
+                slot = candidate;
             }
         }
+
+        if (match == NULL) {
+            break;
+        }
+
+        if (!match->opening) {
+            match->refs += 1;
+            match->used = ++context->ticks;
+            *document = match;
+            return_defer(0);
+        }
+
+        // the slot is freed again if the other worker fails to open it
+        pthread_cond_wait(&context->opened, &context->lock);
+    }
+
+    int cached = slot != NULL;
+    if (slot == NULL) {
+        slot = malloc(sizeof(serve_document));
+        if (slot == NULL) {
+            return_defer(1);
+        }
+    } else if (slot->path != NULL) {
+        // freeing a large document takes a while, it is closed once the lock
+        // is released
+        evicted = *slot;
+    }
+
+    *slot = (serve_document){ .path = strdup(path), .st = st, .refs = 1, .used = ++context->ticks, .cached = cached, .opening = 1 };
+    if (slot->path == NULL) {
+        *slot = (serve_document){0};
+        if (!cached) {
+            free(slot);
+        }
+        return_defer(1);
+    }
+    pthread_mutex_unlock(&context->lock);
+    serve_close_document(&evicted);
+
+    // opening only reads the xref table and the page tree, the objects are
+    // resolved by the requests that need them
+    int opened = serve_open_document(context, slot);
+
+    pthread_mutex_lock(&context->lock);
+    if (opened != 0) {
+        DS_LOG_ERROR("Failed to open %s", path);
+        serve_close_document(slot);
+        if (!cached) {
+            free(slot);
+        }
+        result = 1;
+    } else {
+        slot->opening = 0;
+        *document = slot;
+    }
+    pthread_cond_broadcast(&context->opened);
+
+defer:
+    pthread_mutex_unlock(&context->lock);
+    serve_close_document(&evicted);
+    return result;
+}
+
+static void serve_release(serve_context *context, serve_document *document) {
+    if (!document->cached) {
+        serve_close_document(document);
+        free(document);
+        return;
+    }
+
+    pthread_mutex_lock(&context->lock);
+    document->refs -= 1;
+    pthread_mutex_unlock(&context->lock);
+}
+
+static int write_socket(void *context, const char *data, unsigned long len) {
+    int fd = *(int *)context;
+
+    while (len > 0) {
+        ssize_t written = send(fd, data, len, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return 1;
+        }
+
+        data += written;
+        len -= written;
+    }
+
+    return 0;
+}
+
+// Answer one request line, writing its records followed by an end record
+// that carries the error of the request, or null
+//
+// Requests are `metadata <path>`, `text <first> <last> <path>` and
+// `images <first> <last> <path>`, page ranges are inclusive and clamped to
+// the pages of the document
+//
+// Returns 0 on success. Returns 1 if the connection failed
+static int serve_request(serve_context *context, json_writer *writer, char *line) {
+    const char *error = NULL;
+    serve_document *document = NULL;
+    unsigned long first = 0;
+    unsigned long last = 0;
+    unsigned int fields = 0;
+    char *path = strchr(line, ' ');
+
+    if (path != NULL) {
+        *path++ = '\0';
+    }
+
+    if (strcmp(line, "text") == 0) {
+        fields = PDF_DOCUMENT_PAGE_TEXT;
+    } else if (strcmp(line, "images") == 0) {
+        fields = PDF_DOCUMENT_PAGE_IMAGES;
+    } else if (strcmp(line, "metadata") != 0) {
+        error = "unknown operation";
+    }
+
+    if (error == NULL && fields != 0 && path != NULL) {
+        char *end = NULL;
+        first = strtoul(path, &end, 10);
+        last = end != path && *end == ' ' ? strtoul(end + 1, &end, 10) : 0;
+        path = *end == ' ' && first <= last ? end + 1 : NULL;
+    }
+
+    if (error == NULL && (path == NULL || *path == '\0')) {
+        error = "malformed request";
+    }
+
+    if (error == NULL && serve_acquire(context, path, &document) != 0) {
+        error = "failed to open the document";
+    }
+
+    // the metadata record is still written, with no pages
+    if (document != NULL && !document->catalog) {
+        error = "the document has no catalog";
+    }
+
+    // the records go straight to the socket, the writer only holds the end
+    // record and is empty here
+    if (document != NULL && fields == 0 &&
+        pdf_document_write_metadata(document->document, writer->write, writer->context) != PDF_DOCUMENT_OK) {
+        serve_release(context, document);
+        return 1;
+    }
+
+    if (document != NULL && fields != 0 &&
+        pdf_document_write_pages(document->document, first, last, fields, writer->write, writer->context) != PDF_DOCUMENT_OK) {
+        serve_release(context, document);
+        return 1;
     }
 
-    char *plain_text = NULL;
-    result = ds_string_builder_build(&string_builder, &plain_text);
-    if (result != 0) {
-        DS_LOG_ERROR("Could not extract text");
+    if (document != NULL) {
+        serve_release(context, document);
+    }
+
+    if (json_writer_begin_object(writer) != 0 ||
+        json_writer_key(writer, "type") != 0 || json_writer_string(writer, "end", 3) != 0 ||
+        json_writer_key(writer, "error") != 0 ||
+        (error != NULL ? json_writer_string(writer, error, strlen(error)) : json_writer_null(writer)) != 0 ||
+        json_writer_end_object(writer) != 0 || json_writer_end_record(writer) != 0) {
+        return 1;
+    }
+
+    return json_writer_flush(writer);
+}
+
+// Answer the requests of a connection, one per line, until the client hangs
+// up
+static void serve_connection(serve_context *context, int fd) {
+    char request[SERVE_REQUEST_MAX];
+    unsigned long len = 0;
+    json_writer writer = {0};
+
+    json_writer_init(&writer, write_socket, &fd);
+    for (;;) {
+        char *newline = memchr(request, '\n', len);
+        if (newline == NULL && len == sizeof(request)) {
+            DS_LOG_WARN("Request longer than %d bytes", SERVE_REQUEST_MAX);
+            break;
+        }
+
+        if (newline == NULL) {
+            ssize_t count = read(fd, request + len, sizeof(request) - len);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                break;
+            }
+            len += count;
+            continue;
+        }
+
+        *newline = '\0';
+        if (newline > request && newline[-1] == '\r') {
+            newline[-1] = '\0';
+        }
+        if (serve_request(context, &writer, request) != 0) {
+            break;
+        }
+
+        len -= newline + 1 - request;
+        memmove(request, newline + 1, len);
     }
 
-    ds_string_builder sb = {0};
-    ds_string_builder_init(&sb);
+    json_writer_free(&writer);
+}
+
+static void *serve_worker_main(void *arg) {
+    serve_worker *worker = arg;
+    serve_context *context = worker->context;
+
+    while (!atomic_load(&context->stopping)) {
+        int fd = accept(context->fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && !atomic_load(&context->stopping)) {
+                DS_LOG_ERROR("Failed to accept a connection: %s", strerror(errno));
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&context->lock);
+        context->clients[worker->index] = fd;
+        pthread_mutex_unlock(&context->lock);
 
-    ds_string_builder_append(&sb, "%s_%d_%d.txt", filename, object.object_number, object.generation_number);
+        if (!atomic_load(&context->stopping)) {
+            serve_connection(context, fd);
+        }
+
+        pthread_mutex_lock(&context->lock);
+        context->clients[worker->index] = -1;
+        pthread_mutex_unlock(&context->lock);
+        close(fd);
+    }
 
-    char *path = NULL;
-    ds_string_builder_build(&sb, &path);
-    ds_io_write(path, plain_text, strlen(plain_text), "w");
+    pdf_document_release_thread();
+    return NULL;
 }
 
-void show_image(ds_string_slice stream, char *filename, indirect_object object) {
-    ds_string_builder sb = {0};
-    ds_string_builder_init(&sb);
+// Listen on a Unix socket and answer requests on jobs threads until SIGINT or
+// SIGTERM. Documents stay open between requests so that repeated requests
+// reuse the resolved objects and the decoded streams
+//
+// Returns 0 on success. Returns 1 if the socket could not be set up
+int serve(const char *path, const pdf_document_options *options, unsigned int jobs) {
+    int result = 0;
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    struct stat st;
+    sigset_t signals;
+    int received = 0;
+    pthread_t *threads = NULL;
+    serve_worker *workers = NULL;
+    unsigned int started = 0;
+    int bound = 0;
+    serve_context context = { .fd = -1, .options = options };
+
+    pthread_mutex_init(&context.lock, NULL);
+    pthread_cond_init(&context.opened, NULL);
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        DS_LOG_ERROR("Socket path %s is too long", path);
+        return_defer(1);
+    }
+    strcpy(address.sun_path, path);
+
+    // a socket left behind by a previous server is replaced
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    // any client that connects reads the files of this user, so the socket
+    // is created 0600 before the workers start
+    mode_t mask = umask(0177);
+    context.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (context.fd < 0 || bind(context.fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        DS_LOG_ERROR("Failed to bind %s: %s", path, strerror(errno));
+        umask(mask);
+        return_defer(1);
+    }
+    umask(mask);
+    bound = 1;
+    if (listen(context.fd, SOMAXCONN) != 0) {
+        DS_LOG_ERROR("Failed to listen on %s: %s", path, strerror(errno));
+        return_defer(1);
+    }
+
+    threads = calloc(jobs, sizeof(pthread_t));
+    workers = calloc(jobs, sizeof(serve_worker));
+    context.clients = calloc(jobs, sizeof(int));
+    if (threads == NULL || workers == NULL || context.clients == NULL) {
+        return_defer(1);
+    }
+
+    // the workers inherit the mask, the signals are only taken by sigwait
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    for (; started < jobs; started++) {
+        workers[started] = (serve_worker){ .context = &context, .index = started };
+        context.clients[started] = -1;
+        if (pthread_create(threads + started, NULL, serve_worker_main, workers + started) != 0) {
+            DS_LOG_ERROR("Failed to start the workers");
+            return_defer(1);
+        }
+    }
+
+    DS_LOG_INFO("Serving on %s with %u workers", path, jobs);
+    sigwait(&signals, &received);
+    DS_LOG_INFO("Stopping");
+
+defer:
+    atomic_store(&context.stopping, 1);
+    if (context.fd >= 0) {
+        shutdown(context.fd, SHUT_RDWR);
+    }
+
+    pthread_mutex_lock(&context.lock);
+    for (unsigned int i = 0; i < started; i++) {
+        if (context.clients[i] >= 0) {
+            shutdown(context.clients[i], SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&context.lock);
+
+    for (unsigned int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
 
-    ds_string_builder_append(&sb, "%s_%d_%d.jpeg", filename, object.object_number, object.generation_number);
+    for (unsigned int i = 0; i < SERVE_DOCUMENTS; i++) {
+        if (context.documents[i].path != NULL) {
+            serve_close_document(context.documents + i);
+        }
+    }
 
-    char *path = NULL;
-    ds_string_builder_build(&sb, &path);
-    ds_io_write(path, stream.str, stream.len, "wb");
+    if (context.fd >= 0) {
+        close(context.fd);
+    }
+    if (bound) {
+        unlink(path);
+    }
+    free(context.clients);
+    free(workers);
+    free(threads);
+    pthread_cond_destroy(&context.opened);
+    pthread_mutex_destroy(&context.lock);
+    return result;
 }
 
 int main(int argc, char **argv) {
     int result = 0;
+    unsigned int stats = 0;
+    unsigned int ndjson = 0;
+    char *trace = NULL;
+    char *filename = NULL;
+    char *socket_path = NULL;
     ds_argparse_parser parser;
     ds_argparse_parser_init(&parser, "pdf-parser", "A simple pdf parser in C", "0.1");
 
-    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'i', .long_name = "input", .description = "The input pdf file", .type = ARGUMENT_TYPE_POSITIONAL, .required = 1 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'i', .long_name = "input", .description = "The input pdf file, - for stdin. Pipes are parsed as a stream of objects", .type = ARGUMENT_TYPE_POSITIONAL, .required = 0 });
     ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'd', .long_name = "directory", .description = "The directory where the pdf file contents are extracted to", .type = ARGUMENT_TYPE_VALUE, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'a', .long_name = "archive", .description = "Write the pdf file contents into a single tar archive instead of a directory", .type = ARGUMENT_TYPE_VALUE, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'r', .long_name = "repair", .description = "Rebuild the xref table by scanning the file for objects", .type = ARGUMENT_TYPE_FLAG, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'D', .long_name = "max-depth", .description = "Maximum nesting depth of arrays and dictionaries (0 for no limit)", .type = ARGUMENT_TYPE_VALUE, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'M', .long_name = "max-memory", .description = "Maximum bytes kept by the parsed objects (0 for no limit)", .type = ARGUMENT_TYPE_VALUE, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'Z', .long_name = "max-decompressed", .description = "Maximum decompressed bytes of a single stream (0 for no limit)", .type = ARGUMENT_TYPE_VALUE, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'l', .long_name = "lazy", .description = "Only parse the xref table and resolve the objects on demand", .type = ARGUMENT_TYPE_FLAG, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'c', .long_name = "cache-bytes", .description = "Byte budget of the decoded stream cache (0 disables it)", .type = ARGUMENT_TYPE_VALUE, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'f', .long_name = "format", .description = "Output format: text or ndjson (one record per document and page on stdout)", .type = ARGUMENT_TYPE_VALUE, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'x', .long_name = "index", .description = "Sidecar index file, reused when it matches the input and written otherwise", .type = ARGUMENT_TYPE_VALUE, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'w', .long_name = "window", .description = "Bytes of a piped input kept in memory while streaming", .type = ARGUMENT_TYPE_VALUE, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'j', .long_name = "jobs", .description = "Threads that decode the streams (defaults to the number of processors)", .type = ARGUMENT_TYPE_VALUE, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 's', .long_name = "stats", .description = "Print the time spent in each phase and the counters (a stats record in ndjson)", .type = ARGUMENT_TYPE_FLAG, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'T', .long_name = "trace", .description = "Record the parse, decode and write phases of every thread into a Chrome trace file", .type = ARGUMENT_TYPE_VALUE, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 'S', .long_name = "serve", .description = "Answer metadata, text and images requests on a Unix socket instead of parsing an input", .type = ARGUMENT_TYPE_VALUE, .required = 0 });
+    ds_argparse_add_argument(&parser, (ds_argparse_options){ .short_name = 't', .long_name = "timeout", .description = "Time budget for parsing in milliseconds (0 for no limit)", .type = ARGUMENT_TYPE_VALUE, .required = 0 });
 
     if (ds_argparse_parse(&parser, argc, argv) != 0) {
         DS_LOG_ERROR("Failed to parse arguments");
         return_defer(-1);
     }
 
-    char *filename = ds_argparse_get_value(&parser, "input");
+    filename = ds_argparse_get_value(&parser, "input");
+    socket_path = ds_argparse_get_value(&parser, "serve");
+    if (filename == NULL && socket_path == NULL) {
+        DS_LOG_ERROR("Missing the input pdf file");
+        return_defer(-1);
+    }
     char *directory = ds_argparse_get_value(&parser, "directory");
+    char *archive = ds_argparse_get_value(&parser, "archive");
+    unsigned int repair = ds_argparse_get_flag(&parser, "repair");
+    unsigned int lazy = ds_argparse_get_flag(&parser, "lazy");
+    stats = ds_argparse_get_flag(&parser, "stats");
+    pdf_document_stats_enable(stats);
+    trace = ds_argparse_get_value(&parser, "trace");
+    pdf_document_trace_enable(trace != NULL);
+    char *index_path = ds_argparse_get_value(&parser, "index");
+    char *format = ds_argparse_get_value(&parser, "format");
+
+    if (format != NULL && strcmp(format, "ndjson") == 0) {
+        ndjson = 1;
+    } else if (format != NULL && strcmp(format, "text") != 0) {
+        DS_LOG_ERROR("Unknown output format %s", format);
+        return_defer(-1);
+    }
 
-    char *output_path = NULL;
-    ds_string_builder sb = {0};
-    ds_string_builder_init(&sb);
-    struct stat st = {0};
-    if (directory != NULL) {
-        if (stat(directory, &st) == -1) {
-            mkdir(directory, 0700);
-        }
+    pdf_document_options options;
+    pdf_document_options_init(&options);
+    options.repair = repair;
+    options.eager = !lazy;
+    options.index = index_path;
 
-        ds_string_builder_append(&sb, "%s/", directory);
+    char *max_depth = ds_argparse_get_value(&parser, "max-depth");
+    if (max_depth != NULL) {
+        options.max_depth = strtoul(max_depth, NULL, 10);
     }
 
-    ds_string_builder_append(&sb, "%s", filename);
-    ds_string_builder_build(&sb, &output_path);
+    char *max_memory = ds_argparse_get_value(&parser, "max-memory");
+    if (max_memory != NULL) {
+        options.max_memory = strtoul(max_memory, NULL, 10);
+    }
 
-    pdf_t pdf = {0};
-    char *buffer = NULL;
-    int buffer_len = ds_io_read(filename, &buffer, "rb");
-    if (buffer_len < 0) {
-        DS_LOG_ERROR("Failed to read the file");
-        return_defer(-1);
+    char *max_decompressed = ds_argparse_get_value(&parser, "max-decompressed");
+    if (max_decompressed != NULL) {
+        options.max_decompressed = strtoul(max_decompressed, NULL, 10);
     }
 
-    result = parse_pdf(buffer, buffer_len, &pdf);
-    if (result != 0) {
-        DS_LOG_ERROR("Failed to parse the buffer: %d", result);
-        return_defer(-1);
+    char *cache_bytes = ds_argparse_get_value(&parser, "cache-bytes");
+    if (cache_bytes != NULL) {
+        options.cache_bytes = strtoul(cache_bytes, NULL, 10);
     }
 
-    printf("startxref: %d\n", pdf.startxref);
+    char *window = ds_argparse_get_value(&parser, "window");
+    if (window != NULL) {
+        options.window = strtoul(window, NULL, 10);
+    }
 
-    for (int i = 0; i < pdf.trailer.count; i++) {
-        object_kv kv = {0};
-        ds_dynamic_array_get(&pdf.trailer, i, &kv);
-        printf("trailer: %s\n", kv.name);
+    char *timeout = ds_argparse_get_value(&parser, "timeout");
+    if (timeout != NULL) {
+        options.timeout_ms = strtoul(timeout, NULL, 10);
     }
 
-    for (int i = 0; i < pdf.xref.entries.count; i++) {
-        xref_entry entry = {0};
-        ds_dynamic_array_get(&pdf.xref.entries, i, &entry);
-        printf("xref: %d %d %c\n", entry.object_number, entry.generation_number, entry.in_use);
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    char *jobs_value = ds_argparse_get_value(&parser, "jobs");
+    if (jobs_value != NULL) {
+        jobs = strtol(jobs_value, NULL, 10);
+    }
+    if (jobs < 1) {
+        jobs = 1;
     }
 
-    for (int i = 0; i < pdf.objects.count; i++) {
-        indirect_object object = {0};
-        ds_dynamic_array_get(&pdf.objects, i, &object);
+    if (socket_path != NULL) {
+        // documents are parsed on demand and kept open, without an index
+        options.eager = 0;
+        options.index = NULL;
+        return_defer(serve(socket_path, &options, jobs) != 0 ? -1 : 0);
+    }
 
-        int is_stream = 0;
-        for (int j = 0; j < object.objects.count; j++) {
-            object_t obj = {0};
-            ds_dynamic_array_get(&object.objects, j, &obj);
-            if (obj.kind == object_stream) {
-                is_stream = 1;
-                break;
-            }
+    const char *output = archive != NULL ? archive : directory;
+    struct stat st = {0};
+    int stdin_input = strcmp(filename, "-") == 0;
+    if (stdin_input || (stat(filename, &st) == 0 && !S_ISREG(st.st_mode))) {
+        int fd = stdin_input ? STDIN_FILENO : open(filename, O_RDONLY);
+        if (fd < 0) {
+            DS_LOG_ERROR("Failed to open %s", filename);
+            return_defer(-1);
         }
 
-        if (is_stream == 1) {
-            object_t dictionary = {0};
-            ds_dynamic_array_get(&object.objects, 0, &dictionary);
-            assert(dictionary.kind == object_dictionary);
-
-            object_t stream = {0};
-            ds_dynamic_array_get(&object.objects, 1, &stream);
-            assert(stream.kind == object_stream);
+        // text mode extracts into the working directory when no output is given
+        if (output == NULL && !ndjson) {
+            output = ".";
+        }
 
-            filter_kind kind = get_filter_kind(dictionary.dictionary);
+        result = pdf_document_parse_fd(fd, stdin_input ? "stdin" : filename, &options, output, archive != NULL,
+                                       ndjson ? write_output : NULL, stdout);
+        if (!stdin_input) {
+            close(fd);
+        }
 
-            switch (kind) {
-            case filter_flate_decode: show_text(stream.stream, output_path, object); break;
-            case filter_dct_decode: show_image(stream.stream, output_path, object); break;
-            }
+        if (result != PDF_DOCUMENT_OK) {
+            DS_LOG_ERROR("Failed to parse the stream: %s", pdf_document_error_string(result));
+            return_defer(-1);
         }
+        return_defer(0);
     }
 
+    if (ndjson) {
+        return_defer(write_document(filename, &options, output, archive != NULL, jobs) != 0 ? -1 : 0);
+    }
+
+    return_defer(extract_document(filename, &options, output, archive != NULL, jobs) != 0 ? -1 : 0);
+
 defer:
-    if (buffer != NULL) {
-        free(buffer);
+    // the stats are a record of the ndjson output, a table on stderr otherwise
+    if (stats && ndjson && socket_path == NULL) {
+        if (pdf_document_write_stats(write_output, stdout) != PDF_DOCUMENT_OK) {
+            result = -1;
+        }
+    } else if (stats) {
+        pdf_document_print_stats();
+    }
+    if (trace != NULL && pdf_document_trace_write(trace, filename != NULL ? filename : "serve") != PDF_DOCUMENT_OK) {
+        result = -1;
     }
+    pdf_document_release_thread();
     return result;
 }
@@ -5,6 +5,18 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <assert.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <limits.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif // __linux__
 
 // TODO: Maybe I can have another check where you can define your own DS_H
 #ifdef PDF_IMPLEMENTATION
@@ -13,6 +25,10 @@
 #define DS_SB_IMPLEMENTATION
 #define DS_IO_IMPLEMENTATION
 #define DS_AP_IMPLEMENTATION
+#define DS_HM_IMPLEMENTATION
+#define DS_AL_IMPLEMENTATION
+#define DS_JS_IMPLEMENTATION
+#define DS_TR_IMPLEMENTATION
 #endif
 
 #include "ds.h"
@@ -27,7 +43,12 @@
 
 typedef enum filter_kind {
     filter_flate_decode,
-    filter_dct_decode
+    filter_dct_decode,
+    filter_jpx_decode,
+    filter_jbig2_decode,
+    filter_ccitt_fax_decode,
+    filter_none,
+    filter_other
 } filter_kind;
 
 typedef enum object_kind {
@@ -62,7 +83,7 @@ typedef struct object {
     union {
         boolean bool;
         float real;
-        int integer;
+        long integer; /* 64 bits, /Prev, /Length and /DL can be past 2 GB */
         char *string;
         char *name;
         ds_dynamic_array array; /* object_t */
@@ -81,6 +102,7 @@ typedef struct object_kv {
 typedef struct xref_entry {
     int object_number;
     int generation_number;
+    unsigned long offset;
     char in_use;
 } xref_entry;
 
@@ -89,23 +111,374 @@ typedef struct xref {
     ds_dynamic_array entries; /* xref_entry */
 } xref_t;
 
+typedef enum pdf_error {
+    PDF_OK = 0,
+    PDF_ERR_SYNTAX,
+    PDF_ERR_DEPTH,
+    PDF_ERR_MEMORY,
+    PDF_ERR_DECOMPRESSED,
+    PDF_ERR_TIMEOUT,
+    PDF_ERR_IO,
+} pdf_error;
+
+#ifndef PDF_DEFAULT_MAX_DEPTH
+#define PDF_DEFAULT_MAX_DEPTH 256
+#endif // PDF_DEFAULT_MAX_DEPTH
+
+// Hard limits for parsing untrusted files, 0 means no limit
+typedef struct pdf_parse_options {
+    unsigned int max_depth;               // nesting of arrays and dictionaries
+    unsigned long max_arena_bytes;        // memory kept by the parsed objects
+    unsigned long max_decompressed_bytes; // output of a single stream filter
+    unsigned long timeout_ms;             // wall clock budget for parsing
+    ds_allocator *allocator;              // where objects and decoded streams live, NULL for malloc
+    unsigned long cache_bytes;            // budget of the decoded stream cache, 0 disables it
+    unsigned long window_bytes;           // input kept in memory by pdf_parse_fd
+} pdf_parse_options;
+
+#ifndef PDF_STREAM_WINDOW
+#define PDF_STREAM_WINDOW (4 * 1024 * 1024)
+#endif // PDF_STREAM_WINDOW
+
+// The window must hold at least one object header line
+#define PDF_STREAM_HEADER_SIZE 64
+#define PDF_STREAM_MIN_WINDOW (4 * PDF_STREAM_HEADER_SIZE)
+
+// Decompressor for FlateDecode streams whose decoded length is known from
+// their /DL entry. It inflates a complete zlib stream into out, which has
+// room for out_len bytes.
+//
+// Returns 0 with *written set if the stream ended within out_len bytes.
+// Returns 1 otherwise, and the stream is inflated again by the streaming
+// zlib decoder, so the output does not depend on the backend.
+typedef int pdf_inflate_whole_fn(const char *in, unsigned long in_len, char *out, unsigned long out_len, unsigned long *written);
+
+// The whole buffer backend is chosen at build time: zlib by default, or
+// libdeflate with PDF_USE_LIBDEFLATE (link with -ldeflate). Define
+// PDF_INFLATE_WHOLE to a pdf_inflate_whole_fn to plug in another one.
+#ifndef PDF_INFLATE_WHOLE_MIN
+#define PDF_INFLATE_WHOLE_MIN 4096 // smaller streams stay on the streaming decoder
+#endif // PDF_INFLATE_WHOLE_MIN
+
+// Deflate cannot compress better than this, a larger /DL is bogus
+#define PDF_INFLATE_MAX_RATIO 1032
+
+// Inflate buffers up to this size stay with their thread for the next stream
+#ifndef PDF_INFLATE_KEEP_SIZE
+#define PDF_INFLATE_KEEP_SIZE (1024 * 1024)
+#endif // PDF_INFLATE_KEEP_SIZE
+
+// Objects resolved on demand, indexed by object number. Each slot is
+// published once with an atomic compare and swap, so many threads can resolve
+// objects of the same pdf without a lock.
+typedef struct pdf_cache {
+    _Atomic(indirect_object *) *slots;
+    xref_entry *entries; /* in use entries of the xref, by object number */
+    unsigned int count;
+} pdf_cache;
+
+// A decoded stream shared through the stream cache. It stays valid until it
+// is given back with pdf_release_stream, even if the cache evicts it.
+typedef struct pdf_stream {
+    void *key;
+    char *data;
+    unsigned long len;
+    int owned; /* data was allocated by the decoder */
+    unsigned int refs;
+    struct pdf_stream *prev;
+    struct pdf_stream *next;
+} pdf_stream;
+
+// Least recently used cache of decoded streams with a byte budget, keyed by
+// (object number, generation). Most recently used streams are at the head.
+typedef struct pdf_stream_cache {
+    pthread_mutex_t lock;
+    ds_hashmap map; /* key -> pdf_stream* */
+    pdf_stream *head;
+    pdf_stream *tail;
+    unsigned long bytes;
+    unsigned long budget;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    int ready;
+} pdf_stream_cache;
+
+typedef struct pdf_stream_cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long bytes;
+    unsigned int count;
+} pdf_stream_cache_stats;
+
 typedef struct pdf {
     ds_dynamic_array objects; /* indirect_object */
     xref_t xref;
     ds_dynamic_array trailer; /* object_kv */
-    int startxref;
-    // TODO: Add the xref table
+    long startxref;
+    int repaired;
+    ds_dynamic_array recovered; /* xref_entry */
+    ds_hashmap table; /* (object number, generation) -> indirect_object* */
+    char *buffer;
+    unsigned long buffer_len;
+    pdf_parse_options options;
+    pdf_cache cache;
+    pdf_stream_cache streams;
+    ds_dynamic_array pages; /* pointer_object, the page map of a sidecar index */
 } pdf_t;
 
-PDFDEF int parse_pdf(char *buffer, int buffer_len, pdf_t *pdf);
+// Called by pdf_parse_fd for every indirect object. A non zero return stops
+// the parse and is returned to the caller.
+typedef int pdf_object_callback(void *context, pdf_t *pdf, indirect_object *object);
 
-#endif // PDF_H
+#ifndef PDF_DECODE_WINDOW
+#define PDF_DECODE_WINDOW 4 // decoded streams waiting per worker
+#endif // PDF_DECODE_WINDOW
+
+// An object whose stream was decoded by pdf_decode_streams. The stream is NULL
+// if the object is not a stream, error is the result of pdf_get_stream. Image
+// streams are exported as they are stored, so they are not decoded and their
+// stream is NULL with error PDF_OK.
+typedef struct pdf_decoded {
+    indirect_object *object;
+    pdf_stream *stream;
+    int error;
+} pdf_decoded;
+
+// Called by pdf_decode_streams on the calling thread, in object order. A non
+// zero return stops the decoding and is returned to the caller.
+typedef int pdf_decoded_callback(void *context, pdf_t *pdf, pdf_decoded *decoded);
+
+// Extraction
+//
+// The sink is where the extracted streams go: files created with openat in a
+// directory that is held open, or entries of a single tar archive that is
+// written through a large buffer. pdf_extract_decoded is a
+// pdf_decoded_callback that writes the text of the flate streams and the
+// images of a document into a sink, each named after the prefix and the
+// object. Images are never re-encoded: DCT and JPX streams are written as
+// they are, JBIG2 streams get a JBIG2 file header, CCITT and flate or
+// unfiltered samples get a TIFF header, or a PNG one when the flate stream
+// uses PNG predictors. Once the sink has the pdf file as its source, the
+// image data goes from the file to the sink with copy_file_range or sendfile
+// and never passes through user space.
+#define PDF_SINK_BUFFER_SIZE (1024 * 1024)
+#define PDF_SINK_TAR_BLOCK 512
+// Passthrough images at least this large are copied from the source file by
+// the kernel when the sink writes an archive, smaller ones are buffered
+#define PDF_SINK_COPY_MIN (64 * 1024)
+// The offset given to pdf_sink_copy for data that is not in the source file
+#define PDF_SINK_IN_MEMORY ((unsigned long)-1)
+
+typedef enum pdf_sink_kind {
+    pdf_sink_directory,
+    pdf_sink_archive
+} pdf_sink_kind;
+
+typedef struct pdf_sink {
+    pdf_sink_kind kind;
+    int fd; /* the directory or the archive */
+    int source; /* the file mapped as the pdf buffer, -1 when there is none */
+    ds_dynamic_array buffer; /* char, archive mode only */
+} pdf_sink;
+
+// Bytes written before and after a copied stream, to give it the container
+// of a file format
+typedef struct pdf_sink_container {
+    const char *head;
+    unsigned long head_len;
+    const char *tail;
+    unsigned long tail_len;
+} pdf_sink_container;
+
+typedef struct pdf_extract_context {
+    pdf_sink *sink;
+    const char *prefix;
+} pdf_extract_context;
+
+// Sidecar index
+//
+// The index is a flat native-endian file that can be mapped and used as is:
+// a header followed by the object table (one row per object number) and the
+// page map. The header carries a fingerprint of the pdf (size, mtime and a
+// hash of the last PDF_INDEX_TAIL_SIZE bytes) so a stale index is detected and
+// rebuilt.
+#define PDF_INDEX_MAGIC "PDFIDX\0\0"
+#define PDF_INDEX_VERSION 2
+#define PDF_INDEX_BYTE_ORDER 0x01020304u
+
+#ifndef PDF_INDEX_TAIL_SIZE
+#define PDF_INDEX_TAIL_SIZE 4096
+#endif // PDF_INDEX_TAIL_SIZE
+
+typedef struct pdf_index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t tail_hash;
+    int64_t startxref;
+    int64_t trailer_offset; /* -1 when there is no trailer */
+    uint32_t object_count;
+    uint32_t page_count;
+    uint64_t objects_offset;
+    uint64_t pages_offset;
+} pdf_index_header;
+
+typedef struct pdf_index_object {
+    uint64_t offset;
+    uint32_t generation;
+    uint32_t in_use;
+} pdf_index_object;
+
+typedef struct pdf_index_page {
+    uint32_t object_number;
+    uint32_t generation;
+} pdf_index_page;
+
+typedef struct pdf_index {
+    void *map;
+    unsigned long map_len;
+    const pdf_index_header *header;
+    const pdf_index_object *objects;
+    const pdf_index_page *pages;
+} pdf_index;
+
+// Phase timers and counters
+//
+// Collected for the whole process while pdf_stats_enable(1) is in effect,
+// otherwise every hook costs a single branch. Phase times are inclusive: a
+// dictionary includes the objects nested in it and the document includes
+// everything parsed while it is opened. In pdf_decode_streams the idle phase
+// is a worker waiting for room in the window and the stall phase is the caller
+// waiting for the next decoded stream.
+typedef enum pdf_phase {
+    PDF_PHASE_IO,
+    PDF_PHASE_DOCUMENT,
+    PDF_PHASE_XREF,
+    PDF_PHASE_INDIRECT,
+    PDF_PHASE_DICTIONARY,
+    PDF_PHASE_ARRAY,
+    PDF_PHASE_STRING,
+    PDF_PHASE_STREAM,
+    PDF_PHASE_NAME,
+    PDF_PHASE_NUMBER,
+    PDF_PHASE_POINTER,
+    PDF_PHASE_BOOLEAN,
+    PDF_PHASE_INFLATE,
+    PDF_PHASE_TEXT,
+    PDF_PHASE_WRITE,
+    PDF_PHASE_DECODE,
+    PDF_PHASE_IDLE,
+    PDF_PHASE_STALL,
+    PDF_PHASE_COUNT
+} pdf_phase;
+
+typedef enum pdf_counter {
+    PDF_COUNTER_OBJECTS,
+    PDF_COUNTER_BYTES_READ,
+    PDF_COUNTER_BYTES_INFLATED,
+    PDF_COUNTER_BYTES_WRITTEN,
+    PDF_COUNTER_BYTES_COPIED,
+    PDF_COUNTER_ALLOCATIONS,
+    PDF_COUNTER_CACHE_HITS,
+    PDF_COUNTER_CACHE_MISSES,
+    PDF_COUNTER_COUNT
+} pdf_counter;
+
+typedef struct pdf_stats {
+    unsigned long long phase_ns[PDF_PHASE_COUNT];
+    unsigned long long phase_calls[PDF_PHASE_COUNT];
+    unsigned long long counters[PDF_COUNTER_COUNT];
+} pdf_stats;
+
+// Trace recorder
+//
+// While pdf_trace_enable(1) is in effect every phase timed by the stats hooks
+// is also recorded in a ring buffer owned by the thread that ran it. A thread
+// only ever writes its own ring, so recording takes no lock; once a ring is
+// full the oldest events are overwritten. pdf_trace_write dumps the rings as
+// Chrome trace JSON for chrome://tracing or Perfetto, after the threads that
+// recorded them are done. When both the stats and the trace are off every
+// hook costs a single branch.
+#ifndef PDF_TRACE_EVENTS
+#define PDF_TRACE_EVENTS 65536
+#endif // PDF_TRACE_EVENTS
+
+PDFDEF void pdf_parse_options_init(pdf_parse_options *options);
+PDFDEF const char *pdf_error_string(int error);
+PDFDEF int parse_pdf(char *buffer, unsigned long buffer_len, pdf_t *pdf);
+PDFDEF int parse_pdf_with_options(char *buffer, unsigned long buffer_len, pdf_parse_options *options, pdf_t *pdf);
+PDFDEF int pdf_repair_xref(char *buffer, unsigned long buffer_len, pdf_t *pdf);
+PDFDEF int pdf_get_object(pdf_t *pdf, int object_number, int generation_number, indirect_object **object);
+PDFDEF int pdf_open(char *buffer, unsigned long buffer_len, pdf_parse_options *options, pdf_t *pdf);
+PDFDEF int pdf_resolve(pdf_t *pdf, int object_number, int generation_number, indirect_object **object);
+PDFDEF void pdf_free(pdf_t *pdf);
+PDFDEF int pdf_get_stream(pdf_t *pdf, indirect_object *object, pdf_stream **stream);
+PDFDEF void pdf_release_stream(pdf_t *pdf, pdf_stream *stream);
+PDFDEF void pdf_stream_cache_get_stats(pdf_t *pdf, pdf_stream_cache_stats *stats);
+PDFDEF int pdf_append_text(ds_string_builder *sb, const char *text, unsigned long text_len);
+PDFDEF int pdf_decode_streams(pdf_t *pdf, indirect_object **objects, unsigned long count, unsigned int threads,
+                              pdf_decoded_callback *callback, void *context);
+PDFDEF object_t *pdf_dictionary_get(ds_dynamic_array *dictionary, const char *name);
+PDFDEF object_t *pdf_lookup(pdf_t *pdf, ds_dynamic_array *dictionary, const char *name);
+PDFDEF int pdf_get_catalog(pdf_t *pdf, ds_dynamic_array **catalog);
+PDFDEF int pdf_get_pages(pdf_t *pdf, ds_dynamic_array *pages);
+PDFDEF int pdf_index_write(pdf_t *pdf, const char *pdf_path, const char *index_path);
+PDFDEF int pdf_index_open(const char *pdf_path, const char *index_path, pdf_index *index);
+PDFDEF void pdf_index_close(pdf_index *index);
+PDFDEF int pdf_open_indexed(char *buffer, unsigned long buffer_len, pdf_parse_options *options, pdf_index *index, pdf_t *pdf);
+PDFDEF int pdf_parse_fd(int fd, pdf_parse_options *options, pdf_object_callback *callback, void *context);
+PDFDEF int pdf_flate_decode(pdf_parse_options *options, ds_string_slice *stream, unsigned long decoded_len,
+                            char **buffer, unsigned long *buffer_len);
+PDFDEF void pdf_inflater_release(void);
+PDFDEF void pdf_stats_enable(int enable);
+PDFDEF unsigned long long pdf_stats_begin(void);
+PDFDEF void pdf_stats_end(pdf_phase phase, unsigned long long start);
+PDFDEF void pdf_stats_add(pdf_counter counter, unsigned long long value);
+PDFDEF void pdf_stats_get(pdf_stats *stats);
+PDFDEF const char *pdf_phase_name(pdf_phase phase);
+PDFDEF const char *pdf_counter_name(pdf_counter counter);
+PDFDEF void pdf_trace_enable(int enable);
+PDFDEF int pdf_trace_write(const char *path, const char *process_name);
+PDFDEF int pdf_map_file(const char *path, char **buffer, unsigned long *buffer_len);
+PDFDEF void pdf_unmap_file(char *buffer, unsigned long buffer_len);
+PDFDEF filter_kind pdf_get_filter_kind(ds_dynamic_array *dictionary);
+PDFDEF int pdf_append_page_text(pdf_t *pdf, object_t *contents, ds_string_builder *text);
+PDFDEF int pdf_sink_open_directory(pdf_sink *sink, const char *directory);
+PDFDEF int pdf_sink_open_archive(pdf_sink *sink, const char *path);
+PDFDEF int pdf_sink_open_source(pdf_sink *sink, const char *path);
+PDFDEF int pdf_sink_write(pdf_sink *sink, const char *name, const char *data, unsigned long len);
+PDFDEF int pdf_sink_copy(pdf_sink *sink, const char *name, const pdf_sink_container *container, unsigned long offset,
+                         const char *data, unsigned long len);
+PDFDEF int pdf_sink_close(pdf_sink *sink);
+PDFDEF int pdf_extract_text(pdf_sink *sink, const char *prefix, indirect_object *object, pdf_stream *stream);
+PDFDEF int pdf_extract_image(pdf_t *pdf, pdf_sink *sink, const char *prefix, indirect_object *object, ds_string_slice *data);
+PDFDEF int pdf_extract_decoded(void *context, pdf_t *pdf, pdf_decoded *decoded);
+PDFDEF int pdf_extract_object(pdf_t *pdf, pdf_sink *sink, const char *prefix, indirect_object *object);
 
-// TODO: Remove
-#define PDF_IMPLEMENTATION
+#endif // PDF_H
 
 #ifdef PDF_IMPLEMENTATION
 
+#include "zlib.h"
+#ifdef PDF_USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif // PDF_USE_LIBDEFLATE
+
+typedef struct pdf_parser {
+    pdf_parse_options options;
+    unsigned int depth;
+    unsigned long arena_bytes;
+    unsigned long long deadline_ms;
+    unsigned int ticks;
+    long stream_length; // direct /Length of the next stream, only a hint checked against the data
+    pdf_error error;
+} pdf_parser;
+
 static void skip_comments(ds_string_slice *slice) {
     ds_string_slice line;
     while (ds_string_slice_starts_with(slice, &DS_STRING_SLICE("%"))) {
@@ -121,6 +494,35 @@ static int isnumber(char c) {
     return isdigit(c) || c == '-' || c == '.';
 }
 
+// Parse the integer at the start of a token without copying it, a value out
+// of range saturates at LONG_MAX or LONG_MIN
+static long slice_to_long(ds_string_slice *token) {
+    unsigned long i = 0;
+    int negative = 0;
+    unsigned long limit = LONG_MAX;
+    unsigned long value = 0;
+
+    if (i < token->len && token->str[i] == '-') {
+        negative = 1;
+        limit = (unsigned long)LONG_MAX + 1;
+        i++;
+    }
+
+    for (; i < token->len && isdigit(token->str[i]); i++) {
+        unsigned long digit = token->str[i] - '0';
+        if (value > (limit - digit) / 10) {
+            value = limit;
+            break;
+        }
+        value = value * 10 + digit;
+    }
+
+    if (negative) {
+        return value == limit ? LONG_MIN : -(long)value;
+    }
+    return (long)value;
+}
+
 static bool ispointer(ds_string_slice *slice) {
     // TODO: we ignore floats for now, also negative numbers
 
@@ -141,51 +543,331 @@ static bool ispointer(ds_string_slice *slice) {
     return false;
 }
 
-static int parse_direct_object(ds_string_slice *slice, object_t *object);
+// Account bytes that the parsed document keeps alive
+static int parser_charge(pdf_parser *parser, unsigned long bytes) {
+    parser->arena_bytes += bytes;
+
+    if (parser->options.max_arena_bytes != 0 && parser->arena_bytes > parser->options.max_arena_bytes) {
+        DS_LOG_ERROR("Parser memory limit of %lu bytes exceeded", parser->options.max_arena_bytes);
+        parser->error = PDF_ERR_MEMORY;
+        return 1;
+    }
+
+    return 0;
+}
+
+static unsigned long long parser_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+#define PDF_STATS_ON 1
+#define PDF_TRACE_ON 2
+
+static atomic_int pdf_stats_enabled = 0; /* PDF_STATS_ON | PDF_TRACE_ON */
+static atomic_ullong pdf_stats_phase_ns[PDF_PHASE_COUNT];
+static atomic_ullong pdf_stats_phase_calls[PDF_PHASE_COUNT];
+static atomic_ullong pdf_stats_counters[PDF_COUNTER_COUNT];
+
+// Start or stop collecting the phase timers and counters
+PDFDEF void pdf_stats_enable(int enable) {
+    if (enable) {
+        atomic_fetch_or_explicit(&pdf_stats_enabled, PDF_STATS_ON, memory_order_relaxed);
+    } else {
+        atomic_fetch_and_explicit(&pdf_stats_enabled, ~PDF_STATS_ON, memory_order_relaxed);
+    }
+}
+
+static unsigned long long pdf_stats_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+typedef struct pdf_trace_event {
+    unsigned long long start;
+    unsigned long long end;
+    pdf_phase phase;
+} pdf_trace_event;
+
+typedef struct pdf_trace_ring {
+    struct pdf_trace_ring *next;
+    const char *name;
+    unsigned long tid;
+    atomic_ullong head; /* events ever recorded, the ring keeps the last ones */
+    pdf_trace_event events[PDF_TRACE_EVENTS];
+} pdf_trace_ring;
+
+static _Atomic(pdf_trace_ring *) pdf_trace_rings = NULL;
+static atomic_ulong pdf_trace_threads = 0;
+static atomic_ullong pdf_trace_origin = 0;
+static _Thread_local pdf_trace_ring *pdf_trace_thread_ring = NULL;
+static _Thread_local const char *pdf_trace_thread_name = NULL;
+
+// Start or stop recording the trace
+//
+// The timestamps of the trace count from the first time it is enabled.
+PDFDEF void pdf_trace_enable(int enable) {
+    if (enable) {
+        unsigned long long expected = 0;
+        atomic_compare_exchange_strong(&pdf_trace_origin, &expected, pdf_stats_now_ns());
+        atomic_fetch_or_explicit(&pdf_stats_enabled, PDF_TRACE_ON, memory_order_relaxed);
+    } else {
+        atomic_fetch_and_explicit(&pdf_stats_enabled, ~PDF_TRACE_ON, memory_order_relaxed);
+    }
+}
+
+// Name the rings of the threads started by the parser
+static void pdf_trace_name_thread(const char *name) {
+    pdf_trace_thread_name = name;
+}
+
+// Append an event to the ring of this thread, adding the ring on first use
+//
+// Rings are pushed on a lock free list and live as long as the process, so
+// they can be dumped after their threads exit.
+static void pdf_trace_record(pdf_phase phase, unsigned long long start, unsigned long long end) {
+    pdf_trace_ring *ring = pdf_trace_thread_ring;
+
+    if (ring == NULL) {
+        ring = DS_MALLOC(NULL, sizeof(pdf_trace_ring));
+        if (ring == NULL) {
+            return;
+        }
+        ring->name = pdf_trace_thread_name;
+        ring->tid = atomic_fetch_add_explicit(&pdf_trace_threads, 1, memory_order_relaxed) + 1;
+        atomic_init(&ring->head, 0);
+        ring->next = atomic_load_explicit(&pdf_trace_rings, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&pdf_trace_rings, &ring->next, ring, memory_order_release,
+                                                      memory_order_relaxed)) {
+        }
+        pdf_trace_thread_ring = ring;
+    }
+
+    unsigned long long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ring->events[head % PDF_TRACE_EVENTS] = (pdf_trace_event){.start = start, .end = end, .phase = phase};
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Start timing a phase
+//
+// Returns the start time to pass to pdf_stats_end, 0 when the stats and the
+// trace are off
+PDFDEF unsigned long long pdf_stats_begin(void) {
+    if (!atomic_load_explicit(&pdf_stats_enabled, memory_order_relaxed)) {
+        return 0;
+    }
+
+    return pdf_stats_now_ns();
+}
+
+// Account the time since pdf_stats_begin to a phase
+PDFDEF void pdf_stats_end(pdf_phase phase, unsigned long long start) {
+    if (start == 0) {
+        return;
+    }
+
+    int enabled = atomic_load_explicit(&pdf_stats_enabled, memory_order_relaxed);
+    unsigned long long end = pdf_stats_now_ns();
+    if (enabled & PDF_STATS_ON) {
+        atomic_fetch_add_explicit(&pdf_stats_phase_ns[phase], end - start, memory_order_relaxed);
+        atomic_fetch_add_explicit(&pdf_stats_phase_calls[phase], 1, memory_order_relaxed);
+    }
+    if (enabled & PDF_TRACE_ON) {
+        pdf_trace_record(phase, start, end);
+    }
+}
+
+PDFDEF void pdf_stats_add(pdf_counter counter, unsigned long long value) {
+    if (atomic_load_explicit(&pdf_stats_enabled, memory_order_relaxed) & PDF_STATS_ON) {
+        atomic_fetch_add_explicit(&pdf_stats_counters[counter], value, memory_order_relaxed);
+    }
+}
+
+// Get a snapshot of the phase timers and counters
+PDFDEF void pdf_stats_get(pdf_stats *stats) {
+    for (int i = 0; i < PDF_PHASE_COUNT; i++) {
+        stats->phase_ns[i] = atomic_load_explicit(&pdf_stats_phase_ns[i], memory_order_relaxed);
+        stats->phase_calls[i] = atomic_load_explicit(&pdf_stats_phase_calls[i], memory_order_relaxed);
+    }
+
+    for (int i = 0; i < PDF_COUNTER_COUNT; i++) {
+        stats->counters[i] = atomic_load_explicit(&pdf_stats_counters[i], memory_order_relaxed);
+    }
+}
+
+PDFDEF const char *pdf_phase_name(pdf_phase phase) {
+    static const char *names[PDF_PHASE_COUNT] = {
+        "io", "document", "xref", "indirect", "dictionary", "array", "string", "stream",
+        "name", "number", "pointer", "boolean", "inflate", "text", "write", "decode", "idle", "stall",
+    };
+
+    return phase < PDF_PHASE_COUNT ? names[phase] : "unknown";
+}
+
+PDFDEF const char *pdf_counter_name(pdf_counter counter) {
+    static const char *names[PDF_COUNTER_COUNT] = {
+        "objects", "bytes_read", "bytes_inflated", "bytes_written", "bytes_copied", "allocations", "cache_hits", "cache_misses",
+    };
+
+    return counter < PDF_COUNTER_COUNT ? names[counter] : "unknown";
+}
+
+static void pdf_trace_write_string(FILE *file, const char *str) {
+    fputc('"', file);
+    for (; *str != '\0'; str++) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\') {
+            fprintf(file, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(file, "\\u%04x", c);
+        } else {
+            fputc(c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+// Dump the recorded trace as Chrome trace JSON
+//
+// Every phase becomes a complete event (a begin and an end in one record) on
+// the thread that ran it, with the timestamps in microseconds. The process is
+// named process_name so that the traces of several files can be loaded side
+// by side. Call it once the threads that recorded events have finished.
+//
+// Returns 0 on success. Returns 1 if the file could not be written
+PDFDEF int pdf_trace_write(const char *path, const char *process_name) {
+    int result = 0;
+    unsigned long long origin = atomic_load(&pdf_trace_origin);
+    unsigned long pid = (unsigned long)getpid();
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        DS_LOG_ERROR("Failed to open %s: %s", path, strerror(errno));
+        return_defer(1);
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":0,\"args\":{\"name\":", pid);
+    pdf_trace_write_string(file, process_name != NULL ? process_name : "pdf-parser");
+    fprintf(file, "}}");
+
+    pdf_trace_ring *ring = atomic_load_explicit(&pdf_trace_rings, memory_order_acquire);
+    for (; ring != NULL; ring = ring->next) {
+        unsigned long long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        unsigned long long first = head > PDF_TRACE_EVENTS ? head - PDF_TRACE_EVENTS : 0;
+        if (first != 0) {
+            DS_LOG_WARN("The trace of thread %lu dropped its %llu oldest events", ring->tid, first);
+        }
+
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":%lu,\"args\":{\"name\":\"%s %lu\"}}",
+                pid, ring->tid, ring->name != NULL ? ring->name : "thread", ring->tid);
+        for (unsigned long long i = first; i < head; i++) {
+            pdf_trace_event *event = &ring->events[i % PDF_TRACE_EVENTS];
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%lu,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f}",
+                    pdf_phase_name(event->phase), pid, ring->tid, (event->start - origin) / 1e3,
+                    (event->end - event->start) / 1e3);
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+    if (ferror(file)) {
+        DS_LOG_ERROR("Failed to write %s", path);
+        return_defer(1);
+    }
+
+defer:
+    if (file != NULL && fclose(file) != 0 && result == 0) {
+        DS_LOG_ERROR("Failed to write %s: %s", path, strerror(errno));
+        result = 1;
+    }
+    return result;
+}
+
+// Check the wall clock budget, only every few calls to keep it cheap
+static int parser_check_time(pdf_parser *parser) {
+    if (parser->deadline_ms == 0 || (++parser->ticks & 1023) != 0) {
+        return 0;
+    }
+
+    if (parser_now_ms() > parser->deadline_ms) {
+        DS_LOG_ERROR("Parser time budget of %lu ms exceeded", parser->options.timeout_ms);
+        parser->error = PDF_ERR_TIMEOUT;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Append to an array of the document, charging the memory when it grows
+static int parser_append(pdf_parser *parser, ds_dynamic_array *da, const void *item) {
+    if (da->count >= da->capacity) {
+        unsigned long grow = da->capacity == 0 ? DS_DA_INIT_CAPACITY : da->capacity;
+        if (parser_charge(parser, grow * da->item_size) != 0) {
+            return 1;
+        }
+    }
+
+    return ds_dynamic_array_append(da, item);
+}
+
+static int parser_to_owned(pdf_parser *parser, ds_string_slice *token, char **str) {
+    if (parser_charge(parser, token->len + 1) != 0) {
+        return 1;
+    }
+
+    return ds_string_slice_to_owned(token, str);
+}
+
+static int parse_direct_object(pdf_parser *parser, ds_string_slice *slice, object_t *object);
 
-static int parse_dictionary_object(ds_string_slice *slice, object_t *object) {
+static int parse_dictionary_object(pdf_parser *parser, ds_string_slice *slice, object_t *object) {
     int result = 0;
 
     object->kind = object_dictionary;
-    ds_dynamic_array_init(&object->dictionary, sizeof(object_kv));
+    ds_dynamic_array_init_allocator(&object->dictionary, sizeof(object_kv), parser->options.allocator);
 
-    ds_string_slice_trim_left(slice, '<');
+    ds_string_slice_step(slice, 2); // Remove the <<
 
     while (1) {
         object_kv obj_kv;
 
+        ds_string_slice_trim_left_ws(slice);
         if (ds_string_slice_empty(slice)) {
             DS_LOG_ERROR("Expected a name or `>>` but found EOF");
             return_defer(1);
         }
 
-        ds_string_slice_trim_left_ws(slice);
         if (ds_string_slice_starts_with(slice, &DS_STRING_SLICE(">>"))) {
-            ds_string_slice_trim_left(slice, '>');
+            ds_string_slice_step(slice, 2); // Remove the >>
             break;
         } else if (ds_string_slice_starts_with(slice, &DS_STRING_SLICE("/"))) {
             ds_string_slice token;
             ds_string_slice_step(slice, 1);
             ds_string_slice_take_while_pred(slice, isnamechar, &token);
-            ds_string_slice_to_owned(&token, &obj_kv.name);
+            if (parser_to_owned(parser, &token, &obj_kv.name) != 0) {
+                return_defer(1);
+            }
         } else {
             DS_LOG_ERROR("Expected a name or `>>`");
             return_defer(1);
         }
 
-        if (parse_direct_object(slice, &obj_kv.object) != 0) {
+        if (parse_direct_object(parser, slice, &obj_kv.object) != 0) {
             DS_LOG_ERROR("Could not parse object in dictionary");
             return_defer(1);
         }
 
-        ds_dynamic_array_append(&object->dictionary, &obj_kv);
+        if (parser_append(parser, &object->dictionary, &obj_kv) != 0) {
+            return_defer(1);
+        }
     }
 
 defer:
     return result;
 }
 
-static int parse_string_object(ds_string_slice *slice, object_t *object) {
+static int parse_string_object(pdf_parser *parser, ds_string_slice *slice, object_t *object) {
     int result = 0;
     char start = *slice->str;
     char end = start == '<' ? '>' : ')';
@@ -197,8 +879,8 @@ static int parse_string_object(ds_string_slice *slice, object_t *object) {
     ds_string_slice tmp_slice = *slice;
     tmp_slice.len = 0;
 
-    while (*slice->str != end) {
-        if (*slice->str == '\\') {
+    while (!ds_string_slice_empty(slice) && *slice->str != end) {
+        if (*slice->str == '\\' && slice->len > 1) {
             ds_string_slice_step(slice, 1);
             tmp_slice.len += 1;
         }
@@ -207,19 +889,30 @@ static int parse_string_object(ds_string_slice *slice, object_t *object) {
         tmp_slice.len += 1;
     }
 
-    ds_string_slice_to_owned(&tmp_slice, &object->string);
+    if (ds_string_slice_empty(slice)) {
+        DS_LOG_ERROR("Expected `%c` but found EOF", end);
+        return_defer(1);
+    }
+
+    if (parser_to_owned(parser, &tmp_slice, &object->string) != 0) {
+        return_defer(1);
+    }
     ds_string_slice_step(slice, 1); // Remove the >
 
 defer:
     return result;
 }
 
-static int parse_stream_object(ds_string_slice *slice, object_t *object) {
-    char *tmp;
-    ds_string_slice token;
+// The stream data stays a view into the input, so there is nothing to charge.
+// A direct /Length is trusted when `endstream` follows it, otherwise the data
+// is scanned for the keyword.
+static int parse_stream_object(pdf_parser *parser, ds_string_slice *slice, object_t *object) {
     int result = 0;
+    long length = parser->stream_length;
+    int found = 0;
 
     object->kind = object_stream;
+    parser->stream_length = -1;
 
     ds_string_slice line;
     if (ds_string_slice_tokenize(slice, '\n', &line) != 0) {
@@ -230,54 +923,78 @@ static int parse_stream_object(ds_string_slice *slice, object_t *object) {
     object->stream = *slice;
     object->stream.len = 0;
 
-    while (ds_string_slice_starts_with(slice, &DS_STRING_SLICE("endstream")) == 0) {
-        ds_string_slice_step(slice, 1);
-        object->stream.len += 1;
+    if (length >= 0 && (unsigned long)length <= slice->len) {
+        ds_string_slice rest = *slice;
+        ds_string_slice_step(&rest, length);
+        ds_string_slice_trim_left_ws(&rest);
+        if (ds_string_slice_starts_with(&rest, &DS_STRING_SLICE("endstream"))) {
+            object->stream.len = rest.str - slice->str;
+            found = 1;
+        }
+    }
+
+    const char *end = slice->str + slice->len;
+    const char *cursor = slice->str;
+    while (!found) {
+        cursor = memchr(cursor, 'e', end - cursor);
+        if (cursor == NULL) {
+            DS_LOG_ERROR("Expected `endstream` keyword but found EOF");
+            return_defer(1);
+        }
+
+        if (end - cursor >= 9 && DS_MEMCMP(cursor, "endstream", 9) == 0) {
+            object->stream.len = cursor - slice->str;
+            found = 1;
+        } else if (parser_check_time(parser) != 0) {
+            return_defer(1);
+        } else {
+            cursor += 1;
+        }
     }
 
-    ds_string_slice_step(slice, strlen("endstream"));
+    ds_string_slice_step(slice, object->stream.len + sizeof("endstream") - 1);
 
 defer:
     return result;
 }
 
-static int parse_array_object(ds_string_slice *slice, object_t *object) {
-    char *tmp;
-    ds_string_slice token;
+static int parse_array_object(pdf_parser *parser, ds_string_slice *slice, object_t *object) {
     int result = 0;
 
     object->kind = object_array;
-    ds_dynamic_array_init(&object->array, sizeof(object_t));
+    ds_dynamic_array_init_allocator(&object->array, sizeof(object_t), parser->options.allocator);
 
-    ds_string_slice_trim_left(slice, '[');
+    ds_string_slice_step(slice, 1); // Remove the [
 
     while (1) {
         object_t obj;
 
+        ds_string_slice_trim_left_ws(slice);
         if (ds_string_slice_empty(slice)) {
             DS_LOG_ERROR("Expected an object or `]` but found EOF");
             return_defer(1);
         }
 
-        ds_string_slice_trim_left_ws(slice);
         if (ds_string_slice_starts_with(slice, &DS_STRING_SLICE("]"))) {
-            ds_string_slice_trim_left(slice, ']');
+            ds_string_slice_step(slice, 1); // Remove the ]
             break;
         }
 
-        if (parse_direct_object(slice, &obj) != 0) {
+        if (parse_direct_object(parser, slice, &obj) != 0) {
             DS_LOG_ERROR("Could not parse object in dictionary");
             return_defer(1);
         }
 
-        ds_dynamic_array_append(&object->array, &obj);
+        if (parser_append(parser, &object->array, &obj) != 0) {
+            return_defer(1);
+        }
     }
 
 defer:
     return result;
 }
 
-static int parse_name_object(ds_string_slice *slice, object_t *object) {
+static int parse_name_object(pdf_parser *parser, ds_string_slice *slice, object_t *object) {
     char *tmp;
     ds_string_slice token;
     int result = 0;
@@ -287,7 +1004,9 @@ static int parse_name_object(ds_string_slice *slice, object_t *object) {
     ds_string_slice_step(slice, 1); // Remove the /
 
     ds_string_slice_take_while_pred(slice, isnamechar, &token);
-    ds_string_slice_to_owned(&token, &tmp);
+    if (parser_to_owned(parser, &token, &tmp) != 0) {
+        return_defer(1);
+    }
     object->name = tmp;
     ds_string_slice_trim_left_ws(slice);
 
@@ -296,22 +1015,17 @@ defer:
 }
 
 static int parse_pointer_object(ds_string_slice *slice, object_t *object) {
-    char *tmp;
     ds_string_slice token;
     int result = 0;
 
     object->kind = object_pointer;
 
     ds_string_slice_take_while_pred(slice, isnumber, &token);
-    ds_string_slice_to_owned(&token, &tmp);
-    object->pointer.object_number = atoi(tmp);
-    free(tmp);
+    object->pointer.object_number = slice_to_long(&token);
     ds_string_slice_trim_left_ws(slice);
 
     ds_string_slice_take_while_pred(slice, isnumber, &token);
-    ds_string_slice_to_owned(&token, &tmp);
-    object->pointer.generation_number = atoi(tmp);
-    free(tmp);
+    object->pointer.generation_number = slice_to_long(&token);
     ds_string_slice_trim_left_ws(slice);
 
     ds_string_slice_step(slice, 1); // Remove the R
@@ -326,79 +1040,108 @@ static int parse_number_object(ds_string_slice *slice, object_t *object) {
     int result = 0;
 
     ds_string_slice_take_while_pred(slice, isnumber, &token);
-    ds_string_slice_to_owned(&token, &tmp);
 
-    char *tmp2 = tmp;
     int is_int = 1;
-    for (char c = *tmp2; c != '\0'; c = *tmp2++) {
-        is_int = is_int && (c != '.');
+    for (unsigned int i = 0; i < token.len; i++) {
+        is_int = is_int && (token.str[i] != '.');
     }
 
     if (is_int) {
         object->kind = object_int;
-        object->integer = atoi(tmp);
+        object->integer = slice_to_long(&token);
     } else {
+        if (ds_string_slice_to_owned(&token, &tmp) != 0) {
+            return_defer(1);
+        }
         object->kind = object_real;
         object->real = atof(tmp);
+        DS_FREE(token.allocator, tmp);
     }
 
 defer:
     return result;
 }
 
-int parse_boolean_object(ds_string_slice *slice, object_t *object) {
-    char *tmp;
+static int parse_boolean_object(ds_string_slice *slice, object_t *object) {
     ds_string_slice token;
     int result = 0;
 
     object->kind = object_boolean;
 
-    ds_string_slice_take_while_pred(slice, isnamechar, &token);
-    ds_string_slice_to_owned(&token, &tmp);
+    if (ds_string_slice_take_while_pred(slice, isnamechar, &token) != 0 || token.len == 0) {
+        DS_LOG_ERROR("Expected a keyword");
+        return_defer(1);
+    }
 
-    object->bool = strncmp(tmp, "true", 4) == 0;
+    object->bool = ds_string_slice_starts_with(&token, &DS_STRING_SLICE("true"));
 
 defer:
     return result;
 }
 
-static int parse_direct_object(ds_string_slice *slice, object_t *object) {
+static int parse_direct_object(pdf_parser *parser, ds_string_slice *slice, object_t *object) {
     int result = 0;
+    unsigned long long start_ns = 0;
+    pdf_phase phase = PDF_PHASE_BOOLEAN;
+
+    parser->depth += 1;
+    if (parser->options.max_depth != 0 && parser->depth > parser->options.max_depth) {
+        DS_LOG_ERROR("Maximum nesting depth of %u exceeded", parser->options.max_depth);
+        parser->error = PDF_ERR_DEPTH;
+        return_defer(1);
+    }
+
+    if (parser_check_time(parser) != 0) {
+        return_defer(1);
+    }
 
     ds_string_slice_trim_left_ws(slice);
+    if (ds_string_slice_empty(slice)) {
+        DS_LOG_ERROR("Expected an object but found EOF");
+        return_defer(1);
+    }
+
+    start_ns = pdf_stats_begin();
     if (ds_string_slice_starts_with(slice, &DS_STRING_SLICE("<<"))) {
-        if (parse_dictionary_object(slice, object) != 0) {
+        phase = PDF_PHASE_DICTIONARY;
+        if (parse_dictionary_object(parser, slice, object) != 0) {
             DS_LOG_ERROR("Failed to parse dictionary");
             return_defer(1);
         }
     } else if (ds_string_slice_starts_with(slice, &DS_STRING_SLICE("<")) || ds_string_slice_starts_with(slice, &DS_STRING_SLICE("("))) {
-        if (parse_string_object(slice, object) != 0) {
+        phase = PDF_PHASE_STRING;
+        if (parse_string_object(parser, slice, object) != 0) {
             DS_LOG_ERROR("Failed to parse string");
             return_defer(1);
         }
     } else if (ds_string_slice_starts_with(slice, &DS_STRING_SLICE("stream"))) {
-        if (parse_stream_object(slice, object) != 0) {
+        phase = PDF_PHASE_STREAM;
+        if (parse_stream_object(parser, slice, object) != 0) {
             DS_LOG_ERROR("Failed to parse stream");
             return_defer(1);
         }
     } else if (ds_string_slice_starts_with(slice, &DS_STRING_SLICE("["))) {
-        if (parse_array_object(slice, object) != 0) {
+        phase = PDF_PHASE_ARRAY;
+        if (parse_array_object(parser, slice, object) != 0) {
             DS_LOG_ERROR("Failed to parse array");
             return_defer(1);
         }
     } else if (ds_string_slice_starts_with(slice, &DS_STRING_SLICE("/"))) {
-        if (parse_name_object(slice, object) != 0) {
+        phase = PDF_PHASE_NAME;
+        if (parse_name_object(parser, slice, object) != 0) {
             DS_LOG_ERROR("Failed to parse name");
             return_defer(1);
         }
     } else {
         if (ds_string_slice_starts_with_pred(slice, isnumber)) {
             if (ispointer(slice)) {
+                phase = PDF_PHASE_POINTER;
                 if (parse_pointer_object(slice, object) != 0) {
                     DS_LOG_ERROR("Failed to parse pointer");
                     return_defer(1);
                 }
             } else {
+                phase = PDF_PHASE_NUMBER;
                 if (parse_number_object(slice, object) != 0) {
                     DS_LOG_ERROR("Failed to parse number");
                     return_defer(1);
@@ -413,11 +1156,15 @@ static int parse_direct_object(ds_string_slice *slice, object_t *object) {
     }
 
 defer:
+    pdf_stats_end(phase, start_ns);
+    parser->depth -= 1;
     return result;
 }
 
-static int parse_indirect_object(ds_string_slice *slice, indirect_object *object) {
+static int parse_indirect_object(pdf_parser *parser, ds_string_slice *slice, indirect_object *object) {
     int result = 0;
+    unsigned long long start_ns = pdf_stats_begin();
+    DS_TRACK_SCOPE_BEGIN("parser");
 
     ds_string_slice line;
     if (ds_string_slice_tokenize(slice, '\n', &line) != 0) {
@@ -427,194 +1174,3484 @@ static int parse_indirect_object(ds_string_slice *slice, indirect_object *object
 
     // we must have `x y obj`
     ds_string_slice token;
-    char *word = NULL;
-    ds_dynamic_array_init(&object->objects, sizeof(object_t));
+    ds_dynamic_array_init_allocator(&object->objects, sizeof(object_t), parser->options.allocator);
 
     // could use ws stuff
     ds_string_slice_tokenize(&line, ' ', &token);
-    ds_string_slice_to_owned(&token, &word);
-    object->object_number = atoi(word);
-    free(word);
+    object->object_number = slice_to_long(&token);
 
     ds_string_slice_tokenize(&line, ' ', &token);
-    ds_string_slice_to_owned(&token, &word);
-    object->generation_number = atoi(word);
-    free(word);
+    object->generation_number = slice_to_long(&token);
 
     // we should have a direct object (or more)
     while (1) {
+        ds_string_slice_trim_left_ws(slice);
         if (ds_string_slice_empty(slice)) {
             DS_LOG_ERROR("Expected a direct object or `endobj` keyword but found EOF");
             return_defer(1);
         }
 
-        ds_string_slice_trim_left_ws(slice);
         if (ds_string_slice_starts_with(slice, &DS_STRING_SLICE("endobj"))) {
             ds_string_slice_tokenize(slice, '\n', &line);
             break;
         } else {
             object_t obj;
-            parse_direct_object(slice, &obj);
-            ds_dynamic_array_append(&object->objects, &obj);
+            object_t *last = object->objects.count > 0 ? &((object_t *)object->objects.items)[object->objects.count - 1] : NULL;
+            object_t *length = last != NULL && last->kind == object_dictionary ? pdf_dictionary_get(&last->dictionary, "Length") : NULL;
+            parser->stream_length = length != NULL && length->kind == object_int ? length->integer : -1;
+            if (parse_direct_object(parser, slice, &obj) != 0) {
+                DS_LOG_ERROR("Failed to parse object %d %d", object->object_number, object->generation_number);
+                return_defer(1);
+            }
+            if (parser_append(parser, &object->objects, &obj) != 0) {
+                return_defer(1);
+            }
         }
     }
 
+    pdf_stats_add(PDF_COUNTER_OBJECTS, 1);
+
 defer:
+    DS_TRACK_SCOPE_END();
+    pdf_stats_end(PDF_PHASE_INDIRECT, start_ns);
     return result;
 }
 
-static int parse_xref(ds_string_slice *slice, xref_t *object) {
-    /*
-    xref 42 5
-    0000001000 65535 f
-    0000001234 00000 n
-    0000001987 00000 n
-    0000011987 00000 n
-    0000031987 00000 n
-    */
+// Classic xref rows are exactly 20 bytes: `nnnnnnnnnn ggggg n\r\n`. The fast
+// path decodes a whole row with branch-free digit arithmetic (8 digits at a
+// time packed in a 64 bit word) and the tokenizer is only used for rows that
+// do not follow the fixed layout.
+#define XREF_ENTRY_SIZE 20
+// The PDF spec limits the number of indirect objects in a file, anything above
+// this is damaged data and would only blow up the offset table.
+#define XREF_MAX_OBJECT_NUMBER 8388607
 
-    int result = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+static unsigned long long xref_load8(const unsigned char *data) {
+    unsigned long long chunk;
+    DS_MEMCPY(&chunk, data, sizeof(chunk));
+    return chunk;
+}
 
-    ds_string_slice token;
-    char *word = NULL;
-    int count = 0;
+static unsigned int xref_digits8(const unsigned char *data, unsigned int *value) {
+    unsigned long long chunk = xref_load8(data);
+    unsigned int valid =
+        ((chunk & 0xF0F0F0F0F0F0F0F0ULL) == 0x3030303030303030ULL) &
+        (((chunk + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) == 0x3030303030303030ULL);
 
-    ds_dynamic_array_init(&object->entries, sizeof(xref_entry));
+    chunk -= 0x3030303030303030ULL;
+    chunk = (chunk * 10 + (chunk >> 8)) & 0x00FF00FF00FF00FFULL;
+    chunk = (chunk * 100 + (chunk >> 16)) & 0x0000FFFF0000FFFFULL;
+    chunk = (chunk * 10000 + (chunk >> 32)) & 0x00000000FFFFFFFFULL;
 
-    // we must have `xref`
-    if (ds_string_slice_starts_with(slice, &DS_STRING_SLICE("xref")) == 0) {
-        DS_LOG_ERROR("Expected `xref` keyword but found EOF");
-        return_defer(1);
-    }
-    ds_string_slice_step(slice, 4); // Remove the xref
+    *value = (unsigned int)chunk;
+    return valid;
+}
+#else
+static unsigned int xref_digits8(const unsigned char *data, unsigned int *value) {
+    unsigned int valid = 1;
 
-    ds_string_slice_trim_left_ws(slice);
-    ds_string_slice_take_while_pred(slice, isnumber, &token);
-    ds_string_slice_to_owned(&token, &word);
-    object->id = atoi(word);
-    free(word);
+    *value = 0;
+    for (int i = 0; i < 8; i++) {
+        valid &= (unsigned int)(data[i] - '0') < 10;
+        *value = *value * 10 + (data[i] - '0');
+    }
 
-    ds_string_slice_trim_left_ws(slice);
-    ds_string_slice_take_while_pred(slice, isnumber, &token);
-    ds_string_slice_to_owned(&token, &word);
-    count = atoi(word);
-    free(word);
+    return valid;
+}
+#endif
 
-    ds_string_slice_trim_left_ws(slice);
-    for (int i = 0; i < count; i++) {
-        xref_entry entry = {0};
-        ds_string_slice line;
-        ds_string_slice_tokenize(slice, '\n', &line);
+static int xref_entry_decode(const char *row, xref_entry *entry) {
+    const unsigned char *data = (const unsigned char *)row;
+    unsigned int valid = 1;
+    unsigned int low = 0;
+    unsigned long offset = 0;
+    int generation = 0;
 
-        ds_string_slice_trim_left_ws(&line);
-        ds_string_slice_take_while_pred(&line, isnumber, &token);
-        ds_string_slice_to_owned(&token, &word);
-        entry.object_number = atoi(word);
-        free(word);
+    for (int i = 0; i < 2; i++) {
+        valid &= (unsigned int)(data[i] - '0') < 10;
+        offset = offset * 10 + (data[i] - '0');
+    }
+    valid &= xref_digits8(data + 2, &low);
+    offset = offset * 100000000 + low;
 
-        ds_string_slice_trim_left_ws(&line);
-        ds_string_slice_take_while_pred(&line, isnumber, &token);
-        ds_string_slice_to_owned(&token, &word);
-        entry.generation_number = atoi(word);
-        free(word);
+    for (int i = 11; i < 16; i++) {
+        valid &= (unsigned int)(data[i] - '0') < 10;
+        generation = generation * 10 + (data[i] - '0');
+    }
 
-        ds_string_slice_trim_left_ws(&line);
-        entry.in_use = *line.str;
+    valid &= (data[10] == ' ') & (data[16] == ' ') &
+             ((data[17] == 'n') | (data[17] == 'f'));
+    valid &= ((data[18] == ' ') & ((data[19] == '\n') | (data[19] == '\r'))) |
+             ((data[18] == '\r') & (data[19] == '\n'));
 
-        ds_dynamic_array_append(&object->entries, &entry);
-    }
+    entry->offset = offset;
+    entry->generation_number = generation;
+    entry->in_use = data[17];
 
-defer:
-    return result;
+    return valid;
 }
 
-static int parse_trailer(ds_string_slice *slice, ds_dynamic_array *trailer) {
-    /*
-trailer << /Root 5 0 R
-           /Size 6
-        >>
-    */
-
+static int parse_xref_entry(ds_string_slice *slice, xref_entry *entry) {
     int result = 0;
 
-    object_t object = {0};
+    ds_string_slice token;
 
-    // we must have `trailer`
-    if (ds_string_slice_starts_with(slice, &DS_STRING_SLICE("trailer")) == 0) {
-        DS_LOG_ERROR("Expected `trailer` keyword but found EOF");
+    ds_string_slice line;
+    if (ds_string_slice_tokenize(slice, '\n', &line) != 0) {
+        DS_LOG_ERROR("Expected a xref entry but found EOF");
         return_defer(1);
     }
-    ds_string_slice_step(slice, 7); // Remove the trailer
 
-    ds_string_slice_trim_left_ws(slice);
+    ds_string_slice_trim_left_ws(&line);
+    ds_string_slice_take_while_pred(&line, isnumber, &token);
+    entry->offset = slice_to_long(&token);
 
-    if (parse_dictionary_object(slice, &object) != 0) {
-        DS_LOG_ERROR("Failed to parse dictionary");
-        return_defer(1);
-    }
+    ds_string_slice_trim_left_ws(&line);
+    ds_string_slice_take_while_pred(&line, isnumber, &token);
+    entry->generation_number = slice_to_long(&token);
 
-    *trailer = object.dictionary;
+    ds_string_slice_trim_left_ws(&line);
+    entry->in_use = ds_string_slice_empty(&line) ? 'f' : *line.str;
 
 defer:
     return result;
 }
 
-static int parse_startxref(ds_string_slice *slice, int *startxref) {
+static int parse_xref(pdf_parser *parser, ds_string_slice *slice, xref_t *object) {
+    /*
+    xref
+    42 5
+    0000001000 65535 f
+    0000001234 00000 n
+    0000001987 00000 n
+    0000011987 00000 n
+    0000031987 00000 n
+    */
+
     int result = 0;
 
     ds_string_slice token;
-    char *word = NULL;
 
-    // we must have `startxref`
-    if (ds_string_slice_starts_with(slice, &DS_STRING_SLICE("startxref")) == 0) {
-        DS_LOG_ERROR("Expected `startxref` keyword but found EOF");
+    ds_dynamic_array_init_allocator(&object->entries, sizeof(xref_entry), parser->options.allocator);
+
+    // we must have `xref`
+    if (ds_string_slice_starts_with(slice, &DS_STRING_SLICE("xref")) == 0) {
+        DS_LOG_ERROR("Expected `xref` keyword but found EOF");
+        return_defer(1);
+    }
+    ds_string_slice_step(slice, 4); // Remove the xref
+
+    ds_string_slice_trim_left_ws(slice);
+    object->id = 0;
+
+    // a table is made of subsections, each one starting with `first count`
+    for (int section = 0; !ds_string_slice_empty(slice) && isdigit(*slice->str); section++) {
+        long first = 0;
+        long count = 0;
+
+        ds_string_slice_take_while_pred(slice, isnumber, &token);
+        first = slice_to_long(&token);
+
+        ds_string_slice_trim_left_ws(slice);
+        ds_string_slice_take_while_pred(slice, isnumber, &token);
+        count = slice_to_long(&token);
+
+        if (section == 0) {
+            object->id = first;
+        }
+
+        // skip the end of line after the header, the rows start right after
+        ds_string_slice_trim_left(slice, ' ');
+        ds_string_slice_trim_left(slice, '\r');
+        ds_string_slice_trim_left(slice, '\n');
+
+        if (first < 0 || first > XREF_MAX_OBJECT_NUMBER || count < 0) {
+            DS_LOG_WARN("Invalid xref subsection %ld %ld", first, count);
+            return_defer(0);
+        }
+        long rows = DS_MIN(count, XREF_MAX_OBJECT_NUMBER + 1L - first);
+
+        // the count comes from the file, only reserve the rows that the rest
+        // of the buffer can hold
+        unsigned long reserve = DS_MIN((unsigned long)rows, slice->len / XREF_ENTRY_SIZE + 1);
+        if (parser_charge(parser, reserve * sizeof(xref_entry)) != 0) {
+            return_defer(1);
+        }
+
+        if (ds_dynamic_array_reserve(&object->entries, object->entries.count + reserve) != 0) {
+            DS_LOG_ERROR("Failed to allocate %lu xref entries", reserve);
+            return_defer(1);
+        }
+
+        for (long i = 0; i < rows; i++) {
+            // rows shorter than XREF_ENTRY_SIZE can outgrow the reserve
+            if (object->entries.count == object->entries.capacity &&
+                (parser_charge(parser, object->entries.capacity * sizeof(xref_entry)) != 0 ||
+                 ds_dynamic_array_reserve(&object->entries, object->entries.capacity * 2) != 0)) {
+                return_defer(1);
+            }
+
+            xref_entry *entry = (xref_entry *)object->entries.items + object->entries.count;
+
+            if (slice->len >= XREF_ENTRY_SIZE && xref_entry_decode(slice->str, entry)) {
+                ds_string_slice_step(slice, XREF_ENTRY_SIZE);
+            } else {
+                // a truncated table runs into the trailer, stop at the keyword
+                ds_string_slice_trim_left_ws(slice);
+                if (ds_string_slice_empty(slice) || !isdigit(*slice->str)) {
+                    DS_LOG_WARN("Expected %ld xref entries but found %ld", count, i);
+                    return_defer(0);
+                }
+
+                if (parse_xref_entry(slice, entry) != 0) {
+                    return_defer(1);
+                }
+            }
+
+            entry->object_number = (int)(first + i);
+            object->entries.count += 1;
+        }
+
+        ds_string_slice_trim_left_ws(slice);
+    }
+
+defer:
+    return result;
+}
+
+static int parse_trailer(pdf_parser *parser, ds_string_slice *slice, ds_dynamic_array *trailer) {
+    /*
+trailer << /Root 5 0 R
+           /Size 6
+        >>
+    */
+
+    int result = 0;
+
+    object_t object = {0};
+
+    // we must have `trailer`
+    if (ds_string_slice_starts_with(slice, &DS_STRING_SLICE("trailer")) == 0) {
+        DS_LOG_ERROR("Expected `trailer` keyword but found EOF");
+        return_defer(1);
+    }
+    ds_string_slice_step(slice, 7); // Remove the trailer
+
+    ds_string_slice_trim_left_ws(slice);
+
+    if (parse_dictionary_object(parser, slice, &object) != 0) {
+        DS_LOG_ERROR("Failed to parse dictionary");
+        return_defer(1);
+    }
+
+    *trailer = object.dictionary;
+
+defer:
+    return result;
+}
+
+static int parse_startxref(ds_string_slice *slice, long *startxref) {
+    int result = 0;
+
+    ds_string_slice token;
+
+    // we must have `startxref`
+    if (ds_string_slice_starts_with(slice, &DS_STRING_SLICE("startxref")) == 0) {
+        DS_LOG_ERROR("Expected `startxref` keyword but found EOF");
         return_defer(1);
     }
     ds_string_slice_step(slice, 9); // Remove the startxref
 
     ds_string_slice_trim_left_ws(slice);
     ds_string_slice_take_while_pred(slice, isnumber, &token);
-    ds_string_slice_to_owned(&token, &word);
-    *startxref = atoi(word);
-    free(word);
+    *startxref = slice_to_long(&token);
+
+defer:
+    return result;
+}
+
+// Check that there is an object header `N G obj` at the given offset
+//
+// Returns 1 if the header was found and fills the object and generation number.
+static int xref_object_header(const char *buffer, unsigned long buffer_len, unsigned long offset,
+                              int *object_number, int *generation_number) {
+    unsigned long i = offset;
+    unsigned long len = buffer_len;
+    long number = 0;
+    long generation = 0;
+
+    if (i >= len || !isdigit(buffer[i])) {
+        return 0;
+    }
+    while (i < len && isdigit(buffer[i]) && number <= XREF_MAX_OBJECT_NUMBER) {
+        number = number * 10 + (buffer[i++] - '0');
+    }
+
+    if (i >= len || !isspace(buffer[i])) {
+        return 0;
+    }
+    while (i < len && isspace(buffer[i])) {
+        i++;
+    }
+
+    if (i >= len || !isdigit(buffer[i])) {
+        return 0;
+    }
+    while (i < len && isdigit(buffer[i]) && generation <= 65535) {
+        generation = generation * 10 + (buffer[i++] - '0');
+    }
+
+    if (i >= len || !isspace(buffer[i])) {
+        return 0;
+    }
+    while (i < len && isspace(buffer[i])) {
+        i++;
+    }
+
+    if (i + 3 > len || DS_MEMCMP(buffer + i, "obj", 3) != 0) {
+        return 0;
+    }
+    if (i + 3 < len && isalnum(buffer[i + 3])) {
+        return 0;
+    }
+
+    if (number > XREF_MAX_OBJECT_NUMBER || generation > 65535) {
+        return 0;
+    }
+
+    *object_number = (int)number;
+    *generation_number = (int)generation;
+    return 1;
+}
+
+// Check that the startxref offset and the xref table agree with the buffer
+static int xref_validate(char *buffer, unsigned long buffer_len, pdf_t *pdf) {
+    if (pdf->startxref < 0 || (unsigned long)pdf->startxref >= buffer_len) {
+        return 0;
+    }
+
+    if (buffer_len - pdf->startxref < 4 || DS_MEMCMP(buffer + pdf->startxref, "xref", 4) != 0) {
+        return 0;
+    }
+
+    if (pdf->xref.entries.count == 0) {
+        return 0;
+    }
+
+    xref_entry *entries = (xref_entry *)pdf->xref.entries.items;
+    for (unsigned int i = 0; i < pdf->xref.entries.count; i++) {
+        int object_number, generation_number;
+
+        if (entries[i].in_use != 'n') {
+            continue;
+        }
+
+        if (xref_object_header(buffer, buffer_len, entries[i].offset, &object_number, &generation_number) == 0 ||
+            object_number != entries[i].object_number ||
+            generation_number != entries[i].generation_number) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int pdf_build_cache(pdf_t *pdf);
+static void object_free(ds_allocator *allocator, object_t *object);
+
+// Check whether a `/Type /Catalog` starts between start and end
+static int xref_has_catalog(const char *buffer, const char *start, const char *end) {
+    for (const char *p = start; p != end && (p = memchr(p, '/', end - p)) != NULL; p++) {
+        if (end - p < 8 || DS_MEMCMP(p, "/Catalog", 8) != 0) {
+            continue;
+        }
+
+        // the name must be the value of /Type
+        const char *key = p;
+        while (key > buffer && isspace(key[-1])) key--;
+        if (key - buffer >= 5 && DS_MEMCMP(key - 5, "/Type", 5) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Find the object of a rebuilt table that holds a `/Type /Catalog` in its
+// last definition, the one that starts last in the file
+//
+// Returns 0 if one was found and fills the pointer. Returns 1 otherwise
+static int xref_find_catalog(ds_dynamic_array *table, ds_dynamic_array *catalogs, pointer_object *catalog) {
+    xref_entry *entries = (xref_entry *)table->items;
+    unsigned char *flags = (unsigned char *)catalogs->items;
+    xref_entry *owner = NULL;
+
+    for (unsigned long i = 0; i < table->count; i++) {
+        if (entries[i].in_use == 'n' && flags[i] && (owner == NULL || entries[i].offset > owner->offset)) {
+            owner = entries + i;
+        }
+    }
+
+    if (owner == NULL) {
+        return 1;
+    }
+
+    *catalog = (pointer_object){ .object_number = owner->object_number, .generation_number = owner->generation_number };
+    return 0;
+}
+
+// Point the /Root of the trailer at the catalog found in a rebuilt table when
+// the trailer was lost or its /Root is not one of the objects of the table
+//
+// Returns 0 on success. Returns 1 if the trailer could not be updated
+static int xref_recover_root(ds_dynamic_array *table, ds_dynamic_array *catalogs, pdf_t *pdf) {
+    int result = 0;
+    ds_allocator *allocator = pdf->options.allocator;
+    xref_entry *entries = (xref_entry *)table->items;
+    pointer_object catalog;
+
+    object_t *root = pdf->trailer.item_size != 0 ? pdf_dictionary_get(&pdf->trailer, "Root") : NULL;
+    if (root != NULL && root->kind == object_pointer && root->pointer.object_number >= 0 &&
+        (unsigned long)root->pointer.object_number < table->count &&
+        entries[root->pointer.object_number].in_use == 'n') {
+        return_defer(0);
+    }
+
+    if (xref_find_catalog(table, catalogs, &catalog) != 0) {
+        DS_LOG_WARN("The trailer has no /Root and no catalog was found");
+        return_defer(0);
+    }
+
+    if (root == NULL) {
+        object_kv kv = { .name = DS_MALLOC(allocator, sizeof("Root")) };
+        if (kv.name == NULL) {
+            return_defer(1);
+        }
+        memcpy(kv.name, "Root", sizeof("Root"));
+
+        if (pdf->trailer.item_size == 0) {
+            ds_dynamic_array_init_allocator(&pdf->trailer, sizeof(object_kv), allocator);
+        }
+        if (ds_dynamic_array_append(&pdf->trailer, &kv) != 0) {
+            DS_FREE(allocator, kv.name);
+            return_defer(1);
+        }
+        root = &((object_kv *)pdf->trailer.items)[pdf->trailer.count - 1].object;
+    } else {
+        object_free(allocator, root);
+    }
+
+    *root = (object_t){ .kind = object_pointer, .pointer = catalog };
+    DS_LOG_WARN("Recovered the catalog %d %d", catalog.object_number, catalog.generation_number);
 
 defer:
     return result;
 }
 
-PDFDEF int parse_pdf(char *buffer, int buffer_len, pdf_t *pdf) {
+// Rebuild the xref table from the `N G obj` headers found in the buffer
+//
+// This does a single pass over the buffer looking for the `obj` and `endobj`
+// keywords and keeps the last definition of each object, the same way
+// incremental updates override older definitions. A `/Type /Catalog` found on
+// the way marks the object the pass is in, so the /Root can be recovered. The
+// entries that were missing or wrong in the original table are reported in
+// pdf->recovered.
+//
+// The table is indexed by object number, its memory is charged against
+// max_arena_bytes so that a single huge object number can not blow it up.
+//
+// Returns 0 if the table was rebuilt. Returns 1 in case of an error.
+PDFDEF int pdf_repair_xref(char *buffer, unsigned long buffer_len, pdf_t *pdf) {
     int result = 0;
-    indirect_object object = {0};
-    ds_string_slice slice, line;
-    ds_string_slice_init(&slice, buffer, buffer_len);
-    ds_dynamic_array_init(&pdf->objects, sizeof(object_t));
+    unsigned long long start_ns = pdf_stats_begin();
+    pdf_parser parser = { .options = pdf->options, .error = PDF_OK };
+    ds_dynamic_array table = {0}; /* xref_entry */
+    ds_dynamic_array catalogs = {0}; /* unsigned char, set when the object holds the catalog */
+    ds_dynamic_array original = {0}; /* unsigned long */
+    xref_entry *entries = NULL;
 
-    while (1) {
-        skip_comments(&slice);
-        ds_string_slice_trim_left_ws(&slice);
-        if (ds_string_slice_empty(&slice)) {
-            break;
+    ds_dynamic_array_init(&table, sizeof(xref_entry));
+    ds_dynamic_array_init(&catalogs, sizeof(unsigned char));
+    ds_dynamic_array_init(&pdf->recovered, sizeof(xref_entry));
+
+    xref_entry free_entry = { .object_number = 0, .generation_number = 65535, .offset = 0, .in_use = 'f' };
+    unsigned char no_catalog = 0;
+    if (parser_charge(&parser, sizeof(xref_entry) + sizeof(unsigned char)) != 0 ||
+        ds_dynamic_array_append(&table, &free_entry) != 0 || ds_dynamic_array_append(&catalogs, &no_catalog) != 0) {
+        return_defer(1);
+    }
+
+    const char *end = buffer + buffer_len;
+    const char *p = buffer;
+    const char *scanned = buffer;
+    int owner = -1; /* the object the pass is in, -1 after its endobj */
+    while (p != end && (p = memchr(p, 'j', end - p)) != NULL) {
+        const char *keyword = p - 2;
+
+        // the names since the last keyword belong to the object the pass is in
+        if (owner >= 0 && xref_has_catalog(buffer, scanned, p)) {
+            ((unsigned char *)catalogs.items)[owner] = 1;
         }
+        scanned = p;
+        p += 1;
 
-        if (ds_string_slice_starts_with(&slice, &DS_STRING_SLICE("xref"))) {
-            xref_t xref = {0};
-            parse_xref(&slice, &xref);
-            pdf->xref = xref;
-        } else if (ds_string_slice_starts_with(&slice, &DS_STRING_SLICE("trailer"))) {
-            parse_trailer(&slice, &pdf->trailer);
-        } else if (ds_string_slice_starts_with(&slice, &DS_STRING_SLICE("startxref"))) {
-            parse_startxref(&slice, &pdf->startxref);
-        } else if (ds_string_slice_starts_with(&slice, &DS_STRING_SLICE("%%EOF"))) {
-            break;
-        } else {
-            if (parse_indirect_object(&slice, &object) == 0) {
-                ds_dynamic_array_append(&pdf->objects, &object);
+        if (keyword - buffer >= 3 && DS_MEMCMP(keyword - 3, "endobj", 6) == 0) {
+            owner = -1;
+            continue;
+        }
+
+        if (keyword - buffer < 4 || DS_MEMCMP(keyword, "obj", 3) != 0 || !isspace(keyword[-1])) {
+            continue;
+        }
+
+        // walk back over `N G ` to find the start of the header
+        const char *start = keyword - 1;
+        while (start > buffer && isspace(*start)) start--;
+        if (!isdigit(*start)) continue;
+        while (start > buffer && isdigit(*start)) start--;
+        if (!isspace(*start)) continue;
+        while (start > buffer && isspace(*start)) start--;
+        if (!isdigit(*start)) continue;
+        while (start > buffer && isdigit(*start)) start--;
+        if (!isdigit(*start)) {
+            if (isalnum(*start)) continue;
+            start++;
+        }
+
+        int object_number, generation_number;
+        unsigned long offset = (unsigned long)(start - buffer);
+        if (xref_object_header(buffer, buffer_len, offset, &object_number, &generation_number) == 0) {
+            continue;
+        }
+
+        if ((unsigned int)object_number >= table.count) {
+            if ((unsigned long)object_number >= table.capacity || (unsigned long)object_number >= catalogs.capacity) {
+                unsigned long capacity = DS_MAX((unsigned long)object_number + 1, table.capacity * 2);
+                if (parser_charge(&parser, (capacity - table.capacity) * (sizeof(xref_entry) + sizeof(unsigned char))) != 0 ||
+                    ds_dynamic_array_reserve(&table, capacity) != 0 || ds_dynamic_array_reserve(&catalogs, capacity) != 0) {
+                    return_defer(1);
+                }
+            }
+            entries = (xref_entry *)table.items;
+            for (unsigned int i = table.count; i <= (unsigned int)object_number; i++) {
+                entries[i] = (xref_entry){ .object_number = i, .generation_number = 0, .offset = 0, .in_use = 'f' };
+            }
+            memset((unsigned char *)catalogs.items + catalogs.count, 0, object_number + 1 - catalogs.count);
+            table.count = object_number + 1;
+            catalogs.count = object_number + 1;
+        }
+
+        entries = (xref_entry *)table.items;
+        entries[object_number].generation_number = generation_number;
+        entries[object_number].offset = offset;
+        entries[object_number].in_use = 'n';
+        ((unsigned char *)catalogs.items)[object_number] = 0;
+        owner = object_number;
+    }
+
+    if (owner >= 0 && xref_has_catalog(buffer, scanned, end)) {
+        ((unsigned char *)catalogs.items)[owner] = 1;
+    }
+
+    // offsets of the original table that point at the right object
+    ds_dynamic_array_init(&original, sizeof(unsigned long));
+    if (parser_charge(&parser, table.count * sizeof(unsigned long)) != 0 ||
+        ds_dynamic_array_reserve(&original, table.count) != 0) {
+        return_defer(1);
+    }
+    memset(original.items, 0, table.count * sizeof(unsigned long));
+    original.count = table.count;
+
+    xref_entry *old_entries = (xref_entry *)pdf->xref.entries.items;
+    unsigned long *old_offsets = (unsigned long *)original.items;
+    for (unsigned int i = 0; i < pdf->xref.entries.count; i++) {
+        int object_number, generation_number;
+        xref_entry *entry = old_entries + i;
+
+        if (entry->in_use != 'n' || (unsigned int)entry->object_number >= original.count) {
+            continue;
+        }
+
+        if (xref_object_header(buffer, buffer_len, entry->offset, &object_number, &generation_number) &&
+            object_number == entry->object_number) {
+            old_offsets[object_number] = entry->offset + 1;
+        }
+    }
+
+    entries = (xref_entry *)table.items;
+    for (unsigned int i = 0; i < table.count; i++) {
+        if (entries[i].in_use == 'n' && old_offsets[i] != entries[i].offset + 1) {
+            if (ds_dynamic_array_append(&pdf->recovered, entries + i) != 0) {
+                return_defer(1);
             }
         }
     }
 
+    if (xref_recover_root(&table, &catalogs, pdf) != 0) {
+        return_defer(1);
+    }
+
+    ds_dynamic_array_free(&pdf->xref.entries);
+    pdf->xref.id = 0;
+    pdf->xref.entries = table;
+    pdf->repaired = 1;
+
+    if (pdf->cache.count != 0 && pdf_build_cache(pdf) != 0) {
+        return_defer(1);
+    }
+
+    DS_LOG_WARN("Rebuilt the xref table: %lu objects recovered", pdf->recovered.count);
+
+defer:
+    ds_dynamic_array_free(&original);
+    ds_dynamic_array_free(&catalogs);
+    if (result != 0) {
+        ds_dynamic_array_free(&table);
+    }
+    pdf_stats_end(PDF_PHASE_XREF, start_ns);
+    return result;
+}
+
+// Initialize the parse options with the default limits
+PDFDEF void pdf_parse_options_init(pdf_parse_options *options) {
+    options->max_depth = PDF_DEFAULT_MAX_DEPTH;
+    options->max_arena_bytes = 0;
+    options->max_decompressed_bytes = 0;
+    options->timeout_ms = 0;
+    options->cache_bytes = 0;
+    options->window_bytes = PDF_STREAM_WINDOW;
+    options->allocator = NULL;
+}
+
+// Get a readable message for a pdf_error code
+PDFDEF const char *pdf_error_string(int error) {
+    switch (error) {
+    case PDF_OK: return "ok";
+    case PDF_ERR_SYNTAX: return "syntax error";
+    case PDF_ERR_DEPTH: return "maximum nesting depth exceeded";
+    case PDF_ERR_MEMORY: return "memory limit exceeded";
+    case PDF_ERR_DECOMPRESSED: return "decompressed size limit exceeded";
+    case PDF_ERR_TIMEOUT: return "time budget exceeded";
+    case PDF_ERR_IO: return "input/output error";
+    }
+
+    return "unknown error";
+}
+
+// Pack an object reference into a hashmap key
+static void *pdf_object_key(int object_number, int generation_number) {
+    return (void *)(((unsigned long)(unsigned int)object_number << 16) |
+                    ((unsigned int)generation_number & 0xFFFF));
+}
+
+// Index the parsed objects by (object number, generation). When an object is
+// defined more than once the last definition wins, like an incremental update.
+//
+// Returns 0 on success, 1 if the table could not be allocated
+static int pdf_build_object_table(pdf_parser *parser, pdf_t *pdf) {
+    int result = 0;
+
+    if (ds_hashmap_init_allocator(&pdf->table, pdf->objects.count, ds_hashmap_hash_pointer,
+                                  ds_hashmap_compare_pointer, parser->options.allocator) != 0) {
+        parser->error = PDF_ERR_MEMORY;
+        return_defer(1);
+    }
+
+    if (parser_charge(parser, pdf->table.capacity * (sizeof(ds_hashmap_kv) + sizeof(unsigned int))) != 0) {
+        return_defer(1);
+    }
+
+    for (unsigned int i = 0; i < pdf->objects.count; i++) {
+        indirect_object *object = (indirect_object *)pdf->objects.items + i;
+        ds_hashmap_kv kv = {
+            .key = pdf_object_key(object->object_number, object->generation_number),
+            .value = object,
+        };
+
+        if (ds_hashmap_insert(&pdf->table, &kv) != 0) {
+            parser->error = PDF_ERR_MEMORY;
+            return_defer(1);
+        }
+    }
+
 defer:
     return result;
 }
 
+// Look up an indirect object by its number and generation
+//
+// Returns 0 if the object was found, 1 otherwise. The pointer stays valid as
+// long as the pdf is alive.
+PDFDEF int pdf_get_object(pdf_t *pdf, int object_number, int generation_number, indirect_object **object) {
+    ds_hashmap_kv kv = {.key = pdf_object_key(object_number, generation_number)};
+
+    if (pdf->table.capacity == 0 || ds_hashmap_get(&pdf->table, &kv) != 0) {
+        return 1;
+    }
+
+    *object = kv.value;
+    return 0;
+}
+
+static void object_free(ds_allocator *allocator, object_t *object);
+
+static void object_array_free(ds_allocator *allocator, ds_dynamic_array *array) {
+    object_t *items = (object_t *)array->items;
+    for (unsigned int i = 0; i < array->count; i++) {
+        object_free(allocator, items + i);
+    }
+    ds_dynamic_array_free(array);
+}
+
+static void object_dictionary_free(ds_allocator *allocator, ds_dynamic_array *dictionary) {
+    object_kv *items = (object_kv *)dictionary->items;
+    for (unsigned int i = 0; i < dictionary->count; i++) {
+        DS_FREE(allocator, items[i].name);
+        object_free(allocator, &items[i].object);
+    }
+    ds_dynamic_array_free(dictionary);
+}
+
+// Free everything an object owns. Strings and names are freed with the
+// allocator the parser used for them.
+static void object_free(ds_allocator *allocator, object_t *object) {
+    switch (object->kind) {
+    case object_string: DS_FREE(allocator, object->string); break;
+    case object_name: DS_FREE(allocator, object->name); break;
+    case object_array: object_array_free(allocator, &object->array); break;
+    case object_dictionary: object_dictionary_free(allocator, &object->dictionary); break;
+    case object_indirect: object_array_free(allocator, &object->object.objects); break;
+    default: break;
+    }
+}
+
+static void pdf_cache_free(pdf_cache *cache) {
+    for (unsigned int i = 0; i < cache->count; i++) {
+        indirect_object *object = atomic_load_explicit(cache->slots + i, memory_order_acquire);
+        if (object != NULL) {
+            object_array_free(NULL, &object->objects);
+            DS_FREE(NULL, object);
+        }
+    }
+
+    if (cache->slots != NULL) {
+        DS_FREE(NULL, cache->slots);
+    }
+    if (cache->entries != NULL) {
+        DS_FREE(NULL, cache->entries);
+    }
+
+    cache->slots = NULL;
+    cache->entries = NULL;
+    cache->count = 0;
+}
+
+// Index the in use xref entries by object number for pdf_resolve. Any object
+// resolved from an older table is dropped.
+//
+// Returns 0 on success, 1 if the cache could not be allocated
+static int pdf_build_cache(pdf_t *pdf) {
+    int result = 0;
+    xref_entry *entries = (xref_entry *)pdf->xref.entries.items;
+    unsigned int count = 0;
+
+    pdf_cache_free(&pdf->cache);
+
+    for (unsigned int i = 0; i < pdf->xref.entries.count; i++) {
+        int object_number = entries[i].object_number;
+        if (entries[i].in_use == 'n' && object_number >= 0 && object_number <= XREF_MAX_OBJECT_NUMBER) {
+            count = DS_MAX(count, (unsigned int)object_number + 1);
+        }
+    }
+
+    if (count == 0) {
+        return_defer(0);
+    }
+
+    pdf->cache.slots = DS_MALLOC(NULL, count * sizeof(*pdf->cache.slots));
+    pdf->cache.entries = DS_MALLOC(NULL, count * sizeof(xref_entry));
+    if (pdf->cache.slots == NULL || pdf->cache.entries == NULL) {
+        DS_LOG_ERROR("Failed to allocate the object cache");
+        return_defer(1);
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        atomic_init(pdf->cache.slots + i, NULL);
+        pdf->cache.entries[i] = (xref_entry){ .object_number = i, .generation_number = 0, .offset = 0, .in_use = 'f' };
+    }
+
+    // the rows of an update come later and override the older ones, a free
+    // row deletes the object
+    for (unsigned int i = 0; i < pdf->xref.entries.count; i++) {
+        int object_number = entries[i].object_number;
+        if (object_number >= 0 && (unsigned int)object_number < count) {
+            pdf->cache.entries[object_number] = entries[i];
+        }
+    }
+
+    pdf->cache.count = count;
+
+defer:
+    if (result != 0) {
+        pdf_cache_free(&pdf->cache);
+    }
+    return result;
+}
+
+// Get an indirect object, parsing it from the buffer the first time it is
+// asked for. Objects of an eager parse are returned from the object table.
+//
+// This is safe to call from many threads on the same pdf. When two threads
+// race on one object both parse it, the first one publishes its copy and the
+// other copy is freed. Resolved objects always use malloc, because a
+// ds_allocator cannot be shared between threads.
+//
+// Returns 0 if the object was found, 1 otherwise.
+PDFDEF int pdf_resolve(pdf_t *pdf, int object_number, int generation_number, indirect_object **object) {
+    int result = 0;
+    indirect_object *fresh = NULL;
+    pdf_cache *cache = &pdf->cache;
+
+    if (pdf_get_object(pdf, object_number, generation_number, object) == 0) {
+        return_defer(0);
+    }
+
+    if (object_number < 0 || (unsigned int)object_number >= cache->count) {
+        return_defer(1);
+    }
+
+    xref_entry *entry = cache->entries + object_number;
+    if (entry->in_use != 'n' || entry->generation_number != generation_number ||
+        entry->offset >= pdf->buffer_len) {
+        return_defer(1);
+    }
+
+    indirect_object *cached = atomic_load_explicit(cache->slots + object_number, memory_order_acquire);
+    if (cached != NULL) {
+        *object = cached;
+        return_defer(0);
+    }
+
+    fresh = DS_MALLOC(NULL, sizeof(indirect_object));
+    if (fresh == NULL) {
+        return_defer(1);
+    }
+    *fresh = (indirect_object){0};
+
+    pdf_parser parser = {0};
+    parser.options = pdf->options;
+    parser.options.allocator = NULL;
+    parser.error = PDF_OK;
+    if (parser.options.timeout_ms != 0) {
+        parser.deadline_ms = parser_now_ms() + parser.options.timeout_ms;
+    }
+
+    ds_string_slice slice;
+    ds_string_slice_init(&slice, pdf->buffer + entry->offset, pdf->buffer_len - entry->offset);
+    if (parse_indirect_object(&parser, &slice, fresh) != 0 ||
+        fresh->object_number != object_number) {
+        object_array_free(NULL, &fresh->objects);
+        return_defer(1);
+    }
+
+    indirect_object *expected = NULL;
+    if (atomic_compare_exchange_strong_explicit(cache->slots + object_number, &expected, fresh,
+                                                memory_order_acq_rel, memory_order_acquire)) {
+        *object = fresh;
+        fresh = NULL;
+    } else {
+        object_array_free(NULL, &fresh->objects);
+        *object = expected;
+    }
+
+defer:
+    if (fresh != NULL) {
+        DS_FREE(NULL, fresh);
+    }
+    return result;
+}
+
+static int pdf_stream_cache_init(pdf_stream_cache *cache, unsigned long budget) {
+    int result = 0;
+
+    *cache = (pdf_stream_cache){0};
+    cache->budget = budget;
+
+    if (pthread_mutex_init(&cache->lock, NULL) != 0) {
+        DS_LOG_ERROR("Failed to initialize the stream cache lock");
+        return_defer(1);
+    }
+
+    if (ds_hashmap_init(&cache->map, 0, ds_hashmap_hash_pointer, ds_hashmap_compare_pointer) != 0) {
+        pthread_mutex_destroy(&cache->lock);
+        return_defer(1);
+    }
+
+    cache->ready = 1;
+
+defer:
+    return result;
+}
+
+// Drop a reference to a stream, the last one frees it
+static void pdf_stream_unref(pdf_stream *stream) {
+    stream->refs -= 1;
+    if (stream->refs == 0) {
+        if (stream->owned && stream->data != NULL) {
+            DS_FREE(NULL, stream->data);
+        }
+        DS_FREE(NULL, stream);
+    }
+}
+
+static void pdf_stream_cache_unlink(pdf_stream_cache *cache, pdf_stream *stream) {
+    if (stream->prev != NULL) {
+        stream->prev->next = stream->next;
+    } else {
+        cache->head = stream->next;
+    }
+
+    if (stream->next != NULL) {
+        stream->next->prev = stream->prev;
+    } else {
+        cache->tail = stream->prev;
+    }
+
+    stream->prev = NULL;
+    stream->next = NULL;
+}
+
+static void pdf_stream_cache_push_front(pdf_stream_cache *cache, pdf_stream *stream) {
+    stream->prev = NULL;
+    stream->next = cache->head;
+
+    if (cache->head != NULL) {
+        cache->head->prev = stream;
+    } else {
+        cache->tail = stream;
+    }
+    cache->head = stream;
+}
+
+static void pdf_stream_cache_free(pdf_stream_cache *cache) {
+    if (cache->ready == 0) {
+        return;
+    }
+
+    pdf_stream *stream = cache->head;
+    while (stream != NULL) {
+        pdf_stream *next = stream->next;
+        pdf_stream_unref(stream);
+        stream = next;
+    }
+
+    ds_hashmap_free(&cache->map);
+    pthread_mutex_destroy(&cache->lock);
+    *cache = (pdf_stream_cache){0};
+}
+
+// Find the dictionary and the data of a stream object
+//
+// Returns 0 if the object is a stream. Returns 1 otherwise
+static int pdf_object_stream(indirect_object *object, ds_dynamic_array **dictionary, ds_string_slice *stream) {
+    object_t *items = (object_t *)object->objects.items;
+
+    if (object->objects.count < 2 || items[0].kind != object_dictionary || items[1].kind != object_stream) {
+        return 1;
+    }
+
+    *dictionary = &items[0].dictionary;
+    *stream = items[1].stream;
+    return 0;
+}
+
+// Get the value of a dictionary entry
+//
+// Returns the value, or NULL if the dictionary has no such entry
+PDFDEF object_t *pdf_dictionary_get(ds_dynamic_array *dictionary, const char *name) {
+    object_kv *items = (object_kv *)dictionary->items;
+
+    for (unsigned int i = 0; i < dictionary->count; i++) {
+        if (strcmp(items[i].name, name) == 0) {
+            return &items[i].object;
+        }
+    }
+
+    return NULL;
+}
+
+// Check whether a stream dictionary is an image XObject
+static int pdf_is_image(ds_dynamic_array *dictionary) {
+    object_t *subtype = pdf_dictionary_get(dictionary, "Subtype");
+    return subtype != NULL && subtype->kind == object_name && strcmp(subtype->name, "Image") == 0;
+}
+
+// Get the value of a dictionary entry, following an indirect reference to the
+// first object of the object it points to
+//
+// Returns the value, or NULL if the entry or the referenced object is missing
+PDFDEF object_t *pdf_lookup(pdf_t *pdf, ds_dynamic_array *dictionary, const char *name) {
+    object_t *value = pdf_dictionary_get(dictionary, name);
+    indirect_object *object = NULL;
+
+    if (value == NULL || value->kind != object_pointer) {
+        return value;
+    }
+
+    if (pdf_resolve(pdf, value->pointer.object_number, value->pointer.generation_number, &object) != 0 ||
+        object->objects.count == 0) {
+        return NULL;
+    }
+
+    return (object_t *)object->objects.items;
+}
+
+// Get the decoded data of a stream object
+//
+// FlateDecode streams are inflated and kept in the stream cache, so asking
+// again for a shared stream costs no inflate. On a miss the stream is decoded
+// without holding the lock; if another thread cached it in the meantime that
+// copy is used. Streams with other filters are returned as they are stored
+// in the file. The stream must be given back with pdf_release_stream.
+//
+// Returns PDF_OK with *stream set. PDF_ERR_SYNTAX means the data is corrupt,
+// and *stream holds what could be decoded if there was anything. Any other
+// pdf_error code leaves *stream NULL.
+PDFDEF int pdf_get_stream(pdf_t *pdf, indirect_object *object, pdf_stream **stream) {
+    int result = PDF_OK;
+    pdf_stream_cache *cache = &pdf->streams;
+    pdf_stream *fresh = NULL;
+    ds_dynamic_array *dictionary = NULL;
+    ds_string_slice data;
+    ds_hashmap_kv kv = {.key = pdf_object_key(object->object_number, object->generation_number)};
+
+    *stream = NULL;
+
+    if (pdf_object_stream(object, &dictionary, &data) != 0) {
+        return_defer(PDF_ERR_SYNTAX);
+    }
+
+    fresh = DS_MALLOC(NULL, sizeof(pdf_stream));
+    if (fresh == NULL) {
+        return_defer(PDF_ERR_MEMORY);
+    }
+    *fresh = (pdf_stream){.key = kv.key, .data = data.str, .len = data.len, .owned = 0, .refs = 1};
+
+    object_t *filter = pdf_dictionary_get(dictionary, "Filter");
+    if (filter == NULL || filter->kind != object_name || strcmp(filter->name, "FlateDecode") != 0) {
+        *stream = fresh;
+        return_defer(PDF_OK);
+    }
+
+    if (cache->ready) {
+        pthread_mutex_lock(&cache->lock);
+        if (ds_hashmap_get(&cache->map, &kv) == 0) {
+            pdf_stream *cached = kv.value;
+            pdf_stream_cache_unlink(cache, cached);
+            pdf_stream_cache_push_front(cache, cached);
+            cached->refs += 1;
+            cache->hits += 1;
+            pdf_stats_add(PDF_COUNTER_CACHE_HITS, 1);
+            pthread_mutex_unlock(&cache->lock);
+
+            pdf_stream_unref(fresh);
+            *stream = cached;
+            return_defer(PDF_OK);
+        }
+        cache->misses += 1;
+        pdf_stats_add(PDF_COUNTER_CACHE_MISSES, 1);
+        pthread_mutex_unlock(&cache->lock);
+    }
+
+    // the decoded length is optional, 0 means unknown
+    unsigned long decoded_len = 0;
+    object_t *length = pdf_dictionary_get(dictionary, "DL");
+    if (length != NULL && length->kind == object_int && length->integer > 0) {
+        decoded_len = length->integer;
+    }
+
+    pdf_parse_options options = pdf->options;
+    options.allocator = NULL;
+    result = pdf_flate_decode(&options, &data, decoded_len, &fresh->data, &fresh->len);
+    fresh->owned = 1;
+    if (result != PDF_OK && result != PDF_ERR_SYNTAX) {
+        pdf_stream_unref(fresh);
+        return_defer(result);
+    }
+
+    // partially decoded streams are not cached, the next caller retries
+    if (cache->ready && result == PDF_OK && cache->budget != 0 && fresh->len <= cache->budget) {
+        pthread_mutex_lock(&cache->lock);
+        if (ds_hashmap_get(&cache->map, &kv) == 0) {
+            pdf_stream *cached = kv.value;
+            cached->refs += 1;
+            pthread_mutex_unlock(&cache->lock);
+
+            pdf_stream_unref(fresh);
+            *stream = cached;
+            return_defer(PDF_OK);
+        }
+
+        kv.value = fresh;
+        if (ds_hashmap_insert(&cache->map, &kv) == 0) {
+            fresh->refs += 1;
+            cache->bytes += fresh->len;
+            pdf_stream_cache_push_front(cache, fresh);
+
+            while (cache->bytes > cache->budget && cache->tail != fresh) {
+                pdf_stream *victim = cache->tail;
+                pdf_stream_cache_unlink(cache, victim);
+                ds_hashmap_delete(&cache->map, victim->key);
+                cache->bytes -= victim->len;
+                cache->evictions += 1;
+                pdf_stream_unref(victim);
+            }
+        }
+        pthread_mutex_unlock(&cache->lock);
+    }
+
+    *stream = fresh;
+
+defer:
+    return result;
+}
+
+// Give back a stream from pdf_get_stream
+PDFDEF void pdf_release_stream(pdf_t *pdf, pdf_stream *stream) {
+    if (stream == NULL) {
+        return;
+    }
+
+    if (pdf->streams.ready) {
+        pthread_mutex_lock(&pdf->streams.lock);
+        pdf_stream_unref(stream);
+        pthread_mutex_unlock(&pdf->streams.lock);
+    } else {
+        pdf_stream_unref(stream);
+    }
+}
+
+// Get the hit, miss and eviction counters of the stream cache
+PDFDEF void pdf_stream_cache_get_stats(pdf_t *pdf, pdf_stream_cache_stats *stats) {
+    *stats = (pdf_stream_cache_stats){0};
+
+    if (pdf->streams.ready == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&pdf->streams.lock);
+    stats->hits = pdf->streams.hits;
+    stats->misses = pdf->streams.misses;
+    stats->evictions = pdf->streams.evictions;
+    stats->bytes = pdf->streams.bytes;
+    stats->count = ds_hashmap_count(&pdf->streams.map);
+    pthread_mutex_unlock(&pdf->streams.lock);
+}
+
+// Append the text shown by the string operands of a content stream
+//
+// Returns 0 on success. Returns 1 if the text could not be appended
+PDFDEF int pdf_append_text(ds_string_builder *sb, const char *text, unsigned long text_len) {
+    int result = 0;
+    unsigned long start = 0;
+    unsigned long long start_ns = pdf_stats_begin();
+
+    for (unsigned long j = 0; j < text_len; j++) {
+        if (text[j] != '(') {
+            continue;
+        }
+
+        for (start = ++j; j < text_len && text[j] != ')'; j++) {
+        }
+
+        if (j > start && ds_string_builder_appendn(sb, text + start, j - start) != 0) {
+            return_defer(1);
+        }
+    }
+
+defer:
+    pdf_stats_end(PDF_PHASE_TEXT, start_ns);
+    return result;
+}
+
+// Shared state of the decode workers. Decoded streams wait in a ring of
+// window slots until the calling thread has handed them to the callback, so
+// the workers never run more than window objects ahead.
+typedef struct pdf_decode_stage {
+    pdf_t *pdf;
+    indirect_object **objects;
+    unsigned long count;
+    unsigned long next;    /* next object to decode */
+    unsigned long written; /* objects handed to the callback */
+    unsigned long window;
+    pdf_decoded *slots;
+    int *done;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t ready; /* a slot was filled */
+    pthread_cond_t space; /* a slot was emptied */
+} pdf_decode_stage;
+
+static void pdf_decode_one(pdf_t *pdf, indirect_object *object, pdf_decoded *decoded) {
+    ds_dynamic_array *dictionary = NULL;
+    ds_string_slice data;
+
+    unsigned long long start_ns = pdf_stats_begin();
+
+    *decoded = (pdf_decoded){.object = object, .stream = NULL, .error = PDF_ERR_SYNTAX};
+    if (pdf_object_stream(object, &dictionary, &data) == 0) {
+        decoded->error = pdf_is_image(dictionary) ? PDF_OK : pdf_get_stream(pdf, object, &decoded->stream);
+    }
+    pdf_stats_end(PDF_PHASE_DECODE, start_ns);
+}
+
+static void *pdf_decode_worker(void *arg) {
+    pdf_decode_stage *stage = arg;
+
+    pdf_trace_name_thread("decode");
+    pthread_mutex_lock(&stage->lock);
+    while (!stage->stop && stage->next < stage->count) {
+        if (stage->next >= stage->written + stage->window) {
+            unsigned long long idle_ns = pdf_stats_begin();
+            pthread_cond_wait(&stage->space, &stage->lock);
+            pdf_stats_end(PDF_PHASE_IDLE, idle_ns);
+            continue;
+        }
+
+        unsigned long i = stage->next++;
+        pthread_mutex_unlock(&stage->lock);
+
+        pdf_decoded decoded;
+        pdf_decode_one(stage->pdf, stage->objects[i], &decoded);
+
+        pthread_mutex_lock(&stage->lock);
+        stage->slots[i % stage->window] = decoded;
+        stage->done[i % stage->window] = 1;
+        pthread_cond_broadcast(&stage->ready);
+    }
+    pthread_mutex_unlock(&stage->lock);
+
+    pdf_inflater_release();
+    return NULL;
+}
+
+// Decode the streams of many objects on a pool of threads
+//
+// Every worker inflates with its own zlib state into its own buffers, the
+// decoded streams go through the stream cache like pdf_get_stream. The
+// callback runs on the calling thread in the order of the objects, so the
+// output does not depend on the number of threads. Each stream is released
+// when its callback returns. With threads <= 1 everything runs inline.
+//
+// Returns 0 when every object was handed to the callback, the return value of
+// the callback that stopped the decoding, or 1 if the workers could not be set
+// up.
+PDFDEF int pdf_decode_streams(pdf_t *pdf, indirect_object **objects, unsigned long count, unsigned int threads,
+                              pdf_decoded_callback *callback, void *context) {
+    int result = 0;
+    pdf_decode_stage stage = {0};
+    pthread_t *workers = NULL;
+    unsigned int started = 0;
+    int locks = 0;
+
+    if (threads <= 1 || count <= 1) {
+        for (unsigned long i = 0; i < count && result == 0; i++) {
+            pdf_decoded decoded;
+            pdf_decode_one(pdf, objects[i], &decoded);
+            result = callback(context, pdf, &decoded);
+            pdf_release_stream(pdf, decoded.stream);
+        }
+        return result;
+    }
+
+    stage.pdf = pdf;
+    stage.objects = objects;
+    stage.count = count;
+    stage.window = (unsigned long)threads * PDF_DECODE_WINDOW;
+    stage.slots = DS_MALLOC(NULL, stage.window * sizeof(pdf_decoded));
+    stage.done = DS_MALLOC(NULL, stage.window * sizeof(int));
+    workers = DS_MALLOC(NULL, threads * sizeof(pthread_t));
+    if (stage.slots == NULL || stage.done == NULL || workers == NULL) {
+        DS_LOG_ERROR("Failed to allocate the decode workers");
+        return_defer(1);
+    }
+    memset(stage.done, 0, stage.window * sizeof(int));
+
+    if (pthread_mutex_init(&stage.lock, NULL) != 0 || pthread_cond_init(&stage.ready, NULL) != 0 ||
+        pthread_cond_init(&stage.space, NULL) != 0) {
+        DS_LOG_ERROR("Failed to initialize the decode workers");
+        return_defer(1);
+    }
+    locks = 1;
+
+    for (; started < threads; started++) {
+        if (pthread_create(workers + started, NULL, pdf_decode_worker, &stage) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        DS_LOG_ERROR("Failed to start the decode workers");
+        return_defer(1);
+    }
+
+    for (unsigned long i = 0; i < count && result == 0; i++) {
+        unsigned long slot = i % stage.window;
+
+        pthread_mutex_lock(&stage.lock);
+        unsigned long long stall_ns = stage.done[slot] ? 0 : pdf_stats_begin();
+        while (!stage.done[slot]) {
+            pthread_cond_wait(&stage.ready, &stage.lock);
+        }
+        pdf_stats_end(PDF_PHASE_STALL, stall_ns);
+        pdf_decoded decoded = stage.slots[slot];
+        stage.done[slot] = 0;
+        stage.written = i + 1;
+        pthread_cond_broadcast(&stage.space);
+        pthread_mutex_unlock(&stage.lock);
+
+        result = callback(context, pdf, &decoded);
+        pdf_release_stream(pdf, decoded.stream);
+    }
+
+defer:
+    if (locks) {
+        pthread_mutex_lock(&stage.lock);
+        stage.stop = 1;
+        pthread_cond_broadcast(&stage.space);
+        pthread_mutex_unlock(&stage.lock);
+    }
+    for (unsigned int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    // streams decoded ahead of a callback that stopped the decoding
+    for (unsigned long i = 0; stage.done != NULL && i < stage.window; i++) {
+        if (stage.done[i]) {
+            pdf_release_stream(pdf, stage.slots[i].stream);
+        }
+    }
+    if (locks) {
+        pthread_cond_destroy(&stage.space);
+        pthread_cond_destroy(&stage.ready);
+        pthread_mutex_destroy(&stage.lock);
+    }
+    if (workers != NULL) {
+        DS_FREE(NULL, workers);
+    }
+    if (stage.done != NULL) {
+        DS_FREE(NULL, stage.done);
+    }
+    if (stage.slots != NULL) {
+        DS_FREE(NULL, stage.slots);
+    }
+    return result;
+}
+
+// Free the pdf and everything it owns. The buffer stays with the caller.
+// Streams from pdf_get_stream must be released before.
+PDFDEF void pdf_free(pdf_t *pdf) {
+    ds_allocator *allocator = pdf->options.allocator;
+    indirect_object *objects = (indirect_object *)pdf->objects.items;
+
+    for (unsigned int i = 0; i < pdf->objects.count; i++) {
+        object_array_free(allocator, &objects[i].objects);
+    }
+    ds_dynamic_array_free(&pdf->objects);
+
+    object_dictionary_free(allocator, &pdf->trailer);
+    ds_dynamic_array_free(&pdf->xref.entries);
+    ds_dynamic_array_free(&pdf->recovered);
+    ds_dynamic_array_free(&pdf->pages);
+    ds_hashmap_free(&pdf->table);
+    pdf_cache_free(&pdf->cache);
+    pdf_stream_cache_free(&pdf->streams);
+}
+
+// Find the offset of the last occurrence of a keyword in the buffer
+//
+// Returns the offset, or -1 if the keyword is not in the buffer
+static long pdf_find_last(char *buffer, unsigned long buffer_len, const char *keyword) {
+    long len = strlen(keyword);
+
+    for (long i = (long)buffer_len - len; i >= 0; i--) {
+        if (buffer[i] == keyword[0] && DS_MEMCMP(buffer + i, keyword, len) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Find the last `startxref` of the buffer
+//
+// Returns 0 if it was found. Returns 1 otherwise
+static int pdf_find_startxref(char *buffer, unsigned long buffer_len, long *startxref) {
+    long offset = pdf_find_last(buffer, buffer_len, "startxref");
+    if (offset < 0) {
+        return 1;
+    }
+
+    ds_string_slice slice;
+    ds_string_slice_init(&slice, buffer + offset, buffer_len - offset);
+    return parse_startxref(&slice, startxref);
+}
+
+// Attach the buffer and the options to a pdf that is about to be opened
+//
+// Returns 0 on success. Returns 1 if the stream cache could not be set up
+static int pdf_open_begin(char *buffer, unsigned long buffer_len, pdf_parse_options *options, pdf_t *pdf) {
+    pdf->buffer = buffer;
+    pdf->buffer_len = buffer_len;
+    pdf->options = *options;
+    ds_dynamic_array_init_allocator(&pdf->objects, sizeof(indirect_object), options->allocator);
+    ds_dynamic_array_init(&pdf->pages, sizeof(pointer_object));
+
+    return pdf_stream_cache_init(&pdf->streams, options->cache_bytes);
+}
+
+// Read the xref section and the trailer that startxref points at, then the
+// older sections that the /Prev entries of the trailers point at. The
+// sections are joined oldest first, so the rows of an incremental update come
+// after the rows they override, and only the newest trailer is kept.
+//
+// Returns 0 on success. Returns 1 if a /Prev section is missing or the chain
+// loops, the table is then left empty so that it gets rebuilt
+static int pdf_read_xref(pdf_parser *parser, pdf_t *pdf) {
+    int result = 0;
+    ds_allocator *allocator = parser->options.allocator;
+    ds_dynamic_array sections; /* xref_t, newest first */
+    ds_dynamic_array offsets; /* long */
+    long offset = pdf->startxref;
+
+    ds_dynamic_array_init(&sections, sizeof(xref_t));
+    ds_dynamic_array_init(&offsets, sizeof(long));
+    ds_dynamic_array_init_allocator(&pdf->xref.entries, sizeof(xref_entry), allocator);
+
+    while (offset >= 0) {
+        long *seen = (long *)offsets.items;
+        for (unsigned long i = 0; i < offsets.count; i++) {
+            if (seen[i] == offset) {
+                DS_LOG_WARN("The /Prev chain of the xref sections loops at %ld", offset);
+                return_defer(1);
+            }
+        }
+
+        ds_string_slice slice;
+        ds_string_slice_init_allocator(&slice, pdf->buffer + offset, pdf->buffer_len - DS_MIN((unsigned long)offset, pdf->buffer_len), allocator);
+        if ((unsigned long)offset >= pdf->buffer_len || !ds_string_slice_starts_with(&slice, &DS_STRING_SLICE("xref"))) {
+            if (offsets.count != 0) {
+                DS_LOG_WARN("The xref section at %ld is missing", offset);
+                return_defer(1);
+            }
+            return_defer(0);
+        }
+
+        xref_t xref = {0};
+        int status = parse_xref(parser, &slice, &xref);
+        if (ds_dynamic_array_append(&sections, &xref) != 0 || ds_dynamic_array_append(&offsets, &offset) != 0) {
+            ds_dynamic_array_free(&xref.entries);
+            parser->error = PDF_ERR_MEMORY;
+            return_defer(1);
+        }
+        if (status != 0 || parser->error != PDF_OK) {
+            return_defer(1);
+        }
+
+        ds_dynamic_array trailer = {0};
+        skip_comments(&slice);
+        ds_string_slice_trim_left_ws(&slice);
+        if (ds_string_slice_starts_with(&slice, &DS_STRING_SLICE("trailer")) &&
+            parse_trailer(parser, &slice, &trailer) != 0) {
+            object_dictionary_free(allocator, &trailer);
+            return_defer(1);
+        }
+
+        object_t *prev = pdf_dictionary_get(&trailer, "Prev");
+        offset = prev != NULL && prev->kind == object_int ? prev->integer : -1;
+
+        if (sections.count == 1) {
+            pdf->trailer = trailer;
+        } else {
+            object_dictionary_free(allocator, &trailer);
+        }
+    }
+
+    xref_t *items = (xref_t *)sections.items;
+    for (unsigned long i = sections.count; i > 0; i--) {
+        if (ds_dynamic_array_append_many(&pdf->xref.entries, (void **)items[i - 1].entries.items, items[i - 1].entries.count) != 0) {
+            parser->error = PDF_ERR_MEMORY;
+            return_defer(1);
+        }
+    }
+    pdf->xref.id = sections.count != 0 ? items[sections.count - 1].id : 0;
+
+defer:
+    if (result != 0) {
+        pdf->xref.entries.count = 0;
+    }
+    for (unsigned long i = 0; i < sections.count; i++) {
+        ds_dynamic_array_free(&((xref_t *)sections.items)[i].entries);
+    }
+    ds_dynamic_array_free(&sections);
+    ds_dynamic_array_free(&offsets);
+    return result;
+}
+
+// Open a pdf without parsing its objects
+//
+// Only the xref table and the trailer that startxref points at are parsed
+// (or the table is rebuilt if they do not match the file). Objects are then
+// parsed on demand with pdf_resolve, which can be shared between threads. The
+// buffer must outlive the pdf.
+//
+// Returns PDF_OK if the file was opened, otherwise a pdf_error code.
+PDFDEF int pdf_open(char *buffer, unsigned long buffer_len, pdf_parse_options *options, pdf_t *pdf) {
+    int result = PDF_OK;
+    unsigned long long start_ns = pdf_stats_begin();
+    DS_TRACK_SCOPE_BEGIN("parser");
+
+    if (pdf_open_begin(buffer, buffer_len, options, pdf) != 0) {
+        return_defer(PDF_ERR_MEMORY);
+    }
+
+    pdf_parser parser = {0};
+    parser.options = *options;
+    parser.error = PDF_OK;
+    if (options->timeout_ms != 0) {
+        parser.deadline_ms = parser_now_ms() + options->timeout_ms;
+    }
+
+    if (pdf_find_startxref(buffer, buffer_len, &pdf->startxref) == 0 &&
+        pdf->startxref >= 0 && (unsigned long)pdf->startxref < buffer_len) {
+        unsigned long long xref_ns = pdf_stats_begin();
+        pdf_read_xref(&parser, pdf);
+        pdf_stats_end(PDF_PHASE_XREF, xref_ns);
+
+        if (parser.error != PDF_OK) {
+            return_defer(parser.error);
+        }
+    }
+
+    if (xref_validate(buffer, buffer_len, pdf) == 0) {
+        DS_LOG_WARN("The xref table does not match the file, rebuilding it");
+        if (pdf_repair_xref(buffer, buffer_len, pdf) != 0) {
+            DS_LOG_ERROR("Failed to rebuild the xref table");
+            return_defer(PDF_ERR_MEMORY);
+        }
+    }
+
+    if (pdf_build_cache(pdf) != 0) {
+        return_defer(PDF_ERR_MEMORY);
+    }
+
+defer:
+    DS_TRACK_SCOPE_END();
+    pdf_stats_end(PDF_PHASE_DOCUMENT, start_ns);
+    return result;
+}
+
+// The state of one walk over the page tree
+typedef struct pdf_page_walk {
+    unsigned char *visited; /* one bit per object number */
+    unsigned long count;    /* object numbers covered by visited */
+    unsigned long long deadline_ms;
+    unsigned int max_depth;
+} pdf_page_walk;
+
+// Collect the pages below a node of the page tree, in order. A node is only
+// walked once, so a tree that lists a node many times stays linear.
+static int pdf_walk_pages(pdf_t *pdf, pdf_page_walk *walk, pointer_object node, unsigned int depth, ds_dynamic_array *pages) {
+    int result = 0;
+    indirect_object *object = NULL;
+
+    if (depth > walk->max_depth) {
+        DS_LOG_ERROR("The page tree is nested deeper than %u", walk->max_depth);
+        return_defer(1);
+    }
+
+    if (walk->deadline_ms != 0 && parser_now_ms() > walk->deadline_ms) {
+        DS_LOG_ERROR("Time budget exceeded while walking the page tree");
+        return_defer(1);
+    }
+
+    if (node.object_number < 0 || (unsigned long)node.object_number >= walk->count ||
+        pdf_resolve(pdf, node.object_number, node.generation_number, &object) != 0) {
+        DS_LOG_WARN("Page tree node %d %d is missing", node.object_number, node.generation_number);
+        return_defer(0);
+    }
+
+    unsigned char bit = 1 << (node.object_number % 8);
+    if (walk->visited[node.object_number / 8] & bit) {
+        DS_LOG_WARN("Page tree node %d %d is listed more than once", node.object_number, node.generation_number);
+        return_defer(0);
+    }
+    walk->visited[node.object_number / 8] |= bit;
+
+    object_t *items = (object_t *)object->objects.items;
+    if (object->objects.count == 0 || items[0].kind != object_dictionary) {
+        return_defer(0);
+    }
+
+    object_t *type = pdf_dictionary_get(&items[0].dictionary, "Type");
+    if (type != NULL && type->kind == object_name && strcmp(type->name, "Page") == 0) {
+        if (ds_dynamic_array_append(pages, &node) != 0) {
+            return_defer(1);
+        }
+        return_defer(0);
+    }
+
+    object_t *kids = pdf_dictionary_get(&items[0].dictionary, "Kids");
+    if (kids == NULL || kids->kind != object_array) {
+        return_defer(0);
+    }
+
+    object_t *children = (object_t *)kids->array.items;
+    for (unsigned int i = 0; i < kids->array.count; i++) {
+        if (children[i].kind != object_pointer) {
+            continue;
+        }
+
+        if (pdf_walk_pages(pdf, walk, children[i].pointer, depth + 1, pages) != 0) {
+            return_defer(1);
+        }
+    }
+
+defer:
+    return result;
+}
+
+// Get the catalog of the document, the object the /Root of the trailer
+// points at
+//
+// Returns 0 if the catalog was found. Returns 1 otherwise
+PDFDEF int pdf_get_catalog(pdf_t *pdf, ds_dynamic_array **catalog) {
+    indirect_object *object = NULL;
+
+    object_t *root = pdf_dictionary_get(&pdf->trailer, "Root");
+    if (root == NULL || root->kind != object_pointer ||
+        pdf_resolve(pdf, root->pointer.object_number, root->pointer.generation_number, &object) != 0) {
+        return 1;
+    }
+
+    object_t *items = (object_t *)object->objects.items;
+    if (object->objects.count == 0 || items[0].kind != object_dictionary) {
+        return 1;
+    }
+
+    *catalog = &items[0].dictionary;
+    return 0;
+}
+
+// Get the pages of the document in order by walking the page tree from the
+// /Root of the trailer. A pdf opened from a sidecar index takes them from its
+// page map instead.
+//
+// Returns 0 on success with pages holding pointer_object items, a document
+// without a catalog has no pages. Returns 1 in case of an error
+PDFDEF int pdf_get_pages(pdf_t *pdf, ds_dynamic_array *pages) {
+    int result = 0;
+    ds_dynamic_array *catalog = NULL;
+    pdf_page_walk walk = {0};
+
+    ds_dynamic_array_init(pages, sizeof(pointer_object));
+
+    if (pdf->pages.count != 0) {
+        if (ds_dynamic_array_append_many(pages, (void **)pdf->pages.items, pdf->pages.count) != 0) {
+            return_defer(1);
+        }
+        return_defer(0);
+    }
+
+    if (pdf_get_catalog(pdf, &catalog) != 0) {
+        DS_LOG_WARN("The document has no catalog");
+        return_defer(0);
+    }
+
+    object_t *tree = pdf_dictionary_get(catalog, "Pages");
+    if (tree == NULL || tree->kind != object_pointer) {
+        return_defer(0);
+    }
+
+    // every object that pdf_resolve can find has a bit
+    walk.count = pdf->cache.count;
+    indirect_object *objects = (indirect_object *)pdf->objects.items;
+    for (unsigned long i = 0; i < pdf->objects.count; i++) {
+        if (objects[i].object_number >= 0) {
+            walk.count = DS_MAX(walk.count, (unsigned long)objects[i].object_number + 1);
+        }
+    }
+    walk.max_depth = pdf->options.max_depth != 0 ? pdf->options.max_depth : PDF_DEFAULT_MAX_DEPTH;
+    if (pdf->options.timeout_ms != 0) {
+        walk.deadline_ms = parser_now_ms() + pdf->options.timeout_ms;
+    }
+
+    walk.visited = DS_MALLOC(NULL, walk.count / 8 + 1);
+    if (walk.visited == NULL) {
+        DS_LOG_ERROR("Failed to allocate the page tree walk");
+        return_defer(1);
+    }
+    memset(walk.visited, 0, walk.count / 8 + 1);
+
+    if (pdf_walk_pages(pdf, &walk, tree->pointer, 0, pages) != 0) {
+        return_defer(1);
+    }
+
+defer:
+    if (walk.visited != NULL) {
+        DS_FREE(NULL, walk.visited);
+    }
+    return result;
+}
+
+static uint64_t pdf_index_hash(const unsigned char *data, unsigned long len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned long i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Write the sidecar index of a pdf that was parsed or opened from pdf_path.
+// The file is written next to the final path and renamed over it, so a
+// reader never maps a half written index.
+//
+// Returns 0 on success. Returns 1 in case of an error
+PDFDEF int pdf_index_write(pdf_t *pdf, const char *pdf_path, const char *index_path) {
+    int result = 0;
+    struct stat st;
+    ds_dynamic_array pages = {0}; /* pointer_object */
+    char *data = NULL;
+    char *tmp_path = NULL;
+    ds_string_builder sb = {0};
+
+    if (stat(pdf_path, &st) != 0 || (unsigned long)st.st_size != pdf->buffer_len) {
+        DS_LOG_ERROR("The file %s does not match the parsed buffer", pdf_path);
+        return_defer(1);
+    }
+
+    if (pdf_get_pages(pdf, &pages) != 0) {
+        return_defer(1);
+    }
+
+    // one row per object number, rows missing from the xref stay zero
+    xref_entry *entries = (xref_entry *)pdf->xref.entries.items;
+    unsigned int object_count = 0;
+    for (unsigned int i = 0; i < pdf->xref.entries.count; i++) {
+        int object_number = entries[i].object_number;
+        if (object_number >= 0 && object_number <= XREF_MAX_OBJECT_NUMBER) {
+            object_count = DS_MAX(object_count, (unsigned int)object_number + 1);
+        }
+    }
+
+    uint64_t objects_offset = sizeof(pdf_index_header);
+    uint64_t pages_offset = objects_offset + (uint64_t)object_count * sizeof(pdf_index_object);
+    uint64_t size = pages_offset + (uint64_t)pages.count * sizeof(pdf_index_page);
+
+    data = DS_MALLOC(NULL, size);
+    if (data == NULL) {
+        DS_LOG_ERROR("Failed to allocate the index");
+        return_defer(1);
+    }
+    memset(data, 0, size);
+
+    unsigned long tail = DS_MIN(pdf->buffer_len, (unsigned long)PDF_INDEX_TAIL_SIZE);
+    pdf_index_header *header = (pdf_index_header *)data;
+    memcpy(header->magic, PDF_INDEX_MAGIC, sizeof(header->magic));
+    header->version = PDF_INDEX_VERSION;
+    header->byte_order = PDF_INDEX_BYTE_ORDER;
+    header->file_size = st.st_size;
+    header->mtime_sec = st.st_mtim.tv_sec;
+    header->mtime_nsec = st.st_mtim.tv_nsec;
+    header->tail_hash = pdf_index_hash((unsigned char *)pdf->buffer + pdf->buffer_len - tail, tail);
+    header->startxref = pdf->startxref;
+    header->trailer_offset = pdf_find_last(pdf->buffer, pdf->buffer_len, "trailer");
+    header->object_count = object_count;
+    header->page_count = pages.count;
+    header->objects_offset = objects_offset;
+    header->pages_offset = pages_offset;
+
+    pdf_index_object *objects = (pdf_index_object *)(data + objects_offset);
+    for (unsigned int i = 0; i < pdf->xref.entries.count; i++) {
+        int object_number = entries[i].object_number;
+        if (object_number >= 0 && (unsigned int)object_number < object_count) {
+            objects[object_number].offset = entries[i].offset;
+            objects[object_number].generation = entries[i].generation_number;
+            objects[object_number].in_use = (unsigned char)entries[i].in_use;
+        }
+    }
+
+    pdf_index_page *rows = (pdf_index_page *)(data + pages_offset);
+    pointer_object *page_items = (pointer_object *)pages.items;
+    for (unsigned int i = 0; i < pages.count; i++) {
+        rows[i].object_number = page_items[i].object_number;
+        rows[i].generation = page_items[i].generation_number;
+    }
+
+    ds_string_builder_init(&sb);
+    ds_string_builder_append(&sb, "%s.tmp", index_path);
+    if (ds_string_builder_build(&sb, &tmp_path) != 0) {
+        return_defer(1);
+    }
+
+    if (ds_io_write(tmp_path, data, size, "wb") != (long)size || rename(tmp_path, index_path) != 0) {
+        DS_LOG_ERROR("Failed to write the index %s", index_path);
+        unlink(tmp_path);
+        return_defer(1);
+    }
+
+defer:
+    ds_dynamic_array_free(&pages);
+    ds_string_builder_free(&sb);
+    if (tmp_path != NULL) {
+        DS_FREE(NULL, tmp_path);
+    }
+    if (data != NULL) {
+        DS_FREE(NULL, data);
+    }
+    return result;
+}
+
+// Map the sidecar index of pdf_path and check that it still matches the file
+//
+// Returns 0 if the index can be used. Returns 1 if it is missing, damaged or
+// stale
+PDFDEF int pdf_index_open(const char *pdf_path, const char *index_path, pdf_index *index) {
+    int result = 0;
+    int fd = -1;
+    int pdf_fd = -1;
+    unsigned char *tail = NULL;
+    struct stat st, pdf_st;
+
+    *index = (pdf_index){0};
+
+    if (stat(pdf_path, &pdf_st) != 0) {
+        return_defer(1);
+    }
+
+    fd = open(index_path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || (unsigned long)st.st_size < sizeof(pdf_index_header)) {
+        return_defer(1);
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return_defer(1);
+    }
+    index->map = map;
+    index->map_len = st.st_size;
+
+    const pdf_index_header *header = map;
+    uint64_t len = index->map_len;
+    if (DS_MEMCMP(header->magic, PDF_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != PDF_INDEX_VERSION || header->byte_order != PDF_INDEX_BYTE_ORDER ||
+        header->objects_offset > len || header->object_count > (len - header->objects_offset) / sizeof(pdf_index_object) ||
+        header->pages_offset > len || header->page_count > (len - header->pages_offset) / sizeof(pdf_index_page)) {
+        DS_LOG_WARN("The index %s is damaged", index_path);
+        return_defer(1);
+    }
+
+    if (header->file_size != (uint64_t)pdf_st.st_size ||
+        header->mtime_sec != pdf_st.st_mtim.tv_sec || header->mtime_nsec != pdf_st.st_mtim.tv_nsec) {
+        return_defer(1);
+    }
+
+    unsigned long tail_len = DS_MIN((unsigned long)pdf_st.st_size, (unsigned long)PDF_INDEX_TAIL_SIZE);
+    tail = DS_MALLOC(NULL, tail_len + 1);
+    pdf_fd = open(pdf_path, O_RDONLY);
+    if (tail == NULL || pdf_fd < 0 ||
+        pread(pdf_fd, tail, tail_len, pdf_st.st_size - tail_len) != (ssize_t)tail_len ||
+        pdf_index_hash(tail, tail_len) != header->tail_hash) {
+        return_defer(1);
+    }
+
+    index->header = header;
+    index->objects = (const pdf_index_object *)((const char *)map + header->objects_offset);
+    index->pages = (const pdf_index_page *)((const char *)map + header->pages_offset);
+
+defer:
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (pdf_fd >= 0) {
+        close(pdf_fd);
+    }
+    if (tail != NULL) {
+        DS_FREE(NULL, tail);
+    }
+    if (result != 0) {
+        pdf_index_close(index);
+    }
+    return result;
+}
+
+// Unmap a sidecar index
+PDFDEF void pdf_index_close(pdf_index *index) {
+    if (index->map != NULL) {
+        munmap(index->map, index->map_len);
+    }
+
+    *index = (pdf_index){0};
+}
+
+// Open a pdf from its sidecar index without parsing the xref table
+//
+// The xref entries and the page map come straight from the index, only the
+// trailer dictionary is parsed. Objects are resolved on demand like with
+// pdf_open. The index can be closed once this returns.
+//
+// Returns PDF_OK if the file was opened, otherwise a pdf_error code.
+PDFDEF int pdf_open_indexed(char *buffer, unsigned long buffer_len, pdf_parse_options *options, pdf_index *index, pdf_t *pdf) {
+    int result = PDF_OK;
+    unsigned long long start_ns = pdf_stats_begin();
+    DS_TRACK_SCOPE_BEGIN("parser");
+    const pdf_index_header *header = index->header;
+
+    if (pdf_open_begin(buffer, buffer_len, options, pdf) != 0) {
+        return_defer(PDF_ERR_MEMORY);
+    }
+
+    if (header == NULL || header->file_size != (uint64_t)buffer_len) {
+        DS_LOG_ERROR("The index does not belong to this buffer");
+        return_defer(PDF_ERR_SYNTAX);
+    }
+
+    pdf->startxref = header->startxref;
+
+    ds_dynamic_array_init_allocator(&pdf->xref.entries, sizeof(xref_entry), options->allocator);
+    if (ds_dynamic_array_reserve(&pdf->xref.entries, header->object_count) != 0) {
+        return_defer(PDF_ERR_MEMORY);
+    }
+
+    xref_entry *entries = (xref_entry *)pdf->xref.entries.items;
+    for (unsigned int i = 0; i < header->object_count; i++) {
+        const pdf_index_object *row = index->objects + i;
+        if (row->in_use == 0) {
+            continue;
+        }
+
+        entries[pdf->xref.entries.count++] = (xref_entry){
+            .object_number = i,
+            .generation_number = row->generation,
+            .offset = row->offset,
+            .in_use = (char)row->in_use,
+        };
+    }
+
+    if (ds_dynamic_array_reserve(&pdf->pages, header->page_count) != 0) {
+        return_defer(PDF_ERR_MEMORY);
+    }
+
+    pointer_object *pages = (pointer_object *)pdf->pages.items;
+    for (unsigned int i = 0; i < header->page_count; i++) {
+        pages[i] = (pointer_object){ .object_number = index->pages[i].object_number, .generation_number = index->pages[i].generation };
+    }
+    pdf->pages.count = header->page_count;
+
+    if (header->trailer_offset >= 0 && (uint64_t)header->trailer_offset < buffer_len) {
+        pdf_parser parser = {0};
+        parser.options = *options;
+        parser.error = PDF_OK;
+
+        ds_string_slice slice;
+        ds_string_slice_init_allocator(&slice, buffer + header->trailer_offset, buffer_len - header->trailer_offset, options->allocator);
+        parse_trailer(&parser, &slice, &pdf->trailer);
+    }
+
+    if (pdf_build_cache(pdf) != 0) {
+        return_defer(PDF_ERR_MEMORY);
+    }
+
+defer:
+    DS_TRACK_SCOPE_END();
+    pdf_stats_end(PDF_PHASE_DOCUMENT, start_ns);
+    return result;
+}
+
+// Find the first indirect object header `N G obj` that starts a line
+//
+// Returns the offset of the header, or -1 if there is none
+static long pdf_find_object(const char *buffer, unsigned long len) {
+    int object_number, generation_number;
+
+    for (unsigned long i = 0; i < len; i++) {
+        if ((i == 0 || buffer[i - 1] == '\n' || buffer[i - 1] == '\r') && isdigit(buffer[i]) &&
+            xref_object_header(buffer, len, i, &object_number, &generation_number)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Find the first occurrence of a keyword at or after offset
+//
+// Returns the offset, or -1 if the keyword is not in the buffer
+static long pdf_find_first(const char *buffer, unsigned long len, unsigned long offset, const char *keyword) {
+    unsigned long keyword_len = strlen(keyword);
+
+    for (unsigned long i = offset; i + keyword_len <= len; i++) {
+        if (buffer[i] == keyword[0] && DS_MEMCMP(buffer + i, keyword, keyword_len) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Read the next chunk of the input into the free end of the window
+//
+// Returns 0 on success and sets *eof at the end of the input. Returns 1 if
+// the read failed
+static int pdf_stream_read(int fd, char *window, unsigned long *len, unsigned long capacity, int *eof) {
+    int result = 0;
+    unsigned long long start_ns = pdf_stats_begin();
+
+    while (*len < capacity && !*eof) {
+        ssize_t count = read(fd, window + *len, capacity - *len);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            DS_LOG_ERROR("Failed to read the input: %s", strerror(errno));
+            return_defer(1);
+        }
+
+        *eof = count == 0;
+        *len += count;
+        pdf_stats_add(PDF_COUNTER_BYTES_READ, count);
+        break;
+    }
+
+defer:
+    pdf_stats_end(PDF_PHASE_IO, start_ns);
+    return result;
+}
+
+// Parse one complete indirect object and hand it to the callback
+static int pdf_stream_object(pdf_t *pdf, char *data, unsigned long len, pdf_object_callback *callback, void *context) {
+    int result = PDF_OK;
+    pdf_parser parser = {0};
+    indirect_object object = {0};
+    ds_string_slice slice;
+
+    parser.options = pdf->options;
+    parser.error = PDF_OK;
+    if (parser.options.timeout_ms != 0) {
+        parser.deadline_ms = parser_now_ms() + parser.options.timeout_ms;
+    }
+
+    ds_string_slice_init_allocator(&slice, data, len, pdf->options.allocator);
+    if (parse_indirect_object(&parser, &slice, &object) != 0) {
+        DS_LOG_WARN("Skipping an object that failed to parse: %s", pdf_error_string(parser.error));
+        return_defer(PDF_OK);
+    }
+
+    result = callback(context, pdf, &object);
+
+defer:
+    object_array_free(pdf->options.allocator, &object.objects);
+    return result;
+}
+
+// Move an object that does not fit in the window to the spill file, reading
+// until its `endobj`. The window keeps whatever follows the object.
+//
+// Returns 0 with the object length in *spill_len. Returns 1 if the input
+// ended first or the spill file could not be written
+static int pdf_stream_spill(int fd, FILE *spill, char *window, unsigned long *len, unsigned long capacity,
+                            int *eof, unsigned long *spill_len) {
+    const unsigned long keep = sizeof("endobj") - 2;
+
+    if (fseek(spill, 0, SEEK_SET) != 0 || ftruncate(fileno(spill), 0) != 0) {
+        return 1;
+    }
+    *spill_len = 0;
+
+    while (1) {
+        long end = pdf_find_first(window, *len, 0, "endobj");
+        if (end >= 0) {
+            unsigned long object_len = end + sizeof("endobj") - 1;
+            if (fwrite(window, 1, object_len, spill) != object_len) {
+                return 1;
+            }
+
+            *spill_len += object_len;
+            *len -= object_len;
+            memmove(window, window + object_len, *len);
+            return fflush(spill) != 0;
+        }
+
+        if (*eof) {
+            DS_LOG_ERROR("The input ended inside an object");
+            return 1;
+        }
+
+        // the last bytes may be the start of a split `endobj`
+        unsigned long flush = *len > keep ? *len - keep : 0;
+        if (fwrite(window, 1, flush, spill) != flush) {
+            return 1;
+        }
+
+        *spill_len += flush;
+        *len -= flush;
+        memmove(window, window + flush, *len);
+        if (pdf_stream_read(fd, window, len, capacity, eof) != 0) {
+            return 1;
+        }
+    }
+}
+
+// Parse a pdf from a file descriptor that can not seek, such as a pipe
+//
+// The input is read through a window of options->window_bytes and every
+// indirect object is handed to the callback as soon as its `endobj` arrives,
+// in file order. The xref table is never needed, so the object and the data
+// it points into are only valid until the callback returns and there is
+// nothing to resolve references against. An object larger than the window
+// is spilled to a temporary file and mapped back once it is complete, so
+// memory stays bounded by the window and the largest decoded stream.
+//
+// Returns PDF_OK once the input is consumed, the first non zero value
+// returned by the callback, or a pdf_error code.
+PDFDEF int pdf_parse_fd(int fd, pdf_parse_options *options, pdf_object_callback *callback, void *context) {
+    int result = PDF_OK;
+    unsigned long long start_ns = pdf_stats_begin();
+    DS_TRACK_SCOPE_BEGIN("parser");
+    pdf_t pdf = {0};
+    pdf_parse_options stream_options = *options;
+    unsigned long capacity = DS_MAX(options->window_bytes, (unsigned long)PDF_STREAM_MIN_WINDOW);
+    unsigned long len = 0;
+    int eof = 0;
+    char *window = NULL;
+    FILE *spill = NULL;
+
+    // the objects do not outlive the window, so there is nothing to cache
+    stream_options.cache_bytes = 0;
+    if (pdf_open_begin(NULL, 0, &stream_options, &pdf) != 0) {
+        return_defer(PDF_ERR_MEMORY);
+    }
+
+    window = DS_MALLOC(NULL, capacity);
+    if (window == NULL) {
+        return_defer(PDF_ERR_MEMORY);
+    }
+
+    while (1) {
+        long start = pdf_find_object(window, len);
+        if (start < 0) {
+            if (eof) {
+                break;
+            }
+
+            // keep enough to finish a header that was split by the read
+            unsigned long keep = DS_MIN(len, (unsigned long)PDF_STREAM_HEADER_SIZE);
+            memmove(window, window + len - keep, keep);
+            len = keep;
+            if (pdf_stream_read(fd, window, &len, capacity, &eof) != 0) {
+                return_defer(PDF_ERR_IO);
+            }
+            continue;
+        }
+
+        len -= start;
+        memmove(window, window + start, len);
+
+        unsigned long scanned = 0;
+        long end = -1;
+        while ((end = pdf_find_first(window, len, scanned, "endobj")) < 0 && !eof && len < capacity) {
+            scanned = len > sizeof("endobj") ? len - sizeof("endobj") : 0;
+            if (pdf_stream_read(fd, window, &len, capacity, &eof) != 0) {
+                return_defer(PDF_ERR_IO);
+            }
+        }
+
+        if (end >= 0) {
+            unsigned long object_len = end + sizeof("endobj") - 1;
+            result = pdf_stream_object(&pdf, window, object_len, callback, context);
+            if (result != PDF_OK) {
+                return_defer(result);
+            }
+
+            len -= object_len;
+            memmove(window, window + object_len, len);
+            continue;
+        }
+
+        if (eof) {
+            DS_LOG_ERROR("The input ended inside an object");
+            return_defer(PDF_ERR_SYNTAX);
+        }
+
+        if (spill == NULL && (spill = tmpfile()) == NULL) {
+            DS_LOG_ERROR("Failed to create a spill file: %s", strerror(errno));
+            return_defer(PDF_ERR_IO);
+        }
+
+        unsigned long spill_len = 0;
+        if (pdf_stream_spill(fd, spill, window, &len, capacity, &eof, &spill_len) != 0) {
+            return_defer(PDF_ERR_IO);
+        }
+
+        char *data = mmap(NULL, spill_len, PROT_READ, MAP_PRIVATE, fileno(spill), 0);
+        if (data == MAP_FAILED) {
+            DS_LOG_ERROR("Failed to map the spill file: %s", strerror(errno));
+            return_defer(PDF_ERR_IO);
+        }
+
+        result = pdf_stream_object(&pdf, data, spill_len, callback, context);
+        munmap(data, spill_len);
+        if (result != PDF_OK) {
+            return_defer(result);
+        }
+    }
+
+defer:
+    if (spill != NULL) {
+        fclose(spill);
+    }
+    if (window != NULL) {
+        DS_FREE(NULL, window);
+    }
+    pdf_free(&pdf);
+    DS_TRACK_SCOPE_END();
+    pdf_stats_end(PDF_PHASE_DOCUMENT, start_ns);
+    return result;
+}
+
+// Parse a pdf file from a buffer with the default options
+//
+// Returns PDF_OK if the file was parsed, otherwise a pdf_error code.
+PDFDEF int parse_pdf(char *buffer, unsigned long buffer_len, pdf_t *pdf) {
+    pdf_parse_options options;
+    pdf_parse_options_init(&options);
+
+    return parse_pdf_with_options(buffer, buffer_len, &options, pdf);
+}
+
+// Parse a pdf file from a buffer
+//
+// Objects with syntax errors are skipped, but when one of the limits from the
+// options trips the parser stops right away.
+//
+// Returns PDF_OK if the file was parsed, otherwise a pdf_error code.
+PDFDEF int parse_pdf_with_options(char *buffer, unsigned long buffer_len, pdf_parse_options *options, pdf_t *pdf) {
+    int result = PDF_OK;
+    unsigned long long start_ns = pdf_stats_begin();
+    DS_TRACK_SCOPE_BEGIN("parser");
+    indirect_object object = {0};
+    ds_string_slice slice;
+    ds_string_slice_init_allocator(&slice, buffer, buffer_len, options->allocator);
+    if (pdf_open_begin(buffer, buffer_len, options, pdf) != 0) {
+        return_defer(PDF_ERR_MEMORY);
+    }
+
+    pdf_parser parser = {0};
+    parser.options = *options;
+    parser.error = PDF_OK;
+    if (options->timeout_ms != 0) {
+        parser.deadline_ms = parser_now_ms() + options->timeout_ms;
+    }
+
+    while (1) {
+        skip_comments(&slice);
+        ds_string_slice_trim_left_ws(&slice);
+        if (ds_string_slice_empty(&slice)) {
+            break;
+        }
+
+        if (ds_string_slice_starts_with(&slice, &DS_STRING_SLICE("xref"))) {
+            // the sections of incremental updates come in file order, their
+            // rows override the rows of the older sections
+            xref_t xref = {0};
+            unsigned long long xref_ns = pdf_stats_begin();
+            parse_xref(&parser, &slice, &xref);
+            pdf_stats_end(PDF_PHASE_XREF, xref_ns);
+            if (pdf->xref.entries.item_size == 0) {
+                pdf->xref = xref;
+            } else {
+                if (ds_dynamic_array_append_many(&pdf->xref.entries, (void **)xref.entries.items, xref.entries.count) != 0) {
+                    parser.error = PDF_ERR_MEMORY;
+                }
+                ds_dynamic_array_free(&xref.entries);
+            }
+        } else if (ds_string_slice_starts_with(&slice, &DS_STRING_SLICE("trailer"))) {
+            // only the newest trailer is kept
+            object_dictionary_free(options->allocator, &pdf->trailer);
+            parse_trailer(&parser, &slice, &pdf->trailer);
+        } else if (ds_string_slice_starts_with(&slice, &DS_STRING_SLICE("startxref"))) {
+            parse_startxref(&slice, &pdf->startxref);
+        } else if (ds_string_slice_starts_with(&slice, &DS_STRING_SLICE("%%EOF"))) {
+            // an incremental update can follow
+            ds_string_slice_step(&slice, 5);
+        } else {
+            if (parse_indirect_object(&parser, &slice, &object) == 0) {
+                parser_append(&parser, &pdf->objects, &object);
+            }
+        }
+
+        if (parser.error != PDF_OK) {
+            return_defer(parser.error);
+        }
+    }
+
+    if (pdf_build_object_table(&parser, pdf) != 0) {
+        return_defer(parser.error);
+    }
+
+    if (xref_validate(buffer, buffer_len, pdf) == 0) {
+        DS_LOG_WARN("The xref table does not match the file, rebuilding it");
+        if (pdf_repair_xref(buffer, buffer_len, pdf) != 0) {
+            DS_LOG_ERROR("Failed to rebuild the xref table");
+            return_defer(PDF_ERR_MEMORY);
+        }
+    }
+
+    if (pdf_build_cache(pdf) != 0) {
+        return_defer(PDF_ERR_MEMORY);
+    }
+
+defer:
+    DS_TRACK_SCOPE_END();
+    pdf_stats_end(PDF_PHASE_DOCUMENT, start_ns);
+    return result;
+}
+
+// Inflate state and output buffer of a thread. They are reused by every
+// stream the thread decodes, so a stream costs an inflateReset instead of an
+// inflateInit and a chain of buffer reallocations.
+typedef struct pdf_inflater {
+    z_stream zs;
+    int ready;
+    char *buffer;
+    unsigned long capacity;
+} pdf_inflater;
+
+static _Thread_local pdf_inflater pdf_thread_inflater;
+
+// Get the inflate state of the thread ready for a new stream
+//
+// Returns 0 on success. Returns 1 if zlib could not be set up
+static int pdf_inflater_reset(pdf_inflater *inflater) {
+    if (inflater->ready == 0) {
+        inflater->zs = (z_stream){0};
+        if (inflateInit(&inflater->zs) != Z_OK) {
+            DS_LOG_ERROR("Failed to initialize inflate");
+            return 1;
+        }
+        inflater->ready = 1;
+    } else if (inflateReset(&inflater->zs) != Z_OK) {
+        DS_LOG_ERROR("Failed to reset inflate");
+        return 1;
+    }
+
+    return 0;
+}
+
+// Whole buffer backend on top of zlib: a single inflate call into the final
+// buffer, without growing or copying the output
+static int pdf_inflate_whole_zlib(const char *in, unsigned long in_len, char *out, unsigned long out_len, unsigned long *written) {
+    pdf_inflater *inflater = &pdf_thread_inflater;
+    z_stream *zs = &inflater->zs;
+
+    if (in_len > UINT_MAX || out_len > UINT_MAX || pdf_inflater_reset(inflater) != 0) {
+        return 1;
+    }
+
+    zs->next_in = (Bytef *)in;
+    zs->avail_in = in_len;
+    zs->next_out = (Bytef *)out;
+    zs->avail_out = out_len;
+    if (inflate(zs, Z_FINISH) != Z_STREAM_END) {
+        return 1;
+    }
+
+    *written = out_len - zs->avail_out;
+    return 0;
+}
+
+#ifdef PDF_USE_LIBDEFLATE
+static _Thread_local struct libdeflate_decompressor *pdf_thread_libdeflate = NULL;
+
+static int pdf_inflate_whole_libdeflate(const char *in, unsigned long in_len, char *out, unsigned long out_len, unsigned long *written) {
+    size_t in_used = 0;
+    size_t out_used = 0;
+
+    if (pdf_thread_libdeflate == NULL) {
+        pdf_thread_libdeflate = libdeflate_alloc_decompressor();
+        if (pdf_thread_libdeflate == NULL) {
+            return 1;
+        }
+    }
+
+    // the _ex variant accepts the end of line that often follows the data
+    if (libdeflate_zlib_decompress_ex(pdf_thread_libdeflate, in, in_len, out, out_len, &in_used, &out_used) != LIBDEFLATE_SUCCESS) {
+        return 1;
+    }
+
+    *written = out_used;
+    return 0;
+}
+#endif // PDF_USE_LIBDEFLATE
+
+#ifndef PDF_INFLATE_WHOLE
+#ifdef PDF_USE_LIBDEFLATE
+#define PDF_INFLATE_WHOLE pdf_inflate_whole_libdeflate
+#else
+#define PDF_INFLATE_WHOLE pdf_inflate_whole_zlib
+#endif // PDF_USE_LIBDEFLATE
+#endif // PDF_INFLATE_WHOLE
+
+// Give the inflate state and buffer of the calling thread back, call this
+// before the thread exits
+PDFDEF void pdf_inflater_release(void) {
+    pdf_inflater *inflater = &pdf_thread_inflater;
+
+#ifdef PDF_USE_LIBDEFLATE
+    if (pdf_thread_libdeflate != NULL) {
+        libdeflate_free_decompressor(pdf_thread_libdeflate);
+        pdf_thread_libdeflate = NULL;
+    }
+#endif // PDF_USE_LIBDEFLATE
+    if (inflater->ready) {
+        inflateEnd(&inflater->zs);
+    }
+    if (inflater->buffer != NULL) {
+        DS_FREE(NULL, inflater->buffer);
+    }
+    *inflater = (pdf_inflater){0};
+}
+
+// Inflate a stream of known decoded length with the whole buffer backend
+//
+// Returns 0 if the output is complete. Returns 1 if the stream must go
+// through the streaming decoder
+static int pdf_flate_decode_whole(pdf_parse_options *options, ds_string_slice *stream, unsigned long decoded_len,
+                                  char **buffer, unsigned long *buffer_len) {
+    unsigned long written = 0;
+    char *whole = DS_MALLOC(options->allocator, decoded_len + 1);
+    if (whole == NULL) {
+        return 1;
+    }
+
+    if (PDF_INFLATE_WHOLE(stream->str, stream->len, whole, decoded_len, &written) != 0) {
+        DS_FREE(options->allocator, whole);
+        return 1;
+    }
+
+    // a /DL that was too large
+    if (written < decoded_len) {
+        char *exact = DS_REALLOC(options->allocator, whole, decoded_len + 1, written + 1);
+        if (exact == NULL) {
+            return 1;
+        }
+        whole = exact;
+    }
+
+    whole[written] = '\0';
+    *buffer = whole;
+    *buffer_len = written;
+    return 0;
+}
+
+// The decoder behind pdf_flate_decode
+static int pdf_flate_inflate(pdf_parse_options *options, ds_string_slice *stream, unsigned long decoded_len,
+                             char **buffer, unsigned long *buffer_len) {
+    int result = PDF_OK;
+    pdf_inflater *inflater = &pdf_thread_inflater;
+    z_stream *zs = &inflater->zs;
+    unsigned long limit = options->max_decompressed_bytes;
+    unsigned long consumed = 0;
+    unsigned long len = 0;
+
+    *buffer = NULL;
+    *buffer_len = 0;
+
+    if (decoded_len != 0 && stream->len >= PDF_INFLATE_WHOLE_MIN &&
+        decoded_len / PDF_INFLATE_MAX_RATIO <= stream->len && (limit == 0 || decoded_len <= limit) &&
+        pdf_flate_decode_whole(options, stream, decoded_len, buffer, buffer_len) == 0) {
+        return PDF_OK;
+    }
+
+    if (pdf_inflater_reset(inflater) != 0) {
+        return PDF_ERR_MEMORY;
+    }
+
+    zs->avail_in = 0;
+    while (1) {
+        if (len == inflater->capacity) {
+            unsigned long new_capacity = DS_MAX(inflater->capacity * 2, DS_MAX(stream->len * 4, 1024ul));
+            // one byte over the limit tells us that the stream does not fit
+            if (limit != 0 && new_capacity > limit + 1) {
+                new_capacity = limit + 1;
+            }
+
+            // the old buffer is released when DS_REALLOC fails
+            char *new_buffer = DS_REALLOC(NULL, inflater->buffer, inflater->capacity + 1, new_capacity + 1);
+            if (new_buffer == NULL) {
+                DS_LOG_ERROR("Failed to grow the inflate buffer");
+                inflater->buffer = NULL;
+                inflater->capacity = 0;
+                len = 0;
+                return_defer(PDF_ERR_MEMORY);
+            }
+
+            inflater->buffer = new_buffer;
+            inflater->capacity = new_capacity;
+        }
+
+        // zlib counts in 32 bits, larger streams are fed in chunks
+        if (zs->avail_in == 0 && consumed < stream->len) {
+            unsigned long chunk = DS_MIN(stream->len - consumed, (unsigned long)UINT_MAX);
+            zs->next_in = (Bytef *)stream->str + consumed;
+            zs->avail_in = chunk;
+            consumed += chunk;
+        }
+
+        unsigned long room = inflater->capacity - len;
+        if (limit != 0) {
+            room = DS_MIN(room, limit + 1 - len);
+        }
+        room = DS_MIN(room, (unsigned long)UINT_MAX);
+        zs->next_out = (Bytef *)inflater->buffer + len;
+        zs->avail_out = room;
+
+        int ret = inflate(zs, Z_NO_FLUSH);
+        len += room - zs->avail_out;
+
+        if (limit != 0 && len > limit) {
+            DS_LOG_ERROR("Stream inflates past the limit of %lu bytes", limit);
+            len = limit;
+            return_defer(PDF_ERR_DECOMPRESSED);
+        }
+
+        if (ret == Z_STREAM_END) {
+            break;
+        }
+
+        if ((ret != Z_OK && ret != Z_BUF_ERROR) ||
+            (zs->avail_in == 0 && consumed == stream->len && zs->avail_out != 0)) {
+            DS_LOG_ERROR("Failed to uncompress data at : %d", ret);
+            return_defer(PDF_ERR_SYNTAX);
+        }
+    }
+
+defer:
+    if (inflater->buffer == NULL) {
+        return result;
+    }
+
+    if (options->allocator == NULL && len > PDF_INFLATE_KEEP_SIZE) {
+        // large outputs are not worth a copy, the thread grows a new buffer
+        *buffer = DS_REALLOC(NULL, inflater->buffer, inflater->capacity + 1, len + 1);
+        inflater->buffer = NULL;
+        inflater->capacity = 0;
+    } else {
+        *buffer = DS_MALLOC(options->allocator, len + 1);
+        if (*buffer != NULL) {
+            DS_MEMCPY(*buffer, inflater->buffer, len);
+        }
+
+        if (inflater->capacity > PDF_INFLATE_KEEP_SIZE) {
+            DS_FREE(NULL, inflater->buffer);
+            inflater->buffer = NULL;
+            inflater->capacity = 0;
+        }
+    }
+
+    if (*buffer == NULL) {
+        DS_LOG_ERROR("Failed to allocate the inflate output");
+        return PDF_ERR_MEMORY;
+    }
+
+    (*buffer)[len] = '\0';
+    *buffer_len = len;
+    return result;
+}
+
+// Inflate a FlateDecode stream
+//
+// When the decoded length is known (0 means unknown) and the stream is at
+// least PDF_INFLATE_WHOLE_MIN bytes, it is inflated by the whole buffer
+// backend straight into its final buffer. Streams that backend does not
+// handle completely, and all the others, go through the streaming decoder.
+//
+// The stream is inflated into the buffer of the calling thread, which grows
+// as needed but never past options->max_decompressed_bytes when it is set, so
+// a zip bomb cannot exhaust the memory. The output is then copied into an
+// exact fit allocated with options->allocator; outputs larger than
+// PDF_INFLATE_KEEP_SIZE take the thread buffer itself instead. The output is
+// NUL terminated, and on error it holds what was inflated up to that point.
+//
+// Returns PDF_OK on success, PDF_ERR_DECOMPRESSED if the limit was hit,
+// PDF_ERR_SYNTAX for corrupt data and PDF_ERR_MEMORY if allocation failed.
+PDFDEF int pdf_flate_decode(pdf_parse_options *options, ds_string_slice *stream, unsigned long decoded_len,
+                            char **buffer, unsigned long *buffer_len) {
+    unsigned long long start_ns = pdf_stats_begin();
+    DS_TRACK_SCOPE_BEGIN("decoder");
+    int result = pdf_flate_inflate(options, stream, decoded_len, buffer, buffer_len);
+
+    DS_TRACK_SCOPE_END();
+    pdf_stats_add(PDF_COUNTER_BYTES_INFLATED, *buffer_len);
+    pdf_stats_end(PDF_PHASE_INFLATE, start_ns);
+    return result;
+}
+
+// Map a regular file read only, the pages are loaded by the kernel on demand
+// so files larger than the memory can be parsed. The page faults count
+// towards the phases that touch the pages, not towards io.
+//
+// Returns 0 on success. An empty file gives a NULL buffer. Returns 1 if the
+// file could not be mapped
+PDFDEF int pdf_map_file(const char *path, char **buffer, unsigned long *buffer_len) {
+    int result = 0;
+    struct stat st;
+    unsigned long long start_ns = pdf_stats_begin();
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        return_defer(1);
+    }
+
+    *buffer = NULL;
+    *buffer_len = st.st_size;
+    if (*buffer_len == 0) {
+        return_defer(0);
+    }
+
+    void *map = mmap(NULL, *buffer_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return_defer(1);
+    }
+    madvise(map, *buffer_len, MADV_SEQUENTIAL);
+    *buffer = map;
+    pdf_stats_add(PDF_COUNTER_BYTES_READ, *buffer_len);
+
+defer:
+    if (fd >= 0) {
+        close(fd);
+    }
+    pdf_stats_end(PDF_PHASE_IO, start_ns);
+    return result;
+}
+
+// Unmap a file mapped by pdf_map_file
+PDFDEF void pdf_unmap_file(char *buffer, unsigned long buffer_len) {
+    if (buffer != NULL) {
+        munmap(buffer, buffer_len);
+    }
+}
+
+// Get the filter of a stream dictionary, the first one of a filter chain
+PDFDEF filter_kind pdf_get_filter_kind(ds_dynamic_array *dictionary /* object_kv */) {
+    object_t *filter = pdf_dictionary_get(dictionary, "Filter");
+
+    if (filter != NULL && filter->kind == object_array) {
+        filter = filter->array.count != 0 ? (object_t *)filter->array.items : NULL;
+    }
+
+    if (filter == NULL) {
+        return filter_none;
+    }
+
+    if (filter->kind != object_name) {
+        return filter_other;
+    }
+
+    if (strcmp(filter->name, "FlateDecode") == 0) {
+        return filter_flate_decode;
+    } else if (strcmp(filter->name, "DCTDecode") == 0) {
+        return filter_dct_decode;
+    } else if (strcmp(filter->name, "JPXDecode") == 0) {
+        return filter_jpx_decode;
+    } else if (strcmp(filter->name, "JBIG2Decode") == 0) {
+        return filter_jbig2_decode;
+    } else if (strcmp(filter->name, "CCITTFaxDecode") == 0) {
+        return filter_ccitt_fax_decode;
+    }
+
+    return filter_other;
+}
+
+// Append the text of a page content stream, or of each stream in an array
+//
+// Returns 0 on success, contents that do not resolve to a stream add no text.
+// Returns 1 if a stream could not be decoded
+PDFDEF int pdf_append_page_text(pdf_t *pdf, object_t *contents, ds_string_builder *text) {
+    int result = 0;
+    indirect_object *object = NULL;
+    pdf_stream *stream = NULL;
+
+    if (contents->kind == object_array) {
+        object_t *items = (object_t *)contents->array.items;
+        for (unsigned int i = 0; i < contents->array.count; i++) {
+            if (pdf_append_page_text(pdf, items + i, text) != 0) {
+                return_defer(1);
+            }
+        }
+        return_defer(0);
+    }
+
+    if (contents->kind != object_pointer ||
+        pdf_resolve(pdf, contents->pointer.object_number, contents->pointer.generation_number, &object) != 0) {
+        return_defer(0);
+    }
+
+    object_t *items = (object_t *)object->objects.items;
+    if (object->objects.count != 0 && items[0].kind == object_array) {
+        return_defer(pdf_append_page_text(pdf, items, text));
+    }
+
+    int status = pdf_get_stream(pdf, object, &stream);
+    if (status != PDF_OK && status != PDF_ERR_SYNTAX) {
+        DS_LOG_ERROR("Failed to uncompress object %d %d: %s", object->object_number, object->generation_number, pdf_error_string(status));
+        return_defer(1);
+    }
+
+    if (stream != NULL && pdf_append_text(text, stream->data, stream->len) != 0) {
+        return_defer(1);
+    }
+
+defer:
+    pdf_release_stream(pdf, stream);
+    return result;
+}
+
+static int pdf_write_all(int fd, const char *data, unsigned long len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            return 1;
+        }
+
+        data += written;
+        len -= written;
+        pdf_stats_add(PDF_COUNTER_BYTES_WRITTEN, written);
+    }
+
+    return 0;
+}
+
+// Open a sink that creates the files in a directory, the current directory
+// when it is NULL
+//
+// Returns 0 on success. Returns 1 if the directory could not be created
+PDFDEF int pdf_sink_open_directory(pdf_sink *sink, const char *directory) {
+    *sink = (pdf_sink){ .kind = pdf_sink_directory, .fd = AT_FDCWD, .source = -1 };
+
+    if (directory == NULL) {
+        return 0;
+    }
+
+    if (mkdir(directory, 0700) != 0 && errno != EEXIST) {
+        DS_LOG_ERROR("Failed to create the directory %s", directory);
+        return 1;
+    }
+
+    sink->fd = open(directory, O_RDONLY | O_DIRECTORY);
+    if (sink->fd < 0) {
+        DS_LOG_ERROR("Failed to open the directory %s", directory);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Open a sink that writes the files as the entries of a tar archive
+//
+// Returns 0 on success. Returns 1 if the archive could not be created
+PDFDEF int pdf_sink_open_archive(pdf_sink *sink, const char *path) {
+    *sink = (pdf_sink){ .kind = pdf_sink_archive, .source = -1 };
+    ds_dynamic_array_init(&sink->buffer, sizeof(char));
+
+    sink->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (sink->fd < 0) {
+        DS_LOG_ERROR("Failed to create the archive %s", path);
+        return 1;
+    }
+
+    if (ds_dynamic_array_reserve(&sink->buffer, PDF_SINK_BUFFER_SIZE) != 0) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static int pdf_sink_flush(pdf_sink *sink) {
+    int result = pdf_write_all(sink->fd, (char *)sink->buffer.items, sink->buffer.count);
+    sink->buffer.count = 0;
+    return result;
+}
+
+// Queue bytes for the archive, payloads larger than the buffer skip it
+static int pdf_sink_append(pdf_sink *sink, const char *data, unsigned long len) {
+    if (len == 0) {
+        return 0;
+    }
+
+    if (sink->buffer.count + len > PDF_SINK_BUFFER_SIZE && pdf_sink_flush(sink) != 0) {
+        return 1;
+    }
+
+    if (len >= PDF_SINK_BUFFER_SIZE) {
+        return pdf_write_all(sink->fd, data, len);
+    }
+
+    return ds_dynamic_array_append_many(&sink->buffer, (void **)data, len);
+}
+
+// Fill a ustar header, names longer than 100 bytes are split on a '/'
+static int pdf_sink_tar_header(char *header, const char *name, unsigned long len) {
+    unsigned long name_len = strlen(name);
+    unsigned long split = 0;
+    unsigned int checksum = 0;
+
+    memset(header, 0, PDF_SINK_TAR_BLOCK);
+    if (name_len > 100) {
+        for (split = name_len - 100; split < name_len && name[split] != '/'; split++) {
+        }
+        if (split >= name_len || split > 155) {
+            return 1;
+        }
+        memcpy(header + 345, name, split);
+        name += split + 1;
+    }
+
+    memcpy(header, name, strlen(name));
+    memcpy(header + 100, "0000644", 7);
+    memcpy(header + 108, "0000000", 7);
+    memcpy(header + 116, "0000000", 7);
+    snprintf(header + 124, 12, "%011lo", len);
+    memcpy(header + 136, "00000000000", 11);
+    memset(header + 148, ' ', 8);
+    header[156] = '0';
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+
+    for (unsigned int i = 0; i < PDF_SINK_TAR_BLOCK; i++) {
+        checksum += (unsigned char)header[i];
+    }
+    snprintf(header + 148, 8, "%06o", checksum);
+
+    return 0;
+}
+
+static int pdf_sink_write_entry(pdf_sink *sink, const char *name, const char *data, unsigned long len) {
+    if (sink->kind == pdf_sink_directory) {
+        int fd = openat(sink->fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            DS_LOG_ERROR("Failed to open file: %s", name);
+            return 1;
+        }
+
+        int result = pdf_write_all(fd, data, len);
+        close(fd);
+        return result;
+    }
+
+    char header[PDF_SINK_TAR_BLOCK];
+    char padding[PDF_SINK_TAR_BLOCK] = {0};
+
+    while (*name == '/') {
+        name++;
+    }
+
+    if (pdf_sink_tar_header(header, name, len) != 0) {
+        DS_LOG_ERROR("The name %s does not fit in a tar header", name);
+        return 1;
+    }
+
+    if (pdf_sink_append(sink, header, PDF_SINK_TAR_BLOCK) != 0 || pdf_sink_append(sink, data, len) != 0 ||
+        pdf_sink_append(sink, padding, (PDF_SINK_TAR_BLOCK - len % PDF_SINK_TAR_BLOCK) % PDF_SINK_TAR_BLOCK) != 0) {
+        DS_LOG_ERROR("Failed to write %s to the archive", name);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Open the file that the pdf buffer maps as the source of pdf_sink_copy, so
+// passthrough streams are copied by the kernel instead of written from the
+// mapping
+//
+// Returns 0 on success. Returns 1 if the file could not be opened
+PDFDEF int pdf_sink_open_source(pdf_sink *sink, const char *path) {
+    sink->source = open(path, O_RDONLY);
+    if (sink->source < 0) {
+        DS_LOG_WARN("Failed to open %s, images are written from memory", path);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Copy len bytes at offset of the source into fd without going through user
+// space. copy_file_range is tried first, then sendfile, and what they could
+// not copy is written from data, the same bytes in the mapping
+static int pdf_copy_all(int source, unsigned long offset, int fd, const char *data, unsigned long len) {
+    unsigned long done = 0;
+
+#ifdef __linux__
+#ifdef SYS_copy_file_range
+    while (done < len) {
+        loff_t in = offset + done;
+        ssize_t copied = syscall(SYS_copy_file_range, source, &in, fd, NULL, len - done, 0);
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        if (copied <= 0) {
+            break;
+        }
+
+        done += copied;
+        pdf_stats_add(PDF_COUNTER_BYTES_COPIED, copied);
+    }
+#endif // SYS_copy_file_range
+
+    while (done < len) {
+        off_t in = offset + done;
+        ssize_t copied = sendfile(fd, source, &in, len - done);
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        if (copied <= 0) {
+            break;
+        }
+
+        done += copied;
+        pdf_stats_add(PDF_COUNTER_BYTES_COPIED, copied);
+    }
+#else
+    (void)source;
+    (void)offset;
+#endif // __linux__
+
+    return pdf_write_all(fd, data + done, len - done);
+}
+
+static int pdf_sink_copy_entry(pdf_sink *sink, const char *name, const pdf_sink_container *container,
+                               unsigned long offset, const char *data, unsigned long len) {
+    int source = offset != PDF_SINK_IN_MEMORY ? sink->source : -1;
+    int copy = source >= 0 && (sink->kind == pdf_sink_directory || len >= PDF_SINK_COPY_MIN);
+    unsigned long total = container->head_len + len + container->tail_len;
+
+    if (sink->kind == pdf_sink_directory) {
+        int fd = openat(sink->fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            DS_LOG_ERROR("Failed to open file: %s", name);
+            return 1;
+        }
+
+        int result = pdf_write_all(fd, container->head, container->head_len) != 0 ||
+                     (copy ? pdf_copy_all(source, offset, fd, data, len) : pdf_write_all(fd, data, len)) != 0 ||
+                     pdf_write_all(fd, container->tail, container->tail_len) != 0;
+        close(fd);
+        return result;
+    }
+
+    char header[PDF_SINK_TAR_BLOCK];
+    char padding[PDF_SINK_TAR_BLOCK] = {0};
+
+    while (*name == '/') {
+        name++;
+    }
+
+    if (pdf_sink_tar_header(header, name, total) != 0) {
+        DS_LOG_ERROR("The name %s does not fit in a tar header", name);
+        return 1;
+    }
+
+    // the queued entries go out first, the copy writes at the file offset
+    if (pdf_sink_append(sink, header, PDF_SINK_TAR_BLOCK) != 0 ||
+        pdf_sink_append(sink, container->head, container->head_len) != 0 ||
+        (copy ? pdf_sink_flush(sink) != 0 || pdf_copy_all(source, offset, sink->fd, data, len) != 0
+              : pdf_sink_append(sink, data, len) != 0) ||
+        pdf_sink_append(sink, container->tail, container->tail_len) != 0 ||
+        pdf_sink_append(sink, padding, (PDF_SINK_TAR_BLOCK - total % PDF_SINK_TAR_BLOCK) % PDF_SINK_TAR_BLOCK) != 0) {
+        DS_LOG_ERROR("Failed to write %s to the archive", name);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Write the bytes at offset of the source file under name, between the head
+// and the tail of the container when there is one. data holds the same bytes
+// and is written instead when the offset is PDF_SINK_IN_MEMORY, when the
+// sink has no source, when the kernel cannot copy between the files, or for
+// small archive entries
+//
+// Returns 0 on success. Returns 1 in case of an error
+PDFDEF int pdf_sink_copy(pdf_sink *sink, const char *name, const pdf_sink_container *container, unsigned long offset,
+                         const char *data, unsigned long len) {
+    pdf_sink_container none = {0};
+    unsigned long long start_ns = pdf_stats_begin();
+    int result = pdf_sink_copy_entry(sink, name, container != NULL ? container : &none, offset, data, len);
+
+    pdf_stats_end(PDF_PHASE_WRITE, start_ns);
+    return result;
+}
+
+// Write one extracted stream under name
+//
+// Returns 0 on success. Returns 1 in case of an error
+PDFDEF int pdf_sink_write(pdf_sink *sink, const char *name, const char *data, unsigned long len) {
+    unsigned long long start_ns = pdf_stats_begin();
+    int result = pdf_sink_write_entry(sink, name, data, len);
+
+    pdf_stats_end(PDF_PHASE_WRITE, start_ns);
+    return result;
+}
+
+// Finish the archive and release the sink
+//
+// Returns 0 on success. Returns 1 if the archive could not be completed
+PDFDEF int pdf_sink_close(pdf_sink *sink) {
+    int result = 0;
+    unsigned long long start_ns = pdf_stats_begin();
+
+    if (sink->kind == pdf_sink_archive && sink->fd >= 0) {
+        char end[2 * PDF_SINK_TAR_BLOCK] = {0};
+        if (pdf_sink_append(sink, end, sizeof(end)) != 0 || pdf_sink_flush(sink) != 0) {
+            DS_LOG_ERROR("Failed to finish the archive");
+            result = 1;
+        }
+    }
+
+    if (sink->fd >= 0) {
+        close(sink->fd);
+    }
+    if (sink->source >= 0) {
+        close(sink->source);
+    }
+
+    ds_dynamic_array_free(&sink->buffer);
+    *sink = (pdf_sink){ .fd = -1, .source = -1 };
+    pdf_stats_end(PDF_PHASE_WRITE, start_ns);
+    return result;
+}
+
+// Write the text shown by a decoded content stream as prefix_N_G.txt, an
+// empty file when the stream could not be decoded
+//
+// Returns 0 on success. Returns 1 if the file could not be written
+PDFDEF int pdf_extract_text(pdf_sink *sink, const char *prefix, indirect_object *object, pdf_stream *stream) {
+    char path[PATH_MAX];
+    int result = 0;
+    ds_string_builder string_builder = {0};
+
+    ds_string_builder_init(&string_builder);
+    if (stream != NULL && pdf_append_text(&string_builder, stream->data, stream->len) != 0) {
+        DS_LOG_ERROR("Could not extract text");
+    }
+
+    snprintf(path, sizeof(path), "%s_%d_%d.txt", prefix, object->object_number, object->generation_number);
+    if (pdf_sink_write(sink, path, (char *)string_builder.items.items, string_builder.items.count) != 0) {
+        return_defer(1);
+    }
+
+defer:
+    ds_string_builder_free(&string_builder);
+    return result;
+}
+
+// Size of the TIFF header and directory written before the samples
+#define PDF_TIFF_HEAD_SIZE 256
+
+// The layout of the samples of an image XObject, from its dictionary
+typedef struct pdf_image {
+    unsigned long width;
+    unsigned long height;
+    unsigned int bits; /* per component */
+    unsigned int components; /* 0 for color spaces that are not exported */
+    int inverted; /* a single component image where the maximum sample is black */
+} pdf_image;
+
+static long pdf_image_integer(pdf_t *pdf, ds_dynamic_array *dictionary, const char *name, long fallback) {
+    object_t *value = dictionary != NULL ? pdf_lookup(pdf, dictionary, name) : NULL;
+    return value != NULL && value->kind == object_int ? value->integer : fallback;
+}
+
+static int pdf_image_boolean(pdf_t *pdf, ds_dynamic_array *dictionary, const char *name) {
+    object_t *value = dictionary != NULL ? pdf_lookup(pdf, dictionary, name) : NULL;
+    return value != NULL && value->kind == object_boolean && value->bool;
+}
+
+// Get the parameters of the filter of a stream, the first ones of an array
+static ds_dynamic_array *pdf_image_parms(pdf_t *pdf, ds_dynamic_array *dictionary) {
+    object_t *parms = pdf_lookup(pdf, dictionary, "DecodeParms");
+
+    if (parms != NULL && parms->kind == object_array) {
+        parms = parms->array.count != 0 ? (object_t *)parms->array.items : NULL;
+    }
+
+    return parms != NULL && parms->kind == object_dictionary ? &parms->dictionary : NULL;
+}
+
+// Count the components of a color space, 0 when its samples are not colors
+// that the containers can hold (Indexed, Separation, DeviceN, Lab, Pattern)
+static unsigned int pdf_image_components(pdf_t *pdf, object_t *space) {
+    const char *name = NULL;
+    object_t *items = NULL;
+
+    if (space != NULL && space->kind == object_name) {
+        name = space->name;
+    } else if (space != NULL && space->kind == object_array && space->array.count != 0) {
+        items = (object_t *)space->array.items;
+        name = items[0].kind == object_name ? items[0].name : NULL;
+    }
+
+    if (name == NULL) {
+        return 0;
+    }
+
+    if (strcmp(name, "DeviceGray") == 0 || strcmp(name, "CalGray") == 0 || strcmp(name, "G") == 0) {
+        return 1;
+    } else if (strcmp(name, "DeviceRGB") == 0 || strcmp(name, "CalRGB") == 0 || strcmp(name, "RGB") == 0) {
+        return 3;
+    } else if (strcmp(name, "DeviceCMYK") == 0 || strcmp(name, "CMYK") == 0) {
+        return 4;
+    }
+
+    indirect_object *profile = NULL;
+    if (strcmp(name, "ICCBased") == 0 && space->array.count > 1 && items[1].kind == object_pointer &&
+        pdf_resolve(pdf, items[1].pointer.object_number, items[1].pointer.generation_number, &profile) == 0 &&
+        profile->objects.count != 0 && ((object_t *)profile->objects.items)[0].kind == object_dictionary) {
+        long n = pdf_image_integer(pdf, &((object_t *)profile->objects.items)[0].dictionary, "N", 0);
+        return n == 1 || n == 3 || n == 4 ? n : 0;
+    }
+
+    return 0;
+}
+
+// Read the size and the sample layout of an image. Masks are one bit gray
+// images where 0 paints, like 0 is black in gray. A Decode array is only
+// followed to flip a single component
+static void pdf_image_init(pdf_t *pdf, ds_dynamic_array *dictionary, pdf_image *image) {
+    object_t *decode = pdf_lookup(pdf, dictionary, "Decode");
+    int mask = pdf_image_boolean(pdf, dictionary, "ImageMask");
+
+    *image = (pdf_image){
+        .width = pdf_image_integer(pdf, dictionary, "Width", 0),
+        .height = pdf_image_integer(pdf, dictionary, "Height", 0),
+        .bits = mask ? 1 : pdf_image_integer(pdf, dictionary, "BitsPerComponent", 8),
+        .components = mask ? 1 : pdf_image_components(pdf, pdf_lookup(pdf, dictionary, "ColorSpace")),
+    };
+
+    object_t *range = decode != NULL && decode->kind == object_array && decode->array.count >= 2 ? (object_t *)decode->array.items : NULL;
+    if (range != NULL && (range[0].kind == object_int || range[0].kind == object_real) &&
+        (range[1].kind == object_int || range[1].kind == object_real)) {
+        double low = range[0].kind == object_real ? range[0].real : range[0].integer;
+        double high = range[1].kind == object_real ? range[1].real : range[1].integer;
+        image->inverted = low > high;
+    }
+}
+
+static void pdf_put16(unsigned char *out, unsigned int value) {
+    out[0] = value >> 8;
+    out[1] = value;
+}
+
+static void pdf_put32(unsigned char *out, unsigned long value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+static unsigned char *pdf_tiff_entry(unsigned char *out, unsigned int tag, unsigned int type, unsigned long count, unsigned long value) {
+    memset(out, 0, 12);
+    pdf_put16(out, tag);
+    pdf_put16(out + 2, type);
+    pdf_put32(out + 4, count);
+    if (type == 3 && count == 1) {
+        pdf_put16(out + 8, value);
+    } else {
+        pdf_put32(out + 8, value);
+    }
+
+    return out + 12;
+}
+
+// Build a big endian TIFF header with a single strip of len bytes that
+// follows it. options is the T4Options or T6Options of a CCITT strip
+//
+// Returns 0 on success. Returns 1 if the image does not fit in a TIFF
+static int pdf_tiff_head(ds_dynamic_array *head, pdf_image *image, unsigned int compression, unsigned int photometric,
+                         unsigned long options, unsigned int predictor, unsigned long len) {
+    unsigned char buffer[PDF_TIFF_HEAD_SIZE] = {'M', 'M', 0, 42, 0, 0, 0, 8};
+    unsigned int entries = 9 + (compression == 3 || compression == 4) + (predictor > 1);
+    unsigned long bits = 8 + 2 + entries * 12 + 4;
+    unsigned long strip = bits + (image->components > 2 ? image->components * 2 : 0);
+    unsigned char *out = buffer + 10;
+
+    if (image->width == 0 || image->height == 0 || image->components == 0 || len > 0xffffffffUL) {
+        return 1;
+    }
+
+    pdf_put16(buffer + 8, entries);
+    out = pdf_tiff_entry(out, 256, 4, 1, image->width);
+    out = pdf_tiff_entry(out, 257, 4, 1, image->height);
+    if (image->components > 2) {
+        out = pdf_tiff_entry(out, 258, 3, image->components, bits);
+        for (unsigned int i = 0; i < image->components; i++) {
+            pdf_put16(buffer + bits + i * 2, image->bits);
+        }
+    } else {
+        out = pdf_tiff_entry(out, 258, 3, 1, image->bits);
+    }
+    out = pdf_tiff_entry(out, 259, 3, 1, compression);
+    out = pdf_tiff_entry(out, 262, 3, 1, photometric);
+    out = pdf_tiff_entry(out, 273, 4, 1, strip);
+    out = pdf_tiff_entry(out, 277, 3, 1, image->components);
+    out = pdf_tiff_entry(out, 278, 4, 1, image->height);
+    out = pdf_tiff_entry(out, 279, 4, 1, len);
+    if (compression == 3 || compression == 4) {
+        out = pdf_tiff_entry(out, compression == 3 ? 292 : 293, 4, 1, options);
+    }
+    if (predictor > 1) {
+        out = pdf_tiff_entry(out, 317, 3, 1, predictor);
+    }
+    pdf_put32(out, 0);
+
+    return ds_dynamic_array_append_many(head, (void **)buffer, strip);
+}
+
+// Photometric interpretation of TIFF samples: 0 is white, 0 is black, RGB or
+// CMYK
+static unsigned int pdf_tiff_photometric(pdf_image *image) {
+    switch (image->components) {
+    case 1:
+        return image->inverted ? 0 : 1;
+    case 3:
+        return 2;
+    default:
+        return 5;
+    }
+}
+
+// Build the head of a CCITT image as a TIFF with the Group 3 or Group 4
+// compression of the stream
+static int pdf_ccitt_head(pdf_t *pdf, ds_dynamic_array *dictionary, ds_dynamic_array *head, unsigned long len) {
+    ds_dynamic_array *parms = pdf_image_parms(pdf, dictionary);
+    long k = pdf_image_integer(pdf, parms, "K", 0);
+    pdf_image image;
+
+    pdf_image_init(pdf, dictionary, &image);
+    image.width = pdf_image_integer(pdf, parms, "Columns", image.width != 0 ? (long)image.width : 1728);
+    image.height = pdf_image_integer(pdf, parms, "Rows", image.height);
+    image.bits = 1;
+    image.components = 1;
+
+    // TIFF decoders turn black runs into 1 bits. The runs show black when the
+    // bit they decode to in the pdf (BlackIs1) is the one Decode paints dark
+    int black = pdf_image_boolean(pdf, parms, "BlackIs1") == image.inverted;
+    unsigned long options = (k > 0 ? 1 : 0) | (pdf_image_boolean(pdf, parms, "EncodedByteAlign") ? 4 : 0);
+    return pdf_tiff_head(head, &image, k < 0 ? 4 : 3, black ? 0 : 1, k < 0 ? 0 : options, 1, len);
+}
+
+// Build the head of a flate image whose rows carry PNG predictor tags, the
+// stream is then the IDAT chunk of a PNG as is. The tail is the CRC of the
+// chunk and the IEND chunk
+static int pdf_png_container(pdf_image *image, ds_dynamic_array *parms, pdf_t *pdf, ds_dynamic_array *head,
+                             ds_dynamic_array *tail, const char *data, unsigned long len) {
+    unsigned char buffer[41] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n', 0, 0, 0, 13, 'I', 'H', 'D', 'R'};
+    unsigned char end[16] = {0, 0, 0, 0, 0, 0, 0, 0, 'I', 'E', 'N', 'D', 0xae, 0x42, 0x60, 0x82};
+    unsigned int type = image->components == 1 ? 0 : 2;
+
+    if (image->width == 0 || image->height == 0 || image->inverted || len > 0x7fffffffUL ||
+        (image->components != 1 && image->components != 3) ||
+        (image->components == 3 && image->bits != 8 && image->bits != 16) ||
+        (image->bits != 1 && image->bits != 2 && image->bits != 4 && image->bits != 8 && image->bits != 16) ||
+        pdf_image_integer(pdf, parms, "Colors", 1) != image->components ||
+        pdf_image_integer(pdf, parms, "BitsPerComponent", 8) != image->bits ||
+        pdf_image_integer(pdf, parms, "Columns", 1) != (long)image->width) {
+        return 1;
+    }
+
+    pdf_put32(buffer + 16, image->width);
+    pdf_put32(buffer + 20, image->height);
+    buffer[24] = image->bits;
+    buffer[25] = type;
+    pdf_put32(buffer + 29, crc32(0, buffer + 12, 17));
+    pdf_put32(buffer + 33, len);
+    memcpy(buffer + 37, "IDAT", 4);
+
+    // the checksum reads the mapping, the stream itself is still copied by
+    // the kernel
+    uLong crc = crc32(0, buffer + 37, 4);
+    for (unsigned long done = 0; done < len;) {
+        uInt chunk = len - done > (1UL << 30) ? (1U << 30) : len - done;
+        crc = crc32(crc, (const Bytef *)data + done, chunk);
+        done += chunk;
+    }
+    pdf_put32(end, crc);
+
+    if (ds_dynamic_array_append_many(head, (void **)buffer, sizeof(buffer)) != 0 ||
+        ds_dynamic_array_append_many(tail, (void **)end, sizeof(end)) != 0) {
+        return 1;
+    }
+
+    return 0;
+}
+
+// Build the head of a JBIG2 embedded stream as a sequential JBIG2 file of one
+// page, followed by the global segments the stream refers to
+static int pdf_jbig2_head(pdf_t *pdf, ds_dynamic_array *dictionary, ds_dynamic_array *head) {
+    int result = 0;
+    unsigned char header[13] = {0x97, 'J', 'B', '2', '\r', '\n', 0x1a, '\n', 0x01, 0, 0, 0, 1};
+    ds_dynamic_array *parms = pdf_image_parms(pdf, dictionary);
+    object_t *globals = parms != NULL ? pdf_dictionary_get(parms, "JBIG2Globals") : NULL;
+    indirect_object *object = NULL;
+    pdf_stream *stream = NULL;
+
+    if (ds_dynamic_array_append_many(head, (void **)header, sizeof(header)) != 0) {
+        return_defer(1);
+    }
+
+    if (globals == NULL || globals->kind != object_pointer ||
+        pdf_resolve(pdf, globals->pointer.object_number, globals->pointer.generation_number, &object) != 0) {
+        return_defer(0);
+    }
+
+    if (pdf_get_stream(pdf, object, &stream) != PDF_OK || stream == NULL ||
+        ds_dynamic_array_append_many(head, (void **)stream->data, stream->len) != 0) {
+        return_defer(1);
+    }
+
+defer:
+    pdf_release_stream(pdf, stream);
+    return result;
+}
+
+// Write an image stream as a file without decoding its samples: DCT as
+// prefix_N_G.jpeg, JPX as .jp2 or .j2k, JBIG2 as .jb2, CCITT and flate or
+// unfiltered samples as .tiff, flate with PNG predictors as .png. The bytes
+// are copied from the source of the sink when the stream lies in the pdf
+// buffer. Filter chains and samples the containers cannot hold are skipped
+//
+// Returns 0 on success. Returns 1 if the file could not be written
+PDFDEF int pdf_extract_image(pdf_t *pdf, pdf_sink *sink, const char *prefix, indirect_object *object, ds_string_slice *data) {
+    int result = 0;
+    char path[PATH_MAX];
+    const char *extension = NULL;
+    ds_dynamic_array *dictionary = &((object_t *)object->objects.items)[0].dictionary;
+    ds_dynamic_array head; /* char */
+    ds_dynamic_array tail; /* char */
+    unsigned long len = data->len;
+    pdf_image image;
+
+    ds_dynamic_array_init(&head, sizeof(char));
+    ds_dynamic_array_init(&tail, sizeof(char));
+
+    // the data runs up to endstream, Length drops the end of line before it
+    long length = pdf_image_integer(pdf, dictionary, "Length", -1);
+    if (length >= 0 && (unsigned long)length <= len) {
+        len = length;
+    }
+
+    object_t *filter = pdf_dictionary_get(dictionary, "Filter");
+    filter_kind kind = filter != NULL && filter->kind == object_array && filter->array.count > 1 ? filter_other
+                                                                                               : pdf_get_filter_kind(dictionary);
+    pdf_image_init(pdf, dictionary, &image);
+
+    int failed = 0;
+    switch (kind) {
+    case filter_dct_decode:
+        extension = "jpeg";
+        break;
+    case filter_jpx_decode:
+        extension = len >= 4 && memcmp(data->str, "\xff\x4f\xff\x51", 4) == 0 ? "j2k" : "jp2";
+        break;
+    case filter_jbig2_decode:
+        extension = "jb2";
+        failed = pdf_jbig2_head(pdf, dictionary, &head);
+        break;
+    case filter_ccitt_fax_decode:
+        extension = "tiff";
+        failed = pdf_ccitt_head(pdf, dictionary, &head, len);
+        break;
+    case filter_flate_decode: {
+        ds_dynamic_array *parms = pdf_image_parms(pdf, dictionary);
+        long predictor = pdf_image_integer(pdf, parms, "Predictor", 1);
+        if (predictor >= 10) {
+            extension = "png";
+            failed = pdf_png_container(&image, parms, pdf, &head, &tail, data->str, len);
+        } else {
+            // TIFF takes zlib strips and has the same horizontal predictor
+            extension = "tiff";
+            failed = (predictor == 2 && image.bits != 8 && image.bits != 16) ||
+                     pdf_tiff_head(&head, &image, 8, pdf_tiff_photometric(&image), 0, predictor == 2 ? 2 : 1, len);
+        }
+        break;
+    }
+    case filter_none:
+        extension = "tiff";
+        failed = pdf_tiff_head(&head, &image, 1, pdf_tiff_photometric(&image), 0, 1, len);
+        break;
+    case filter_other:
+        break;
+    }
+
+    if (extension == NULL || failed) {
+        DS_LOG_WARN("Skipping image %d %d, its format cannot be exported as is", object->object_number, object->generation_number);
+        return_defer(0);
+    }
+
+    pdf_sink_container container = {
+        .head = (char *)head.items, .head_len = head.count, .tail = (char *)tail.items, .tail_len = tail.count
+    };
+    unsigned long offset = PDF_SINK_IN_MEMORY;
+    if (pdf->buffer != NULL && data->str >= pdf->buffer && data->str + len <= pdf->buffer + pdf->buffer_len) {
+        offset = data->str - pdf->buffer;
+    }
+
+    snprintf(path, sizeof(path), "%s_%d_%d.%s", prefix, object->object_number, object->generation_number, extension);
+    result = pdf_sink_copy(sink, path, &container, offset, data->str, len);
+
+defer:
+    ds_dynamic_array_free(&head);
+    ds_dynamic_array_free(&tail);
+    return result;
+}
+
+// Write the text or the image of an object once its stream is decoded, the
+// context is a pdf_extract_context. Objects that are not streams are skipped
+//
+// Returns 0 on success. Returns 1 if a stream could not be decoded or written
+PDFDEF int pdf_extract_decoded(void *context, pdf_t *pdf, pdf_decoded *decoded) {
+    pdf_extract_context *extract = context;
+    indirect_object *object = decoded->object;
+    ds_dynamic_array *dictionary = NULL;
+    ds_string_slice data;
+
+    if (pdf_object_stream(object, &dictionary, &data) != 0) {
+        return 0;
+    }
+
+    filter_kind kind = pdf_get_filter_kind(dictionary);
+    if (kind == filter_dct_decode || pdf_is_image(dictionary)) {
+        return pdf_extract_image(pdf, extract->sink, extract->prefix, object, &data);
+    }
+
+    if (kind != filter_flate_decode) {
+        return 0;
+    }
+
+    if (decoded->error != PDF_OK && decoded->error != PDF_ERR_SYNTAX) {
+        DS_LOG_ERROR("Failed to uncompress object %d %d: %s", object->object_number, object->generation_number, pdf_error_string(decoded->error));
+        return 1;
+    }
+
+    return pdf_extract_text(extract->sink, extract->prefix, object, decoded->stream);
+}
+
+// Decode and extract a single object on the calling thread
+//
+// Returns 0 on success. Returns 1 if the stream could not be decoded or written
+PDFDEF int pdf_extract_object(pdf_t *pdf, pdf_sink *sink, const char *prefix, indirect_object *object) {
+    pdf_extract_context context = { .sink = sink, .prefix = prefix };
+    return pdf_decode_streams(pdf, &object, 1, 1, pdf_extract_decoded, &context);
+}
+
 #endif // PDF_IMPLEMENTATION
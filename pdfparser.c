@@ -0,0 +1,882 @@
+// libpdfparser
+//
+// The translation unit behind libpdfparser. It holds the implementation of
+// pdf.h and ds.h, counts the allocations for the stats and implements the
+// document handles of pdfparser.h on top of pdf.h.
+
+// Count every allocation that goes through the DS_* macros for the stats
+static void *pdf_count_malloc(void *allocator, unsigned long size);
+static void *pdf_count_realloc(void *allocator, void *ptr, unsigned long old_size, unsigned long new_size);
+static void pdf_count_free(void *allocator, void *ptr);
+
+#define DS_MALLOC(a, sz) pdf_count_malloc(a, sz)
+#define DS_REALLOC(a, ptr, old_sz, new_sz) pdf_count_realloc(a, ptr, old_sz, new_sz)
+#define DS_FREE(a, ptr) pdf_count_free(a, ptr)
+#define PDF_IMPLEMENTATION
+#include "pdf.h"
+#include "pdfparser.h"
+
+static void *pdf_count_malloc(void *allocator, unsigned long size) {
+    pdf_stats_add(PDF_COUNTER_ALLOCATIONS, 1);
+    return ds_allocator_alloc(allocator, size);
+}
+
+static void *pdf_count_realloc(void *allocator, void *ptr, unsigned long old_size, unsigned long new_size) {
+    pdf_stats_add(PDF_COUNTER_ALLOCATIONS, 1);
+    return ds_allocator_realloc(allocator, ptr, old_size, new_size);
+}
+
+static void pdf_count_free(void *allocator, void *ptr) {
+    ds_allocator_free(allocator, ptr);
+}
+
+// The error codes of pdfparser.h are the pdf_error codes of pdf.h
+_Static_assert(PDF_DOCUMENT_OK == PDF_OK && PDF_DOCUMENT_ERR_SYNTAX == PDF_ERR_SYNTAX &&
+               PDF_DOCUMENT_ERR_DEPTH == PDF_ERR_DEPTH && PDF_DOCUMENT_ERR_MEMORY == PDF_ERR_MEMORY &&
+               PDF_DOCUMENT_ERR_DECOMPRESSED == PDF_ERR_DECOMPRESSED && PDF_DOCUMENT_ERR_TIMEOUT == PDF_ERR_TIMEOUT &&
+               PDF_DOCUMENT_ERR_IO == PDF_ERR_IO, "pdfparser.h error codes out of sync with pdf_error");
+
+struct pdf_document {
+    pdf_t pdf;
+    char *buffer;
+    unsigned long buffer_len;
+    int mapped;
+    char *path; /* the file, or a name for a buffer */
+    const char *prefix; /* the base name of path, names the extracted files */
+    ds_dynamic_array pages; /* pointer_object */
+};
+
+// Initialize the options with the default limits of pdf_parse_options_init
+PDFPARSERDEF void pdf_document_options_init(pdf_document_options *options) {
+    pdf_parse_options defaults;
+    pdf_parse_options_init(&defaults);
+
+    *options = (pdf_document_options){
+        .max_depth = defaults.max_depth,
+        .max_memory = defaults.max_arena_bytes,
+        .max_decompressed = defaults.max_decompressed_bytes,
+        .timeout_ms = defaults.timeout_ms,
+        .cache_bytes = defaults.cache_bytes,
+        .repair = 0,
+        .eager = 0,
+        .index = NULL,
+        .window = defaults.window_bytes,
+    };
+}
+
+// Translate the document options into the limits of pdf.h, NULL for the
+// defaults
+static void pdf_document_parse_options(const pdf_document_options *options, pdf_parse_options *parse_options) {
+    pdf_document_options defaults;
+    if (options == NULL) {
+        pdf_document_options_init(&defaults);
+        options = &defaults;
+    }
+
+    pdf_parse_options_init(parse_options);
+    parse_options->max_depth = options->max_depth;
+    parse_options->max_arena_bytes = options->max_memory;
+    parse_options->max_decompressed_bytes = options->max_decompressed;
+    parse_options->timeout_ms = options->timeout_ms;
+    parse_options->cache_bytes = options->cache_bytes;
+    parse_options->window_bytes = options->window;
+}
+
+// The base name of a path, it names the extracted files
+static const char *pdf_document_base_name(const char *path) {
+    const char *base = strrchr(path, '/');
+    return base != NULL ? base + 1 : path;
+}
+
+// Open a document over a buffer that it takes over when mapped is set
+static int pdf_document_open_buffer(char *buffer, unsigned long buffer_len, int mapped, const char *name,
+                                    const pdf_document_options *options, pdf_document **document) {
+    int result = PDF_OK;
+    pdf_document_options defaults;
+    pdf_parse_options parse_options;
+    pdf_index index = {0};
+    pdf_document *doc = DS_MALLOC(NULL, sizeof(pdf_document));
+
+    if (doc == NULL) {
+        if (mapped) {
+            pdf_unmap_file(buffer, buffer_len);
+        }
+        return_defer(PDF_ERR_MEMORY);
+    }
+
+    *doc = (pdf_document){ .buffer = buffer, .buffer_len = buffer_len, .mapped = mapped };
+    ds_dynamic_array_init(&doc->pages, sizeof(pointer_object));
+
+    ds_string_builder path;
+    ds_string_builder_init(&path);
+    if (ds_string_builder_append(&path, "%s", name) != 0 || ds_string_builder_build(&path, &doc->path) != 0) {
+        ds_string_builder_free(&path);
+        return_defer(PDF_ERR_MEMORY);
+    }
+    ds_string_builder_free(&path);
+
+    doc->prefix = pdf_document_base_name(doc->path);
+
+    if (options == NULL) {
+        pdf_document_options_init(&defaults);
+        options = &defaults;
+    }
+    pdf_document_parse_options(options, &parse_options);
+
+    // an index needs the file it was written for
+    const char *index_path = mapped ? options->index : NULL;
+    if (index_path != NULL && pdf_index_open(doc->path, index_path, &index) == 0) {
+        DS_LOG_INFO("Reusing the index %s", index_path);
+        result = pdf_open_indexed(buffer, buffer_len, &parse_options, &index, &doc->pdf);
+    } else if (options->eager) {
+        result = parse_pdf_with_options(buffer, buffer_len, &parse_options, &doc->pdf);
+    } else {
+        result = pdf_open(buffer, buffer_len, &parse_options, &doc->pdf);
+    }
+    if (result != PDF_OK) {
+        return_defer(result);
+    }
+
+    if (options->repair && doc->pdf.repaired == 0 && pdf_repair_xref(buffer, buffer_len, &doc->pdf) != 0) {
+        return_defer(PDF_ERR_SYNTAX);
+    }
+
+    if (index_path != NULL && index.map == NULL && pdf_index_write(&doc->pdf, doc->path, index_path) != 0) {
+        DS_LOG_WARN("Failed to write the index %s", index_path);
+    }
+
+    if (pdf_get_pages(&doc->pdf, &doc->pages) != 0) {
+        return_defer(PDF_ERR_SYNTAX);
+    }
+
+defer:
+    pdf_index_close(&index);
+    if (result != PDF_OK && doc != NULL) {
+        pdf_document_close(doc);
+        doc = NULL;
+    }
+    *document = doc;
+    return result;
+}
+
+// Open the pdf file at path
+//
+// The file is mapped and parsed on demand: only the xref table, the trailer
+// and the page tree are read here, unless options ask for an eager parse or
+// a sidecar index. options can be NULL for the defaults.
+PDFPARSERDEF int pdf_document_open(const char *path, const pdf_document_options *options, pdf_document **document) {
+    char *buffer = NULL;
+    unsigned long buffer_len = 0;
+
+    *document = NULL;
+    if (pdf_map_file(path, &buffer, &buffer_len) != 0) {
+        DS_LOG_ERROR("Failed to read %s", path);
+        return PDF_ERR_IO;
+    }
+
+    return pdf_document_open_buffer(buffer, buffer_len, 1, path, options, document);
+}
+
+// Open a pdf held in memory, the buffer must outlive the document
+PDFPARSERDEF int pdf_document_open_memory(const char *buffer, unsigned long buffer_len,
+                                          const pdf_document_options *options, pdf_document **document) {
+    return pdf_document_open_buffer((char *)buffer, buffer_len, 0, "document", options, document);
+}
+
+// Close a document and release everything it owns, NULL is ignored
+PDFPARSERDEF void pdf_document_close(pdf_document *document) {
+    if (document == NULL) {
+        return;
+    }
+
+    ds_dynamic_array_free(&document->pages);
+    pdf_free(&document->pdf);
+    if (document->mapped) {
+        pdf_unmap_file(document->buffer, document->buffer_len);
+    }
+    if (document->path != NULL) {
+        DS_FREE(NULL, document->path);
+    }
+    DS_FREE(NULL, document);
+}
+
+PDFPARSERDEF const char *pdf_document_error_string(int error) {
+    return pdf_error_string(error);
+}
+
+// Describe the xref table, the trailer and the stream cache of a document
+PDFPARSERDEF void pdf_document_get_info(pdf_document *document, pdf_document_info *info) {
+    pdf_stream_cache_stats stats;
+    ds_dynamic_array *catalog = NULL;
+    pdf_stream_cache_get_stats(&document->pdf, &stats);
+
+    *info = (pdf_document_info){
+        .startxref = document->pdf.startxref,
+        .repaired = document->pdf.repaired,
+        .catalog = pdf_get_catalog(&document->pdf, &catalog) == 0,
+        .trailer_count = document->pdf.trailer.count,
+        .xref_count = document->pdf.xref.entries.count,
+        .recovered_count = document->pdf.recovered.count,
+        .cache_hits = stats.hits,
+        .cache_misses = stats.misses,
+        .cache_evictions = stats.evictions,
+        .cache_bytes = stats.bytes,
+        .cache_count = stats.count,
+    };
+}
+
+// Get the name of a key of the trailer, in the order of the file
+//
+// Returns NULL if index is past the last key
+PDFPARSERDEF const char *pdf_document_trailer_key(pdf_document *document, unsigned long index) {
+    if (index >= document->pdf.trailer.count) {
+        return NULL;
+    }
+
+    return ((object_kv *)document->pdf.trailer.items)[index].name;
+}
+
+static int pdf_document_row(ds_dynamic_array *rows, unsigned long index, pdf_document_xref *row) {
+    if (index >= rows->count) {
+        return PDF_ERR_SYNTAX;
+    }
+
+    xref_entry *entry = (xref_entry *)rows->items + index;
+    *row = (pdf_document_xref){
+        .object_number = entry->object_number,
+        .generation_number = entry->generation_number,
+        .offset = entry->offset,
+        .in_use = entry->in_use,
+    };
+    return PDF_OK;
+}
+
+// Get a row of the xref table, the sections of incremental updates come after
+// the sections they update
+PDFPARSERDEF int pdf_document_get_xref(pdf_document *document, unsigned long index, pdf_document_xref *row) {
+    return pdf_document_row(&document->pdf.xref.entries, index, row);
+}
+
+// Get a row that the rebuild of the xref table added or moved
+PDFPARSERDEF int pdf_document_get_recovered(pdf_document *document, unsigned long index, pdf_document_xref *row) {
+    return pdf_document_row(&document->pdf.recovered, index, row);
+}
+
+static void pdf_document_describe(indirect_object *object, pdf_document_object *description) {
+    object_t *items = (object_t *)object->objects.items;
+
+    *description = (pdf_document_object){
+        .object_number = object->object_number,
+        .generation_number = object->generation_number,
+    };
+
+    if (object->objects.count == 0 || items[0].kind != object_dictionary) {
+        return;
+    }
+
+    object_t *type = pdf_dictionary_get(&items[0].dictionary, "Type");
+    object_t *subtype = pdf_dictionary_get(&items[0].dictionary, "Subtype");
+    object_t *filter = pdf_dictionary_get(&items[0].dictionary, "Filter");
+    if (filter != NULL && filter->kind == object_array && filter->array.count != 0) {
+        filter = (object_t *)filter->array.items;
+    }
+
+    description->type = type != NULL && type->kind == object_name ? type->name : NULL;
+    description->subtype = subtype != NULL && subtype->kind == object_name ? subtype->name : NULL;
+    description->filter = filter != NULL && filter->kind == object_name ? filter->name : NULL;
+
+    if (object->objects.count > 1 && items[1].kind == object_stream) {
+        description->is_stream = 1;
+        description->length = items[1].stream.len;
+    }
+}
+
+// Describe an indirect object, parsing it if it was not resolved yet
+PDFPARSERDEF int pdf_document_get_object(pdf_document *document, int object_number, int generation_number,
+                                         pdf_document_object *object) {
+    indirect_object *resolved = NULL;
+
+    if (pdf_resolve(&document->pdf, object_number, generation_number, &resolved) != 0) {
+        return PDF_ERR_SYNTAX;
+    }
+
+    pdf_document_describe(resolved, object);
+    return PDF_OK;
+}
+
+// Get a copy of the decoded stream of an object, NUL terminated
+//
+// Returns PDF_ERR_SYNTAX if the object is not a stream
+PDFPARSERDEF int pdf_document_get_stream(pdf_document *document, int object_number, int generation_number,
+                                         char **data, unsigned long *data_len) {
+    int result = PDF_OK;
+    indirect_object *object = NULL;
+    pdf_stream *stream = NULL;
+
+    *data = NULL;
+    *data_len = 0;
+    if (pdf_resolve(&document->pdf, object_number, generation_number, &object) != 0) {
+        return_defer(PDF_ERR_SYNTAX);
+    }
+
+    result = pdf_get_stream(&document->pdf, object, &stream);
+    if (result != PDF_OK) {
+        return_defer(result);
+    }
+    if (stream == NULL) {
+        return_defer(PDF_ERR_SYNTAX);
+    }
+
+    *data = DS_MALLOC(NULL, stream->len + 1);
+    if (*data == NULL) {
+        return_defer(PDF_ERR_MEMORY);
+    }
+    memcpy(*data, stream->data, stream->len);
+    (*data)[stream->len] = '\0';
+    *data_len = stream->len;
+
+defer:
+    pdf_release_stream(&document->pdf, stream);
+    return result;
+}
+
+PDFPARSERDEF unsigned long pdf_document_page_count(pdf_document *document) {
+    return document->pages.count;
+}
+
+// Resolve the dictionary of a page
+static int pdf_document_page(pdf_document *document, unsigned long index, indirect_object **object) {
+    if (index >= document->pages.count) {
+        return 1;
+    }
+
+    pointer_object pointer = ((pointer_object *)document->pages.items)[index];
+    if (pdf_resolve(&document->pdf, pointer.object_number, pointer.generation_number, object) != 0) {
+        return 1;
+    }
+
+    object_t *items = (object_t *)(*object)->objects.items;
+    return (*object)->objects.count == 0 || items[0].kind != object_dictionary;
+}
+
+// Describe the page at index, in the order of the page tree
+PDFPARSERDEF int pdf_document_get_page(pdf_document *document, unsigned long index, pdf_document_object *page) {
+    indirect_object *object = NULL;
+
+    if (pdf_document_page(document, index, &object) != 0) {
+        return PDF_ERR_SYNTAX;
+    }
+
+    pdf_document_describe(object, page);
+    return PDF_OK;
+}
+
+// Get the text shown by the content streams of the page at index, NUL
+// terminated
+PDFPARSERDEF int pdf_document_page_text(pdf_document *document, unsigned long index, char **text,
+                                        unsigned long *text_len) {
+    int result = PDF_OK;
+    indirect_object *object = NULL;
+    ds_string_builder sb;
+
+    *text = NULL;
+    *text_len = 0;
+    ds_string_builder_init(&sb);
+    if (pdf_document_page(document, index, &object) != 0) {
+        return_defer(PDF_ERR_SYNTAX);
+    }
+
+    object_t *contents = pdf_dictionary_get(&((object_t *)object->objects.items)[0].dictionary, "Contents");
+    if (contents != NULL && pdf_append_page_text(&document->pdf, contents, &sb) != 0) {
+        return_defer(PDF_ERR_SYNTAX);
+    }
+
+    if (ds_string_builder_build(&sb, text) != 0) {
+        return_defer(PDF_ERR_MEMORY);
+    }
+    *text_len = sb.items.count;
+
+defer:
+    ds_string_builder_free(&sb);
+    return result;
+}
+
+// Write the text and the images of every stream into a directory, or into a
+// tar archive when archive is set, decoding on threads workers
+//
+// The files are named after the document and the object, like the parser
+// command line does.
+PDFPARSERDEF int pdf_document_extract(pdf_document *document, const char *path, int archive, unsigned int threads) {
+    int result = PDF_OK;
+    pdf_sink sink = { .fd = -1, .source = -1 };
+    ds_dynamic_array targets; /* indirect_object* */
+    xref_entry *entries = document->pdf.cache.entries;
+
+    ds_dynamic_array_init(&targets, sizeof(indirect_object *));
+    if ((archive ? pdf_sink_open_archive(&sink, path) : pdf_sink_open_directory(&sink, path)) != 0) {
+        return_defer(PDF_ERR_IO);
+    }
+
+    // images are copied from the file by the kernel
+    if (document->mapped) {
+        pdf_sink_open_source(&sink, document->path);
+    }
+
+    // an eager parse holds the objects, and an object redefined by an
+    // incremental update is only extracted in its newest definition
+    indirect_object *objects = (indirect_object *)document->pdf.objects.items;
+    for (unsigned long i = 0; i < document->pdf.objects.count; i++) {
+        indirect_object *object = objects + i;
+        indirect_object *newest = NULL;
+        if (pdf_get_object(&document->pdf, object->object_number, object->generation_number, &newest) != 0 ||
+            newest != object) {
+            continue;
+        }
+
+        if (ds_dynamic_array_append(&targets, &object) != 0) {
+            return_defer(PDF_ERR_MEMORY);
+        }
+    }
+
+    // otherwise one row per object number, the newest definition of each
+    for (unsigned long i = 0; document->pdf.objects.count == 0 && i < document->pdf.cache.count; i++) {
+        indirect_object *object = NULL;
+
+        if (entries[i].in_use != 'n' ||
+            pdf_resolve(&document->pdf, entries[i].object_number, entries[i].generation_number, &object) != 0) {
+            continue;
+        }
+
+        if (ds_dynamic_array_append(&targets, &object) != 0) {
+            return_defer(PDF_ERR_MEMORY);
+        }
+    }
+
+    pdf_extract_context context = { .sink = &sink, .prefix = document->prefix };
+    if (pdf_decode_streams(&document->pdf, (indirect_object **)targets.items, targets.count, threads,
+                           pdf_extract_decoded, &context) != 0) {
+        return_defer(PDF_ERR_IO);
+    }
+
+defer:
+    if (pdf_sink_close(&sink) != 0 && result == PDF_OK) {
+        result = PDF_ERR_IO;
+    }
+    ds_dynamic_array_free(&targets);
+    return result;
+}
+
+// A writer of the caller, the library times the writes and counts the bytes
+typedef struct pdf_document_output {
+    pdf_document_write_fn *write;
+    void *context;
+} pdf_document_output;
+
+static int pdf_document_write_output(void *context, const char *data, unsigned long len) {
+    pdf_document_output *output = context;
+    unsigned long long start_ns = pdf_stats_begin();
+    int result = output->write(output->context, data, len);
+
+    pdf_stats_add(PDF_COUNTER_BYTES_WRITTEN, len);
+    pdf_stats_end(PDF_PHASE_WRITE, start_ns);
+    return result;
+}
+
+// Write the image XObjects of a page as references to their objects
+static int pdf_document_write_images(json_writer *writer, pdf_t *pdf, ds_dynamic_array *page) {
+    object_t *resources = pdf_lookup(pdf, page, "Resources");
+    object_t *xobjects = NULL;
+
+    if (resources != NULL && resources->kind == object_dictionary) {
+        xobjects = pdf_lookup(pdf, &resources->dictionary, "XObject");
+    }
+
+    if (json_writer_key(writer, "images") != 0 || json_writer_begin_array(writer) != 0) {
+        return 1;
+    }
+
+    object_kv *kvs = xobjects != NULL && xobjects->kind == object_dictionary ? (object_kv *)xobjects->dictionary.items : NULL;
+    for (unsigned long i = 0; kvs != NULL && i < xobjects->dictionary.count; i++) {
+        indirect_object *object = NULL;
+        pointer_object pointer = kvs[i].object.pointer;
+
+        if (kvs[i].object.kind != object_pointer ||
+            pdf_resolve(pdf, pointer.object_number, pointer.generation_number, &object) != 0) {
+            continue;
+        }
+
+        object_t *items = (object_t *)object->objects.items;
+        if (object->objects.count == 0 || items[0].kind != object_dictionary) {
+            continue;
+        }
+
+        object_t *subtype = pdf_dictionary_get(&items[0].dictionary, "Subtype");
+        if (subtype == NULL || subtype->kind != object_name || strcmp(subtype->name, "Image") != 0) {
+            continue;
+        }
+
+        object_t *filter = pdf_dictionary_get(&items[0].dictionary, "Filter");
+        object_t *width = pdf_dictionary_get(&items[0].dictionary, "Width");
+        object_t *height = pdf_dictionary_get(&items[0].dictionary, "Height");
+
+        if (json_writer_begin_object(writer) != 0 ||
+            json_writer_key(writer, "name") != 0 || json_writer_string(writer, kvs[i].name, strlen(kvs[i].name)) != 0 ||
+            json_writer_key(writer, "object") != 0 || json_writer_integer(writer, pointer.object_number) != 0 ||
+            json_writer_key(writer, "generation") != 0 || json_writer_integer(writer, pointer.generation_number) != 0 ||
+            json_writer_key(writer, "filter") != 0 ||
+            (filter != NULL && filter->kind == object_name ? json_writer_string(writer, filter->name, strlen(filter->name)) : json_writer_null(writer)) != 0 ||
+            json_writer_key(writer, "width") != 0 ||
+            (width != NULL && width->kind == object_int ? json_writer_integer(writer, width->integer) : json_writer_null(writer)) != 0 ||
+            json_writer_key(writer, "height") != 0 ||
+            (height != NULL && height->kind == object_int ? json_writer_integer(writer, height->integer) : json_writer_null(writer)) != 0 ||
+            json_writer_end_object(writer) != 0) {
+            return 1;
+        }
+    }
+
+    return json_writer_end_array(writer);
+}
+
+// Write one record with the text and the images of a page, or only with the
+// fields asked for
+static int pdf_document_write_page(json_writer *writer, pdf_document *document, unsigned long index,
+                                   ds_string_builder *text, unsigned int fields) {
+    indirect_object *object = NULL;
+    ds_dynamic_array *page = NULL;
+    pointer_object pointer = ((pointer_object *)document->pages.items)[index];
+
+    if (pdf_document_page(document, index, &object) == 0) {
+        page = &((object_t *)object->objects.items)[0].dictionary;
+    }
+
+    text->items.count = 0;
+    object_t *contents = page != NULL && (fields & PDF_DOCUMENT_PAGE_TEXT) ? pdf_dictionary_get(page, "Contents") : NULL;
+    if (contents != NULL && pdf_append_page_text(&document->pdf, contents, text) != 0) {
+        return 1;
+    }
+
+    if (json_writer_begin_object(writer) != 0 ||
+        json_writer_key(writer, "type") != 0 || json_writer_string(writer, "page", 4) != 0 ||
+        json_writer_key(writer, "index") != 0 || json_writer_integer(writer, index) != 0 ||
+        json_writer_key(writer, "object") != 0 || json_writer_integer(writer, pointer.object_number) != 0 ||
+        json_writer_key(writer, "generation") != 0 || json_writer_integer(writer, pointer.generation_number) != 0) {
+        return 1;
+    }
+
+    if ((fields & PDF_DOCUMENT_PAGE_TEXT) &&
+        (json_writer_key(writer, "text") != 0 || json_writer_string(writer, (char *)text->items.items, text->items.count) != 0)) {
+        return 1;
+    }
+
+    if (page != NULL && (fields & PDF_DOCUMENT_PAGE_IMAGES) && pdf_document_write_images(writer, &document->pdf, page) != 0) {
+        return 1;
+    }
+
+    return json_writer_end_object(writer) != 0 || json_writer_end_record(writer) != 0;
+}
+
+// Write the document record with the trailer keys and the xref table
+//
+// Returns 0 on success. Returns PDF_ERR_IO if write failed
+PDFPARSERDEF int pdf_document_write_metadata(pdf_document *document, pdf_document_write_fn *write, void *context) {
+    int result = PDF_OK;
+    pdf_t *pdf = &document->pdf;
+    pdf_document_output output = { .write = write, .context = context };
+    json_writer writer;
+
+    json_writer_init(&writer, pdf_document_write_output, &output);
+    if (json_writer_begin_object(&writer) != 0 ||
+        json_writer_key(&writer, "type") != 0 || json_writer_string(&writer, "document", 8) != 0 ||
+        json_writer_key(&writer, "file") != 0 || json_writer_string(&writer, document->path, strlen(document->path)) != 0 ||
+        json_writer_key(&writer, "startxref") != 0 || json_writer_integer(&writer, pdf->startxref) != 0 ||
+        json_writer_key(&writer, "repaired") != 0 || json_writer_boolean(&writer, pdf->repaired) != 0 ||
+        json_writer_key(&writer, "pages") != 0 || json_writer_integer(&writer, document->pages.count) != 0 ||
+        json_writer_key(&writer, "trailer") != 0 || json_writer_begin_array(&writer) != 0) {
+        return_defer(PDF_ERR_IO);
+    }
+
+    object_kv *trailer = (object_kv *)pdf->trailer.items;
+    for (unsigned long i = 0; i < pdf->trailer.count; i++) {
+        if (json_writer_string(&writer, trailer[i].name, strlen(trailer[i].name)) != 0) {
+            return_defer(PDF_ERR_IO);
+        }
+    }
+
+    if (json_writer_end_array(&writer) != 0 || json_writer_key(&writer, "xref") != 0 || json_writer_begin_array(&writer) != 0) {
+        return_defer(PDF_ERR_IO);
+    }
+
+    xref_entry *entries = (xref_entry *)pdf->xref.entries.items;
+    for (unsigned long i = 0; i < pdf->xref.entries.count; i++) {
+        if (json_writer_begin_array(&writer) != 0 ||
+            json_writer_integer(&writer, entries[i].object_number) != 0 ||
+            json_writer_integer(&writer, entries[i].generation_number) != 0 ||
+            json_writer_integer(&writer, entries[i].offset) != 0 ||
+            json_writer_boolean(&writer, entries[i].in_use == 'n') != 0 ||
+            json_writer_end_array(&writer) != 0) {
+            return_defer(PDF_ERR_IO);
+        }
+    }
+
+    if (json_writer_end_array(&writer) != 0 || json_writer_end_object(&writer) != 0 ||
+        json_writer_end_record(&writer) != 0 || json_writer_flush(&writer) != 0) {
+        return_defer(PDF_ERR_IO);
+    }
+
+defer:
+    json_writer_free(&writer);
+    return result;
+}
+
+// Write one record per page from first to last, inclusive and clamped to the
+// pages of the document, with the PDF_DOCUMENT_PAGE_* fields asked for
+//
+// Returns 0 on success. Returns PDF_ERR_IO if write failed
+PDFPARSERDEF int pdf_document_write_pages(pdf_document *document, unsigned long first, unsigned long last,
+                                          unsigned int fields, pdf_document_write_fn *write, void *context) {
+    int result = PDF_OK;
+    pdf_document_output output = { .write = write, .context = context };
+    json_writer writer;
+    ds_string_builder text;
+
+    json_writer_init(&writer, pdf_document_write_output, &output);
+    ds_string_builder_init(&text);
+    for (unsigned long i = first; i <= last && i < document->pages.count; i++) {
+        if (pdf_document_write_page(&writer, document, i, &text, fields) != 0) {
+            return_defer(PDF_ERR_IO);
+        }
+    }
+
+    if (json_writer_flush(&writer) != 0) {
+        return_defer(PDF_ERR_IO);
+    }
+
+defer:
+    ds_string_builder_free(&text);
+    json_writer_free(&writer);
+    return result;
+}
+
+// Handles the objects of a piped pdf for pdf_document_parse_fd
+typedef struct pdf_document_stream_context {
+    pdf_sink *sink; /* NULL when no files are written */
+    const char *prefix;
+    json_writer *writer; /* NULL when no records are written */
+    ds_string_builder text;
+} pdf_document_stream_context;
+
+// Write one record for a stream object read from a pipe
+static int pdf_document_write_object(json_writer *writer, pdf_t *pdf, indirect_object *object, ds_string_builder *text) {
+    object_t *items = (object_t *)object->objects.items;
+    pdf_stream *stream = NULL;
+
+    if (object->objects.count < 2 || items[0].kind != object_dictionary || items[1].kind != object_stream) {
+        return 0;
+    }
+
+    ds_dynamic_array *dictionary = &items[0].dictionary;
+    object_t *filter = pdf_dictionary_get(dictionary, "Filter");
+    object_t *subtype = pdf_dictionary_get(dictionary, "Subtype");
+    int flate = filter != NULL && filter->kind == object_name && strcmp(filter->name, "FlateDecode") == 0;
+    int image = subtype != NULL && subtype->kind == object_name && strcmp(subtype->name, "Image") == 0;
+
+    text->items.count = 0;
+    if (flate && !image) {
+        int status = pdf_get_stream(pdf, object, &stream);
+        if (status != PDF_OK && status != PDF_ERR_SYNTAX) {
+            DS_LOG_ERROR("Failed to uncompress object %d %d: %s", object->object_number, object->generation_number, pdf_error_string(status));
+            return 1;
+        }
+
+        if (stream != NULL) {
+            pdf_append_text(text, stream->data, stream->len);
+        }
+        pdf_release_stream(pdf, stream);
+    }
+
+    if (json_writer_begin_object(writer) != 0 ||
+        json_writer_key(writer, "type") != 0 || json_writer_string(writer, image ? "image" : "stream", image ? 5 : 6) != 0 ||
+        json_writer_key(writer, "object") != 0 || json_writer_integer(writer, object->object_number) != 0 ||
+        json_writer_key(writer, "generation") != 0 || json_writer_integer(writer, object->generation_number) != 0 ||
+        json_writer_key(writer, "filter") != 0 ||
+        (filter != NULL && filter->kind == object_name ? json_writer_string(writer, filter->name, strlen(filter->name)) : json_writer_null(writer)) != 0 ||
+        json_writer_key(writer, "length") != 0 || json_writer_integer(writer, items[1].stream.len) != 0) {
+        return 1;
+    }
+
+    if (flate && !image &&
+        (json_writer_key(writer, "text") != 0 || json_writer_string(writer, (char *)text->items.items, text->items.count) != 0)) {
+        return 1;
+    }
+
+    return json_writer_end_object(writer) != 0 || json_writer_end_record(writer) != 0;
+}
+
+// Handle an object of a piped pdf as soon as it has been parsed
+static int pdf_document_streamed(void *context, pdf_t *pdf, indirect_object *object) {
+    pdf_document_stream_context *stream = context;
+
+    if (stream->writer != NULL && pdf_document_write_object(stream->writer, pdf, object, &stream->text) != 0) {
+        return 1;
+    }
+
+    if (stream->sink != NULL && pdf_extract_object(pdf, stream->sink, stream->prefix, object) != 0) {
+        return 1;
+    }
+
+    return 0;
+}
+
+// Parse a pdf from a file descriptor that can not seek, such as a pipe,
+// keeping options->window bytes of it in memory
+//
+// Every stream object is written as a record when write is given, and its
+// text and images are extracted into path, a directory or a tar archive when
+// archive is set, when path is given. The files are named after the base name
+// of name.
+PDFPARSERDEF int pdf_document_parse_fd(int fd, const char *name, const pdf_document_options *options, const char *path,
+                                       int archive, pdf_document_write_fn *write, void *context) {
+    int result = PDF_OK;
+    pdf_parse_options parse_options;
+    pdf_sink sink = { .fd = -1, .source = -1 };
+    pdf_document_output output = { .write = write, .context = context };
+    json_writer writer = {0};
+    pdf_document_stream_context stream = { .prefix = pdf_document_base_name(name) };
+
+    ds_string_builder_init(&stream.text);
+    pdf_document_parse_options(options, &parse_options);
+    if (path != NULL) {
+        if ((archive ? pdf_sink_open_archive(&sink, path) : pdf_sink_open_directory(&sink, path)) != 0) {
+            return_defer(PDF_ERR_IO);
+        }
+        stream.sink = &sink;
+    }
+
+    if (write != NULL) {
+        json_writer_init(&writer, pdf_document_write_output, &output);
+        stream.writer = &writer;
+    }
+
+    result = pdf_parse_fd(fd, &parse_options, pdf_document_streamed, &stream);
+    if (result == PDF_OK && write != NULL && json_writer_flush(&writer) != 0) {
+        result = PDF_ERR_IO;
+    }
+
+defer:
+    if (pdf_sink_close(&sink) != 0 && result == PDF_OK) {
+        result = PDF_ERR_IO;
+    }
+    json_writer_free(&writer);
+    ds_string_builder_free(&stream.text);
+    return result;
+}
+
+// Turn the phase timers and counters on or off for the whole process
+PDFPARSERDEF void pdf_document_stats_enable(int enable) {
+    pdf_stats_enable(enable);
+}
+
+// Print the phase timers and counters as a table on stderr. Builds with
+// DS_TRACK_ALLOCATIONS also report the allocation tracker
+PDFPARSERDEF void pdf_document_print_stats(void) {
+    pdf_stats stats;
+    pdf_stats_get(&stats);
+
+    fprintf(stderr, "%-12s %10s %12s %12s\n", "phase", "calls", "total ms", "avg us");
+    for (int i = 0; i < PDF_PHASE_COUNT; i++) {
+        double calls = stats.phase_calls[i] != 0 ? stats.phase_calls[i] : 1;
+        fprintf(stderr, "%-12s %10llu %12.3f %12.3f\n", pdf_phase_name(i), stats.phase_calls[i],
+                stats.phase_ns[i] / 1e6, stats.phase_ns[i] / calls / 1e3);
+    }
+
+    fprintf(stderr, "%-14s %8s\n", "counter", "value");
+    for (int i = 0; i < PDF_COUNTER_COUNT; i++) {
+        fprintf(stderr, "%-14s %8llu\n", pdf_counter_name(i), stats.counters[i]);
+    }
+#ifdef DS_TRACK_ALLOCATIONS
+    ds_track_dump();
+#endif // DS_TRACK_ALLOCATIONS
+}
+
+// Write the phase timers and counters as a stats record
+//
+// Returns 0 on success. Returns PDF_ERR_IO if write failed
+PDFPARSERDEF int pdf_document_write_stats(pdf_document_write_fn *write, void *context) {
+    int result = PDF_OK;
+    pdf_document_output output = { .write = write, .context = context };
+    json_writer writer;
+    pdf_stats stats;
+
+    pdf_stats_get(&stats);
+    json_writer_init(&writer, pdf_document_write_output, &output);
+    if (json_writer_begin_object(&writer) != 0 ||
+        json_writer_key(&writer, "type") != 0 || json_writer_string(&writer, "stats", 5) != 0 ||
+        json_writer_key(&writer, "phases") != 0 || json_writer_begin_object(&writer) != 0) {
+        return_defer(PDF_ERR_IO);
+    }
+
+    for (int i = 0; i < PDF_PHASE_COUNT; i++) {
+        if (json_writer_key(&writer, pdf_phase_name(i)) != 0 || json_writer_begin_object(&writer) != 0 ||
+            json_writer_key(&writer, "calls") != 0 || json_writer_integer(&writer, stats.phase_calls[i]) != 0 ||
+            json_writer_key(&writer, "ns") != 0 || json_writer_integer(&writer, stats.phase_ns[i]) != 0 ||
+            json_writer_end_object(&writer) != 0) {
+            return_defer(PDF_ERR_IO);
+        }
+    }
+
+    if (json_writer_end_object(&writer) != 0 || json_writer_key(&writer, "counters") != 0 || json_writer_begin_object(&writer) != 0) {
+        return_defer(PDF_ERR_IO);
+    }
+
+    for (int i = 0; i < PDF_COUNTER_COUNT; i++) {
+        if (json_writer_key(&writer, pdf_counter_name(i)) != 0 || json_writer_integer(&writer, stats.counters[i]) != 0) {
+            return_defer(PDF_ERR_IO);
+        }
+    }
+
+#ifdef DS_TRACK_ALLOCATIONS
+    ds_track_stats memory;
+    ds_track_get_stats(&memory);
+    if (json_writer_end_object(&writer) != 0 || json_writer_key(&writer, "memory") != 0 || json_writer_begin_object(&writer) != 0 ||
+        json_writer_key(&writer, "live") != 0 || json_writer_integer(&writer, memory.live) != 0 ||
+        json_writer_key(&writer, "peak") != 0 || json_writer_integer(&writer, memory.peak) != 0 ||
+        json_writer_key(&writer, "copy_bytes") != 0 || json_writer_integer(&writer, memory.copy_bytes) != 0) {
+        return_defer(PDF_ERR_IO);
+    }
+#endif // DS_TRACK_ALLOCATIONS
+
+    if (json_writer_end_object(&writer) != 0 || json_writer_end_object(&writer) != 0 ||
+        json_writer_end_record(&writer) != 0 || json_writer_flush(&writer) != 0) {
+        return_defer(PDF_ERR_IO);
+    }
+
+defer:
+    json_writer_free(&writer);
+    return result;
+}
+
+// Record the parse, decode and write phases of every thread for
+// pdf_document_trace_write
+PDFPARSERDEF void pdf_document_trace_enable(int enable) {
+    pdf_trace_enable(enable);
+}
+
+// Write the recorded phases into a Chrome trace file
+//
+// Returns 0 on success. Returns PDF_ERR_IO if the file could not be written
+PDFPARSERDEF int pdf_document_trace_write(const char *path, const char *process_name) {
+    return pdf_trace_write(path, process_name) != 0 ? PDF_ERR_IO : PDF_OK;
+}
+
+// Release the decoder state that the calling thread keeps between calls, a
+// thread calls it before it exits
+PDFPARSERDEF void pdf_document_release_thread(void) {
+    pdf_inflater_release();
+}
+
+// Release memory returned by the document functions, NULL is ignored
+PDFPARSERDEF void pdf_document_free(void *ptr) {
+    if (ptr != NULL) {
+        DS_FREE(NULL, ptr);
+    }
+}
@@ -0,0 +1,130 @@
+// DOCUMENTATION
+//
+// PDFPARSER.H
+//
+// The stable interface of libpdfparser. A document is an opaque handle that
+// owns the mapped file, the objects resolved so far and the decoded stream
+// cache, so a long running process can open many files in process and keep
+// its caches warm instead of forking a parser per file. Only standard C types
+// cross this interface, pdf.h and ds.h stay an implementation detail of the
+// library: it is built with hidden visibility and only the functions declared
+// here are exported.
+//
+// Functions that can fail return PDF_DOCUMENT_OK on success, otherwise one of
+// the PDF_DOCUMENT_ERR_* codes that pdf_document_error_string describes.
+// Memory handed to the caller is released with pdf_document_free.
+//
+// A document can be read from several threads at once, but it must not be
+// closed while another thread still uses it.
+#ifndef PDFPARSER_H
+#define PDFPARSER_H
+
+#ifndef PDFPARSERDEF
+#ifdef PDFPARSER_STATIC
+#define PDFPARSERDEF static
+#else
+#define PDFPARSERDEF extern __attribute__((visibility("default")))
+#endif
+#endif
+
+#define PDFPARSER_VERSION 1
+
+#define PDF_DOCUMENT_OK 0
+#define PDF_DOCUMENT_ERR_SYNTAX 1       // the file or the object is malformed
+#define PDF_DOCUMENT_ERR_DEPTH 2        // max_depth exceeded
+#define PDF_DOCUMENT_ERR_MEMORY 3       // max_memory exceeded or out of memory
+#define PDF_DOCUMENT_ERR_DECOMPRESSED 4 // max_decompressed exceeded
+#define PDF_DOCUMENT_ERR_TIMEOUT 5      // timeout_ms exceeded
+#define PDF_DOCUMENT_ERR_IO 6           // the file or the output could not be read or written
+
+// The parts of a page written into its record
+#define PDF_DOCUMENT_PAGE_TEXT 1   // the text shown by the content streams
+#define PDF_DOCUMENT_PAGE_IMAGES 2 // the image XObjects
+
+typedef struct pdf_document pdf_document;
+
+// Receives the ndjson records, returns 0 on success
+typedef int pdf_document_write_fn(void *context, const char *data, unsigned long len);
+
+// Limits for parsing untrusted files, 0 means no limit
+typedef struct pdf_document_options {
+    unsigned long max_depth;        // nesting of arrays and dictionaries
+    unsigned long max_memory;       // memory kept by the parsed objects
+    unsigned long max_decompressed; // output of a single stream filter
+    unsigned long timeout_ms;       // wall clock budget for parsing
+    unsigned long cache_bytes;      // budget of the decoded stream cache, 0 disables it
+    int repair;                     // rebuild the xref table by scanning the file
+    int eager;                      // parse every object up front instead of on demand
+    const char *index;              // sidecar index, reused when it matches the file and written otherwise
+    unsigned long window;           // bytes of a piped input kept in memory by pdf_document_parse_fd
+} pdf_document_options;
+
+// An indirect object of the document. The names point into the document and
+// stay valid until it is closed, they are NULL when the entry is missing.
+typedef struct pdf_document_object {
+    int object_number;
+    int generation_number;
+    int is_stream;
+    const char *type;     // the /Type name
+    const char *subtype;  // the /Subtype name
+    const char *filter;   // the /Filter name, the first one of a chain
+    unsigned long length; // bytes of the stream as stored in the file
+} pdf_document_object;
+
+// The structure of the file as it was read, and the counters of the decoded
+// stream cache
+typedef struct pdf_document_info {
+    long startxref;
+    int repaired;                  // the xref table was rebuilt from the objects
+    int catalog;                   // the trailer /Root is a dictionary
+    unsigned long trailer_count;   // keys of the trailer
+    unsigned long xref_count;      // rows of the xref table
+    unsigned long recovered_count; // rows the rebuild added or moved
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+    unsigned long cache_evictions;
+    unsigned long cache_bytes;
+    unsigned long cache_count;     // streams held by the cache
+} pdf_document_info;
+
+// A row of the xref table
+typedef struct pdf_document_xref {
+    int object_number;
+    int generation_number;
+    unsigned long offset;
+    char in_use; // 'n' for an object, 'f' for a free row
+} pdf_document_xref;
+
+PDFPARSERDEF void pdf_document_options_init(pdf_document_options *options);
+PDFPARSERDEF int pdf_document_open(const char *path, const pdf_document_options *options, pdf_document **document);
+PDFPARSERDEF int pdf_document_open_memory(const char *buffer, unsigned long buffer_len,
+                                          const pdf_document_options *options, pdf_document **document);
+PDFPARSERDEF void pdf_document_close(pdf_document *document);
+PDFPARSERDEF const char *pdf_document_error_string(int error);
+PDFPARSERDEF void pdf_document_get_info(pdf_document *document, pdf_document_info *info);
+PDFPARSERDEF const char *pdf_document_trailer_key(pdf_document *document, unsigned long index);
+PDFPARSERDEF int pdf_document_get_xref(pdf_document *document, unsigned long index, pdf_document_xref *row);
+PDFPARSERDEF int pdf_document_get_recovered(pdf_document *document, unsigned long index, pdf_document_xref *row);
+PDFPARSERDEF int pdf_document_get_object(pdf_document *document, int object_number, int generation_number,
+                                         pdf_document_object *object);
+PDFPARSERDEF int pdf_document_get_stream(pdf_document *document, int object_number, int generation_number,
+                                         char **data, unsigned long *data_len);
+PDFPARSERDEF unsigned long pdf_document_page_count(pdf_document *document);
+PDFPARSERDEF int pdf_document_get_page(pdf_document *document, unsigned long index, pdf_document_object *page);
+PDFPARSERDEF int pdf_document_page_text(pdf_document *document, unsigned long index, char **text,
+                                        unsigned long *text_len);
+PDFPARSERDEF int pdf_document_extract(pdf_document *document, const char *path, int archive, unsigned int threads);
+PDFPARSERDEF int pdf_document_write_metadata(pdf_document *document, pdf_document_write_fn *write, void *context);
+PDFPARSERDEF int pdf_document_write_pages(pdf_document *document, unsigned long first, unsigned long last,
+                                          unsigned int fields, pdf_document_write_fn *write, void *context);
+PDFPARSERDEF int pdf_document_parse_fd(int fd, const char *name, const pdf_document_options *options, const char *path,
+                                       int archive, pdf_document_write_fn *write, void *context);
+PDFPARSERDEF void pdf_document_stats_enable(int enable);
+PDFPARSERDEF void pdf_document_print_stats(void);
+PDFPARSERDEF int pdf_document_write_stats(pdf_document_write_fn *write, void *context);
+PDFPARSERDEF void pdf_document_trace_enable(int enable);
+PDFPARSERDEF int pdf_document_trace_write(const char *path, const char *process_name);
+PDFPARSERDEF void pdf_document_release_thread(void);
+PDFPARSERDEF void pdf_document_free(void *ptr);
+
+#endif // PDFPARSER_H